@@ -0,0 +1,631 @@
+﻿/****************************************************************************
+**
+** Copyright (C) 2013 Ken
+** All rights reserved.
+** Contact: ikenchina@gmail.com
+**
+****************************************************************************/
+
+/* 渲染和几何热点的微基准, 在offscreen平台上运行, 结果以JSON输出.
+ * Microbenchmarks for the rendering and geometry hot paths. Runs on the
+ * offscreen platform and prints JSON.
+ *
+ * build : compile together with ../kcolorcirclehsv.cpp (QtGui / QtWidgets)
+ * usage : kcolorcirclehsvbench [-o result.json] [sizes...]
+ */
+
+#include "../kcolorcirclehsv.h"
+
+#include <QtCore/QtGlobal>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QTextStream>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+#include <QtCore/QVector>
+#include <QtGui/QPainter>
+#if QT_VERSION >= 0x050000
+#include <QtWidgets/QApplication>
+#else
+#include <QtGui/QApplication>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+
+
+// ***************** 内存分配计数 allocation counting
+
+// 所有线程的分配都计入s_nAllocations, GUI线程的还计入s_nGuiAllocations;
+// 后者经KColorCircleHsv::setAllocationCounter交给控件, 定义了KCOLORCIRCLEHSV_ALLOC_STATS时
+// 控件只统计paintImage中的分配, 见paintAllocations()
+// every thread's allocations count in s_nAllocations and the GUI thread's
+// also in s_nGuiAllocations; the latter goes to the widget through
+// KColorCircleHsv::setAllocationCounter, and with KCOLORCIRCLEHSV_ALLOC_STATS
+// the widget counts only the allocations inside paintImage, see
+// paintAllocations()
+static QAtomicInt s_nAllocations;
+static QAtomicInt s_nGuiAllocations;
+static Qt::HANDLE volatile s_guiThread = 0;
+
+static inline void countAllocation()
+{
+	s_nAllocations.fetchAndAddRelaxed(1);
+	if (s_guiThread && s_guiThread == QThread::currentThreadId())
+		s_nGuiAllocations.fetchAndAddRelaxed(1);
+}
+
+void *operator new(size_t size)
+{
+	countAllocation();
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](size_t size)
+{
+	countAllocation();
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) throw()
+{
+	free(p);
+}
+
+void operator delete[](void *p) throw()
+{
+	free(p);
+}
+
+static int allocations()
+{
+	return s_nAllocations.fetchAndAddRelaxed(0);
+}
+
+static int guiAllocations()
+{
+	return s_nGuiAllocations.fetchAndAddRelaxed(0);
+}
+
+
+// kcolorcirclehsv.cpp中的几何算法
+// geometry algorithms from kcolorcirclehsv.cpp
+bool calTriangleContainsPt(const QPointF &p, const QPointF &a, const QPointF &b, const QPointF &c);
+QPointF p2triangleMinPos(const QPointF &p, const QPointF &pa, const QPointF &pb, const QPointF &pc);
+
+
+// 一次测量的结果
+// result of one measurement
+struct BenchResult
+{
+	const char *name;
+	int size;			// 控件边长, 0 : 与尺寸无关 widget side, 0 : size independent
+	int iterations;
+	double nsPerIter;
+	double nsPerPixel;	// 0 : 不适用 not applicable
+	double allocsPerIter;	// -1 : 没有计数 not counted
+};
+
+
+// 略带偏色的n^3 .cube文件
+// an n^3 .cube file with a slight colour cast
+static bool writeCube(const QString &fileName, int n)
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))
+		return false;
+	QTextStream out(&file);
+	out << "LUT_3D_SIZE " << n << "\n";
+	for (int b = 0; b < n; ++b)
+	{
+		for (int g = 0; g < n; ++g)
+		{
+			for (int r = 0; r < n; ++r)
+				out << r / (n - 1.0) * 0.95 << ' ' << g / (n - 1.0) << ' ' << b / (n - 1.0) * 0.9 << "\n";
+		}
+	}
+	return true;
+}
+
+
+// 以友元访问控件的私有渲染函数
+// reaches the widget's private rendering functions as a friend
+class KColorCircleHsvBench
+{
+public:
+	KColorCircleHsvBench(QTextStream *out) : m_out(out), m_bFirst(true) {}
+	
+	void runSize(int size);
+	void runGeometry();
+	void runDistribution();
+	void runScheduler();
+	void begin();
+	void end();
+	
+private:
+	// 被测函数的参数
+	// arguments for the measured functions
+	struct Context
+	{
+		KColorCircleHsv *w;
+		QImage *img;
+		const QVector<QPointF> *pts;
+		const QVector<QColor> *cols;
+		const QVector<KColorCircleHsv *> *widgets;
+		
+		Context(KColorCircleHsv *widget) : w(widget), img(0), pts(0), cols(0), widgets(0) {}
+	};
+	typedef void (*BenchFn)(const Context &ctx, int iteration);
+	
+	// 运行至少minMs毫秒, 至少minIter次
+	// runs for at least minMs milliseconds and minIter iterations
+	BenchResult measure(const char *name, int size, qint64 pixels, BenchFn fn, const Context &ctx,
+						int minIter = 5, qint64 minMs = 200);
+	void report(const BenchResult &r);
+	
+	static void createBackground(const Context &ctx, int i);
+	static void drawTriangle(const Context &ctx, int i);
+	static void drawTriangleNoAA(const Context &ctx, int i);
+	static void drawTriangleOklch(const Context &ctx, int i);
+	static void paintImageHue(const Context &ctx, int i);
+	static void paintImageSV(const Context &ctx, int i);
+	static void fullPaintEvent(const Context &ctx, int i);
+	static void colorFromPoint(const Context &ctx, int i);
+	static void pointFromColor(const Context &ctx, int i);
+	static void colorsFromPoints(const Context &ctx, int i);
+	static void pointsFromColors(const Context &ctx, int i);
+	static void triangleContains(const Context &ctx, int i);
+	static void triangleMinPos(const Context &ctx, int i);
+	static void distributionBuild(const Context &ctx, int i);
+	static void distributionUpdate(const Context &ctx, int i);
+	static void resizeAll(const Context &ctx, int i);
+	
+	QTextStream *m_out;
+	bool m_bFirst;
+};
+
+
+BenchResult KColorCircleHsvBench::measure(const char *name, int size, qint64 pixels, BenchFn fn,
+										  const Context &ctx, int minIter, qint64 minMs)
+{
+	fn(ctx, 0);	// warm up
+	
+	int iter = 0;
+	QElapsedTimer timer;
+#ifdef KCOLORCIRCLEHSV_ALLOC_STATS
+	// 每次调用前清掉上一次paintImage的结果; 结果是每次paintImage的平均
+	// clear the previous paintImage's count before each call; the result is
+	// the average per paintImage call
+	qint64 allocs = 0;
+	int paints = 0;
+	timer.start();
+	while (iter < minIter || timer.elapsed() < minMs)
+	{
+		ctx.w->m_nPaintAllocations = -1;
+		fn(ctx, iter++);
+		if (ctx.w->paintAllocations() >= 0)
+		{
+			allocs += ctx.w->paintAllocations();
+			++paints;
+		}
+	}
+	qint64 ns = timer.nsecsElapsed();
+	double allocsPerIter = paints ? (double) allocs / paints : -1.0;
+#else
+	int allocs = allocations();
+	timer.start();
+	while (iter < minIter || timer.elapsed() < minMs)
+		fn(ctx, iter++);
+	qint64 ns = timer.nsecsElapsed();
+	allocs = allocations() - allocs;
+	double allocsPerIter = (double) allocs / iter;
+#endif
+	
+	BenchResult r;
+	r.name = name;
+	r.size = size;
+	r.iterations = iter;
+	r.nsPerIter = (double) ns / iter;
+	r.nsPerPixel = pixels > 0 ? r.nsPerIter / pixels : 0.0;
+	r.allocsPerIter = allocsPerIter;
+	report(r);
+	return r;
+}
+
+
+void KColorCircleHsvBench::begin()
+{
+	*m_out << "{\n  \"benchmarks\": [\n";
+}
+
+
+void KColorCircleHsvBench::end()
+{
+	*m_out << "\n  ]\n}\n";
+	m_out->flush();
+}
+
+
+void KColorCircleHsvBench::report(const BenchResult &r)
+{
+	if (!m_bFirst)
+		*m_out << ",\n";
+	m_bFirst = false;
+	
+	char line[512];
+	snprintf(line, sizeof(line),
+			 "    {\"name\": \"%s\", \"size\": %d, \"iterations\": %d, \"ns_per_iter\": %.1f, "
+			 "\"ns_per_pixel\": %.4f, \"allocs_per_iter\": %.2f}",
+			 r.name, r.size, r.iterations, r.nsPerIter, r.nsPerPixel, r.allocsPerIter);
+	*m_out << line;
+	m_out->flush();
+}
+
+
+// ##### 渲染函数 rendering
+
+void KColorCircleHsvBench::createBackground(const Context &ctx, int)
+{
+	// 不经过共享缓存, 每次都渲染
+	// bypass the shared cache so every call renders
+	KColorCircleHsv *w = ctx.w;
+	KColorCircleHsv::renderRing(w->contentsRect().size(), w->m_nOuterRadius,
+								w->m_nOuterRadius - w->m_dOuterInnerWidth,
+								w->palette().window().color().rgb());
+}
+
+void KColorCircleHsvBench::drawTriangle(const Context &ctx, int)
+{
+	QColor hue;
+	hue.setHsv(0, 255, 255);
+	KColorCircleHsv::drawTriangle(ctx.img, ctx.w->pa, ctx.w->pb, ctx.w->pc, hue, 0, -1,
+								  &ctx.w->m_triangleScratch);
+}
+
+// 自适应画质降低后的三角形
+// the triangle once adaptive quality has dropped anti-aliasing
+void KColorCircleHsvBench::drawTriangleNoAA(const Context &ctx, int)
+{
+	QColor hue;
+	hue.setHsv(0, 255, 255);
+	KColorCircleHsv::drawTriangle(ctx.img, ctx.w->pa, ctx.w->pb, ctx.w->pc, hue, 0, -1,
+								  &ctx.w->m_triangleScratch, false);
+}
+
+// OKLCH模型的三角形, 每个像素都从OKLab转换
+// the OKLCH model's triangle, every pixel converted from OKLab
+void KColorCircleHsvBench::drawTriangleOklch(const Context &ctx, int)
+{
+	QColor hue = KColorCircleHsv::apexColor(0, KColorCircleHsv::ModelOklch);
+	KColorCircleHsv::drawTriangle(ctx.img, ctx.w->pa, ctx.w->pb, ctx.w->pc, hue, 0, -1,
+								  &ctx.w->m_triangleScratch, true, KColorCircleHsv::ModelOklch);
+}
+
+// 色相改变后的一帧 : 三角形层 + 叠加层
+// one frame after a hue change : triangle layer + overlays
+void KColorCircleHsvBench::paintImageHue(const Context &ctx, int i)
+{
+	KColorCircleHsv *w = ctx.w;
+	w->m_nCurrentHue = (i * 7) % 360;
+	w->calRadian(w->m_nCurrentHue);
+	w->m_dSelectorPos = w->pointFromHsv(w->m_hsv);
+	w->markDirty();
+	w->paintImage();
+}
+
+// 只移动s v定位圈的一帧
+// one frame that only moves the s v selector
+void KColorCircleHsvBench::paintImageSV(const Context &ctx, int i)
+{
+	KColorCircleHsv *w = ctx.w;
+	qreal t = (i % 64) / 64.0;
+	w->m_dSelectorPos = w->pb + (w->pc - w->pb) * 0.5 + (w->pa - w->pb) * (t * 0.5);
+	w->markDirty();
+	w->paintImage();
+}
+
+// 完整的paintEvent : 色相改变后重画并贴到屏幕
+// full paintEvent : redraw after a hue change and blit
+void KColorCircleHsvBench::fullPaintEvent(const Context &ctx, int i)
+{
+	KColorCircleHsv *w = ctx.w;
+	w->m_nCurrentHue = (i * 7) % 360;
+	w->calRadian(w->m_nCurrentHue);
+	w->markDirty();
+	w->repaint();
+}
+
+
+void KColorCircleHsvBench::runSize(int size)
+{
+	KColorCircleHsv w;
+	// 同步渲染, 计时的是渲染本身
+	// synchronous rendering, so the timings cover the rendering itself
+	w.setThreadedRendering(false);
+	w.resize(size, size);
+	w.show();
+	QApplication::processEvents();
+	// 不让后台预热影响计时
+	// keep the background warm-up out of the timings
+	QThreadPool::globalInstance()->waitForDone();
+	
+	const qint64 pixels = (qint64) w.contentsRect().width() * w.contentsRect().height();
+	Context ctx(&w);
+	
+	measure("createBackground", size, pixels, createBackground, ctx);
+	
+	QImage img(w.contentsRect().size(), QImage::Format_RGB32);
+	img.fill(0);
+	ctx.img = &img;
+	QRect bounds = w.triangleRect();
+	measure("drawTriangle", size, (qint64) bounds.width() * bounds.height() / 2, drawTriangle, ctx);
+	measure("drawTriangle_noaa", size, (qint64) bounds.width() * bounds.height() / 2, drawTriangleNoAA, ctx);
+	measure("drawTriangle_oklch", size, (qint64) bounds.width() * bounds.height() / 2, drawTriangleOklch, ctx);
+	
+	// 其他输出格式: 同一个三角形直接画成RGB565(抖动)和RGBA64
+	// other output formats: the same triangle drawn straight into RGB565 (dithered) and RGBA64
+	QImage img565(img.size(), QImage::Format_RGB16);
+	img565.fill(0);
+	ctx.img = &img565;
+	measure("drawTriangle_rgb565", size, (qint64) bounds.width() * bounds.height() / 2, drawTriangle, ctx);
+#if QT_VERSION >= 0x050c00
+	QImage img64(img.size(), QImage::Format_RGBX64);
+	img64.fill(0);
+	ctx.img = &img64;
+	measure("drawTriangle_rgba64", size, (qint64) bounds.width() * bounds.height() / 2, drawTriangle, ctx);
+#endif
+	ctx.img = &img;
+	
+	measure("paintImage_hue", size, pixels, paintImageHue, ctx);
+	measure("paintImage_sv", size, pixels, paintImageSV, ctx);
+	measure("paintEvent", size, pixels, fullPaintEvent, ctx);
+	
+	// OKLCH模型: 同样的帧, 三角形块由缓存和预热提供
+	// the OKLCH model: the same frames, triangle tiles from the cache and warm-up
+	w.setColorModel(KColorCircleHsv::ModelOklch);
+	QApplication::processEvents();
+	QThreadPool::globalInstance()->waitForDone();
+	measure("paintImage_hue_oklch", size, pixels, paintImageHue, ctx);
+	measure("paintEvent_oklch", size, pixels, fullPaintEvent, ctx);
+	w.setColorModel(KColorCircleHsv::ModelHsv);
+	
+	// RGB565输出: 圆环, 三角形块和叠加层都是16位
+	// RGB565 output: the ring, triangle tiles and overlays are all 16-bit
+	w.setOutputFormat(QImage::Format_RGB16);
+	QApplication::processEvents();
+	QThreadPool::globalInstance()->waitForDone();
+	measure("paintImage_hue_rgb565", size, pixels, paintImageHue, ctx);
+	w.setOutputFormat(QImage::Format_RGB32);
+	
+	// 色彩管理: 17^3的.cube, 圆环只变换一次, 每帧只变换三角形和叠加层
+	// colour management: a 17^3 .cube, the ring is transformed once and each
+	// frame only transforms the triangle and overlays
+	if (writeCube("kcolorcirclehsvbench.cube", 17) && w.setDisplayLut("kcolorcirclehsvbench.cube"))
+	{
+		measure("paintImage_hue_lut", size, pixels, paintImageHue, ctx);
+		measure("paintImage_sv_lut", size, pixels, paintImageSV, ctx);
+		w.setDisplayLut(QString());
+	}
+	QFile::remove("kcolorcirclehsvbench.cube");
+	
+	// 低内存模式: 每帧展开索引圆环, 三角形直接画进带缓冲
+	// low-memory mode: every frame unpacks the indexed ring and draws the
+	// triangle straight into the band buffer
+	w.setLowMemoryMode(true);
+	QApplication::processEvents();
+	measure("paintEvent_lowmem", size, pixels, fullPaintEvent, ctx);
+	
+	w.hide();
+	QThreadPool::globalInstance()->waitForDone();
+}
+
+
+// ##### 几何函数, 每次调用 geometry, per call
+
+void KColorCircleHsvBench::colorFromPoint(const Context &ctx, int i)
+{
+	volatile QRgb sink = ctx.w->colorFromPoint(ctx.pts->at(i & 1023)).rgb();
+	(void) sink;
+}
+
+void KColorCircleHsvBench::pointFromColor(const Context &ctx, int i)
+{
+	volatile qreal sink = ctx.w->pointFromColor(ctx.cols->at(i & 1023)).x();
+	(void) sink;
+}
+
+// 批量, 每次1024个
+// batch, 1024 per call
+void KColorCircleHsvBench::colorsFromPoints(const Context &ctx, int)
+{
+	static QColor out[1024];
+	ctx.w->colorsFromPoints(ctx.pts->constData(), out, 1024);
+}
+
+void KColorCircleHsvBench::pointsFromColors(const Context &ctx, int)
+{
+	static QPointF out[1024];
+	ctx.w->pointsFromColors(ctx.cols->constData(), out, 1024);
+}
+
+void KColorCircleHsvBench::triangleContains(const Context &ctx, int i)
+{
+	volatile bool sink = calTriangleContainsPt(ctx.pts->at(i & 1023), ctx.w->pa, ctx.w->pb, ctx.w->pc);
+	(void) sink;
+}
+
+void KColorCircleHsvBench::triangleMinPos(const Context &ctx, int i)
+{
+	volatile qreal sink = p2triangleMinPos(ctx.pts->at(i & 1023), ctx.w->pa, ctx.w->pb, ctx.w->pc).x();
+	(void) sink;
+}
+
+
+void KColorCircleHsvBench::runGeometry()
+{
+	KColorCircleHsv w;
+	w.setThreadedRendering(false);
+	w.resize(800, 800);
+	w.show();
+	QApplication::processEvents();
+	QThreadPool::globalInstance()->waitForDone();
+	
+	srand(1);
+	QVector<QPointF> pts(1024);
+	QVector<QColor> cols(1024);
+	for (int i = 0; i < 1024; ++i)
+	{
+		pts[i] = QPointF(rand() % 800, rand() % 800);
+		cols[i].setHsv(w.m_nCurrentHue, rand() % 256, rand() % 256);
+	}
+	
+	Context ctx(&w);
+	ctx.pts = &pts;
+	ctx.cols = &cols;
+	const int minIter = 100000;
+	measure("colorFromPoint", 0, 0, colorFromPoint, ctx, minIter);
+	measure("pointFromColor", 0, 0, pointFromColor, ctx, minIter);
+	measure("colorsFromPoints", 0, 1024, colorsFromPoints, ctx, minIter / 1024);
+	measure("pointsFromColors", 0, 1024, pointsFromColors, ctx, minIter / 1024);
+	measure("calTriangleContainsPt", 0, 0, triangleContains, ctx, minIter);
+	measure("p2triangleMinPos", 0, 0, triangleMinPos, ctx, minIter);
+	
+	w.hide();
+}
+
+
+// ##### 颜色分布 colour distribution
+
+void KColorCircleHsvBench::distributionBuild(const Context &ctx, int)
+{
+	ctx.w->setDistributionImage(*ctx.img);
+}
+
+// 改变一块512x512
+// one changed 512x512 block
+void KColorCircleHsvBench::distributionUpdate(const Context &ctx, int i)
+{
+	ctx.w->updateDistributionImage(*ctx.img, QRect((i * 512) % ctx.img->width(), 0, 512, 512));
+}
+
+
+void KColorCircleHsvBench::runDistribution()
+{
+	KColorCircleHsv w;
+	w.setThreadedRendering(false);
+	w.resize(800, 800);
+	
+	// 8M像素的渐变图
+	// an 8 megapixel gradient image
+	QImage img(4096, 2048, QImage::Format_RGB32);
+	for (int y = 0; y < img.height(); ++y)
+	{
+		QRgb *line = reinterpret_cast<QRgb *>(img.scanLine(y));
+		for (int x = 0; x < img.width(); ++x)
+			line[x] = qRgb(x & 0xff, y & 0xff, (x ^ y) & 0xff);
+	}
+	
+	Context ctx(&w);
+	ctx.img = &img;
+	const qint64 pixels = (qint64) img.width() * img.height();
+	measure("distribution_build", 0, pixels, distributionBuild, ctx);
+	measure("distribution_update", 0, 512 * 512, distributionUpdate, ctx);
+}
+
+
+// ##### 渲染调度 render scheduling
+
+// 所有控件改变尺寸后处理一轮事件: 隐藏的控件推迟到显示出来
+// every widget resized, then one round of events: hidden widgets are
+// deferred until they are exposed
+void KColorCircleHsvBench::resizeAll(const Context &ctx, int i)
+{
+	const int side = (i & 1) ? 420 : 400;
+	for (int k = 0; k < ctx.widgets->size(); ++k)
+		ctx.widgets->at(k)->resize(side, side);
+	QApplication::processEvents();
+}
+
+
+void KColorCircleHsvBench::runScheduler()
+{
+	// 24个控件, 只有4个可见(其余像在后台标签页中)
+	// 24 widgets, only 4 of them visible (the rest as if in background tabs)
+	QVector<KColorCircleHsv *> widgets;
+	for (int k = 0; k < 24; ++k)
+	{
+		KColorCircleHsv *w = new KColorCircleHsv;
+		w->setThreadedRendering(false);
+		w->resize(400, 400);
+		if (k < 4)
+			w->show();
+		widgets.append(w);
+	}
+	QApplication::processEvents();
+	QThreadPool::globalInstance()->waitForDone();
+	
+	Context ctx(widgets.first());
+	ctx.widgets = &widgets;
+	measure("resizeAll_24_visible4", 0, 0, resizeAll, ctx);
+	
+	QThreadPool::globalInstance()->waitForDone();
+	qDeleteAll(widgets);
+}
+
+
+int main(int argc, char **argv)
+{
+	if (qgetenv("QT_QPA_PLATFORM").isEmpty())
+		qputenv("QT_QPA_PLATFORM", "offscreen");
+	QApplication app(argc, argv);
+	s_guiThread = QThread::currentThreadId();
+	KColorCircleHsv::setAllocationCounter(guiAllocations);
+	
+	QString outName;
+	QVector<int> sizes;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "-o") && i + 1 < argc)
+			outName = QString::fromLocal8Bit(argv[++i]);
+		else if (atoi(argv[i]) > 0)
+			sizes.append(atoi(argv[i]));
+	}
+	if (sizes.isEmpty())
+	{
+		static const int defaults[] = { 100, 200, 400, 800, 1600, 3200, 4000 };
+		for (unsigned i = 0; i < sizeof(defaults) / sizeof(defaults[0]); ++i)
+			sizes.append(defaults[i]);
+	}
+	
+	QFile file;
+	if (outName.isEmpty())
+		file.open(stdout, QIODevice::WriteOnly);
+	else
+	{
+		file.setFileName(outName);
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		{
+			fprintf(stderr, "cannot open %s\n", qPrintable(outName));
+			return 1;
+		}
+	}
+	
+	QTextStream out(&file);
+	KColorCircleHsvBench bench(&out);
+	bench.begin();
+	for (int i = 0; i < sizes.size(); ++i)
+		bench.runSize(sizes.at(i));
+	bench.runGeometry();
+	bench.runDistribution();
+	bench.runScheduler();
+	bench.end();
+	return 0;
+}
@@ -2,12 +2,136 @@
 
 #include "kcolorcirclehsv.h"
 #include <math>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <QtCore/QCache>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDebug>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QMap>
+#include <QtCore/QMutex>
+#include <QtCore/QRunnable>
+#include <QtCore/QSet>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+#include <QtCore/QWaitCondition>
+#include <QtGui/QMouseEvent>
+#include <QtGui/QPainter>
+#if QT_VERSION >= 0x050000
+#include <QtGui/QWindow>
+#endif
+#if QT_VERSION >= 0x050100
+#include <QtCore/QLockFile>
+#include <QtCore/QSaveFile>
+#endif
+#if QT_VERSION >= 0x050300
+#include <QtCore/QLoggingCategory>
+#endif
+#if QT_VERSION >= 0x050c00
+#include <QtGui/QRgba64>
+#endif
+#if QT_VERSION >= 0x060200
+#include <QtGui/QRgbaFloat>
+#endif
+#if QT_VERSION >= 0x050e00
+#include <QtGui/QColorSpace>
+#include <QtGui/QColorTransform>
+#endif
+
+// SSE2为x86-64基线, AVX2运行时检测
+// SSE2 is the x86-64 baseline, AVX2 is detected at runtime
+#if !defined(HSV_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define HSV_HAVE_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+	&& (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HSV_HAVE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+
+// 调试: 统计paintImage中的内存分配次数, 见paintAllocations(). 库不替换operator new,
+// 计数器由程序(如bench)用setAllocationCounter提供
+// debug: count the heap allocations made inside paintImage, see
+// paintAllocations(). The library never replaces operator new, the program
+// (e.g. the bench) supplies the counter through setAllocationCounter
+#ifdef KCOLORCIRCLEHSV_ALLOC_STATS
+static int (*s_allocationCounter)() = 0;
+
+// 在作用域内统计分配次数, 结束时写入*result; 没有计数器时不改变*result
+// counts allocations within the scope into *result; *result is left alone
+// without a counter
+class KHsvAllocationScope
+{
+public:
+	KHsvAllocationScope(int *result)
+		: m_result(result), m_nStart(s_allocationCounter ? s_allocationCounter() : 0) {}
+	~KHsvAllocationScope()
+	{
+		if (!s_allocationCounter)
+			return;
+		*m_result = s_allocationCounter() - m_nStart;
+		if (*m_result > 0)
+			qDebug("KColorCircleHsv: %d heap allocations in paintImage", *m_result);
+	}
+	
+private:
+	int *m_result;
+	int m_nStart;
+};
+#endif
 
 
 #define HSVPI 3.1415926535897932
 #define HSVTWOPI (2.0*HSVPI)
 
 
+// ***************** Qt版本 Qt versions
+
+// 鼠标事件在控件中的位置
+// a mouse event's position in the widget
+static inline QPointF eventPos(const QMouseEvent *e)
+{
+#if QT_VERSION >= 0x060000
+	return e->position();
+#elif QT_VERSION >= 0x050000
+	return e->localPos();
+#else
+	return e->posF();
+#endif
+}
+
+// 区域中的矩形 (Qt 5.8起QRegion可以直接遍历, rects()在Qt 6中已删除)
+// the rectangles of a region (QRegion is iterable from Qt 5.8 and rects()
+// is gone in Qt 6)
+static QVector<QRect> regionRects(const QRegion &region)
+{
+#if QT_VERSION >= 0x050800
+	QVector<QRect> rects;
+	rects.reserve(region.rectCount());
+	for (QRegion::const_iterator it = region.begin(); it != region.end(); ++it)
+		rects.append(*it);
+	return rects;
+#else
+	return region.rects();
+#endif
+}
+
+// 图像的字节数 (byteCount在Qt 6中已删除)
+// an image's size in bytes (byteCount is gone in Qt 6)
+static inline int imageBytes(const QImage &image)
+{
+#if QT_VERSION >= 0x050a00
+	return int(image.sizeInBytes());
+#else
+	return image.byteCount();
+#endif
+}
+
+
 // ***************** 几何算法 geometry algorithms
 
 // 勾股定理
@@ -194,447 +318,6693 @@ qreal radianAt(const QPointF &pos, const QRect &rect)
 }
 
 
-KColorCircleHsv::KColorCircleHsv(QWidget *parent)
-	: QWidget(parent), m_imgBG(sizeHint(), QImage::Format_RGB32), m_selMode(None)
-{
-	setSizePolicy(QSizePolicy::Minimum, QSizePolicy::Minimum);
-	setFocusPolicy(Qt::StrongFocus);
-	setMinimumSize(100, 100);
-	m_bNeedUpdateBackground = true;
-	m_nCurrentHue = 0;
-	calRadian(m_nCurrentHue);
-	QColor tmp;
-	tmp.setHsv(0, 0, 0);
-	setColor(tmp);
-}
-
+// ***************** 扫描线填充 scanline filling
 
-KColorCircleHsv::~KColorCircleHsv()
+// 定点数(16.16)通道步进, 通道值 = v >> 16
+// fixed-point (16.16) channel stepping, channel value = v >> 16
+struct SpanStep
 {
-}
+	int r, g, b;
+	int dr, dg, db;
+};
 
+typedef void (*SpanFiller)(QRgb *dst, int count, const SpanStep &st);
 
-void KColorCircleHsv::calRadian(int hue)
+// 把定点数像素打包成QRgb, 通道在[0, 0xffffff]内
+// pack fixed-point channels in [0, 0xffffff] into a QRgb
+static inline QRgb packFixed(int r, int g, int b)
 {
-	m_radA = (((360 - hue) * HSVTWOPI) / 360.0);
-	m_radA += HSVPI / 2.0;
-	if (m_radA > HSVTWOPI)
-		m_radA -= HSVTWOPI;
-	
-	m_radB = m_radA + HSVTWOPI/3;
-	m_radC = m_radB + HSVTWOPI/3;
-	
-	if (m_radB > HSVTWOPI)
-		m_radB -= HSVTWOPI;
-	if (m_radC > HSVTWOPI)
-		m_radC -= HSVTWOPI;
-	
-	calVertexPoint();
+	return 0xff000000u | (uint(r) & 0xff0000u) | ((uint(g) >> 8) & 0xff00u) | (uint(b) >> 16);
 }
 
-// 计算顶点 (calculate vertext)
-// a : 颜色顶点
-// b : s = 0 v = 0
-// c : s = 0 v = 255
-void KColorCircleHsv::calVertexPoint()
+static void fillSpanScalar(QRgb *dst, int count, const SpanStep &st)
 {
-	qreal cx = (qreal) contentsRect().center().x();
-	qreal cy = (qreal) contentsRect().center().y();
-	int innerRadius = m_nOuterRadius - m_dOuterInnerWidth;
-	pa = QPointF(cx + (cos(m_radA) * innerRadius), cy - (sin(m_radA) * innerRadius));
-	pb = QPointF(cx + (cos(m_radB) * innerRadius), cy - (sin(m_radB) * innerRadius));
-	pc = QPointF(cx + (cos(m_radC) * innerRadius), cy - (sin(m_radC) * innerRadius));
-	pd = QPointF(pa.x() + cos(m_radA) * m_dOuterInnerWidth, 
-				 pa.y() - (sin(m_radA) * m_dOuterInnerWidth));
-	
+	int r = st.r;
+	int g = st.g;
+	int b = st.b;
+	for (int i = 0; i < count; ++i)
+	{
+		*dst++ = packFixed(r, g, b);
+		r += st.dr;
+		g += st.dg;
+		b += st.db;
+	}
 }
 
-
-//  背景图，仅画圆环
-// drawing background image
-void KColorCircleHsv::createBackground()
+#ifdef HSV_HAVE_SSE2
+// 每次迭代4个像素
+// 4 pixels per iteration
+static void fillSpanSSE2(QRgb *dst, int count, const SpanStep &st)
 {
-	qreal innerRadius = m_nOuterRadius - m_dOuterInnerWidth;
-	m_imgBG = QImage(contentsRect().size(), QImage::Format_RGB32);
-	QPainter p(&m_imgBG);
-	p.setRenderHint(QPainter::Antialiasing);
-	p.fillRect(m_imgBG.rect(), palette().background());
+	const __m128i alpha = _mm_set1_epi32(0xff000000);
+	const __m128i maskR = _mm_set1_epi32(0x00ff0000);
+	const __m128i maskG = _mm_set1_epi32(0x0000ff00);
+	__m128i r = _mm_set_epi32(st.r + 3 * st.dr, st.r + 2 * st.dr, st.r + st.dr, st.r);
+	__m128i g = _mm_set_epi32(st.g + 3 * st.dg, st.g + 2 * st.dg, st.g + st.dg, st.g);
+	__m128i b = _mm_set_epi32(st.b + 3 * st.db, st.b + 2 * st.db, st.b + st.db, st.b);
+	const __m128i dr = _mm_set1_epi32(4 * st.dr);
+	const __m128i dg = _mm_set1_epi32(4 * st.dg);
+	const __m128i db = _mm_set1_epi32(4 * st.db);
 	
-	QConicalGradient gradient(m_imgBG.rect().center(), 90);
-	QColor color;
-	// 色环：360～0：red-green-blue-red逆时针，90度为起点
-	for (qreal i = 0; i <= 1.0; i += 0.1) 
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
 	{
-		color.setHsv(int(360.0 - (i * 360.0)), 255, 255);	//一个纯色相pure hue
-		gradient.setColorAt(i, color);
+		__m128i px = _mm_or_si128(alpha, _mm_and_si128(r, maskR));
+		px = _mm_or_si128(px, _mm_and_si128(_mm_srli_epi32(g, 8), maskG));
+		px = _mm_or_si128(px, _mm_srli_epi32(b, 16));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), px);
+		r = _mm_add_epi32(r, dr);
+		g = _mm_add_epi32(g, dg);
+		b = _mm_add_epi32(b, db);
 	}
-
-	// 画环形
-	QRectF innerRadiusRect(m_imgBG.rect().center().x() - innerRadius, m_imgBG.rect().center().y() - innerRadius,
-							innerRadius * 2 + 1, innerRadius * 2 + 1);
-	QRectF outerRadiusRect(m_imgBG.rect().center().x() - m_nOuterRadius, m_imgBG.rect().center().y() - m_nOuterRadius,
-							m_nOuterRadius * 2 + 1, m_nOuterRadius * 2 + 1);
-	QPainterPath path;
-	path.addEllipse(innerRadiusRect);
-	path.addEllipse(outerRadiusRect);
-
-	p.save();
-	p.setClipPath(path);
-	p.fillRect(m_imgBG.rect(), gradient);
-	p.restore();
 	
+	SpanStep tail = st;
+	tail.r += i * st.dr;
+	tail.g += i * st.dg;
+	tail.b += i * st.db;
+	fillSpanScalar(dst + i, count - i, tail);
 }
+#endif
 
-
-// 鼠标坐标改变
-// mouse point changed
-bool KColorCircleHsv::pointChanged(QPointF point)
+#ifdef HSV_HAVE_AVX2
+// 每次迭代8个像素
+// 8 pixels per iteration
+__attribute__((target("avx2")))
+static void fillSpanAVX2(QRgb *dst, int count, const SpanStep &st)
 {
-	bool newColor = false;
-	if (m_selMode == SelCircle)
-	{
-		// 更新顶点
-		// m_radA is hue: 选中点平面坐标系的弧度
-		m_radA = radianAt(point, contentsRect());
-		// b is black: m_radA/120, , 对逆时针旋转120度，
-		m_radB = m_radA + HSVTWOPI / 3.0;
-		m_radC = m_radB + HSVTWOPI / 3.0;
-		if (m_radB > HSVTWOPI) m_radB -= HSVTWOPI;
-		if (m_radC > HSVTWOPI) m_radC -= HSVTWOPI;
-		qreal am = m_radA - HSVPI/2;
-		if (am < 0) am += HSVTWOPI;
-		int te = (int) (((am) * 360.0) / (HSVTWOPI));
-		m_nCurrentHue = 360 - te;
-		
-		int h,s,v;
-		m_CurrentColor.getHsv(&h, &s, &v);
-		if (m_nCurrentHue != h) 
-		{
-			newColor = true;
-			m_CurrentColor.setHsv(m_nCurrentHue, s, v);
-		}
-		calVertexPoint();
-		m_dSelectorPos = pointFromColor(m_CurrentColor);
-	}
-	else if(m_selMode == SelTriangle)
+	const __m256i alpha = _mm256_set1_epi32(0xff000000);
+	const __m256i maskR = _mm256_set1_epi32(0x00ff0000);
+	const __m256i maskG = _mm256_set1_epi32(0x0000ff00);
+	const __m256i lane = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i r = _mm256_add_epi32(_mm256_set1_epi32(st.r), _mm256_mullo_epi32(lane, _mm256_set1_epi32(st.dr)));
+	__m256i g = _mm256_add_epi32(_mm256_set1_epi32(st.g), _mm256_mullo_epi32(lane, _mm256_set1_epi32(st.dg)));
+	__m256i b = _mm256_add_epi32(_mm256_set1_epi32(st.b), _mm256_mullo_epi32(lane, _mm256_set1_epi32(st.db)));
+	const __m256i dr = _mm256_set1_epi32(8 * st.dr);
+	const __m256i dg = _mm256_set1_epi32(8 * st.dg);
+	const __m256i db = _mm256_set1_epi32(8 * st.db);
+	
+	int i = 0;
+	for (; i + 8 <= count; i += 8)
 	{
-		// 是否在三角形内
-		QPointF fpos = point;
-		if (!calTriangleContainsPt(point, pa, pb, pc))
-			fpos = p2triangleMinPos(point, pa, pb, pc);
-		
-		m_dSelectorPos = fpos;
-		QColor col = colorFromPoint(m_dSelectorPos);
-		if (col != m_CurrentColor) 
-		{
-			int h, s, v;
-			col.getHsv(&h, &s, &v);
-			m_CurrentColor.setHsv(m_nCurrentHue, s, v);
-			newColor = true;
-		}
+		__m256i px = _mm256_or_si256(alpha, _mm256_and_si256(r, maskR));
+		px = _mm256_or_si256(px, _mm256_and_si256(_mm256_srli_epi32(g, 8), maskG));
+		px = _mm256_or_si256(px, _mm256_srli_epi32(b, 16));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), px);
+		r = _mm256_add_epi32(r, dr);
+		g = _mm256_add_epi32(g, dg);
+		b = _mm256_add_epi32(b, db);
 	}
 	
-	return newColor;
+	SpanStep tail = st;
+	tail.r += i * st.dr;
+	tail.g += i * st.dg;
+	tail.b += i * st.db;
+	fillSpanScalar(dst + i, count - i, tail);
 }
+#endif
 
-void KColorCircleHsv::mouseMoveEvent(QMouseEvent *e)
+// 运行时选择最快的实现; 静态初始化可能早于libgcc自己的CPU检测, 先初始化
+// pick the fastest implementation at runtime; static initialisation may run
+// before libgcc's own CPU detection, so initialise it first
+static SpanFiller detectSpanFiller()
 {
-	if ((e->buttons() & Qt::LeftButton) == 0)
-		return;
-	
-	QPointF fpos = e->posF();
-	bool newColor = this->pointChanged(fpos);
-	if (newColor)
-		emit colorChanged(m_CurrentColor);
-	
-	update();
+#ifdef HSV_HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return fillSpanAVX2;
+#endif
+#ifdef HSV_HAVE_SSE2
+	return fillSpanSSE2;
+#else
+	return fillSpanScalar;
+#endif
 }
 
+static const SpanFiller s_spanFiller = detectSpanFiller();
 
-void KColorCircleHsv::mousePressEvent(QMouseEvent *e)
+// 浮点起点和增量转为定点数, 并保证整段都落在[0, 255]内
+// convert a float start/delta to fixed point, clamped so the whole span stays in [0, 255]
+static inline void fixedChannel(qreal v, qreal delta, int count, int *start, int *step)
 {
-	if (e->button() != Qt::LeftButton)
-		return;
-	QPointF fPos = e->posF();
-	qreal rad = p2pdist(fPos, contentsRect().center());
-	if (rad > (m_nOuterRadius - m_dOuterInnerWidth))
-	{
-		m_selMode = SelCircle;
-	}
-	else
-	{
-		// 是否在三角形内
-		if (calTriangleContainsPt(fPos, pa, pb, pc))
-			m_selMode = SelTriangle;
-		else
-			m_selMode = None;
-	}
-	
-	bool newColor = this->pointChanged(fPos);
-	if (newColor)
-		emit colorChanged(m_CurrentColor);
-	
-	update();
+	const qint64 maxv = 0xffffff;
+	qint64 s = qBound(qint64(0), (qint64) floor(v * 65536.0), maxv);
+	qint64 d = qRound64(delta * 65536.0);
+	qint64 e = s + d * (count - 1);
+	if (count > 1 && (e < 0 || e > maxv))
+		d = (qBound(qint64(0), e, maxv) - s) / (count - 1);
+	*start = (int) s;
+	*step = (int) d;
 }
 
-void KColorCircleHsv::mouseReleaseEvent(QMouseEvent *e)
+// 填充一段水平渐变, 与浮点累加结果误差不超过1; (x, y)为dst[0]在图像中的位置
+// fill a horizontal gradient span, within 1 of the float accumulator result;
+// (x, y) is where dst[0] sits in the image
+template <class Dst>
+static void fillSpan(typename Dst::Pixel *dst, int count, qreal r, qreal g, qreal b,
+					qreal rdelta, qreal gdelta, qreal bdelta, int x, int y)
 {
-	if (e->buttons() & Qt::LeftButton)
-		m_selMode = None;
+	if (count <= 0)
+		return;
+	SpanStep st;
+	fixedChannel(r, rdelta, count, &st.r, &st.dr);
+	fixedChannel(g, gdelta, count, &st.g, &st.dg);
+	fixedChannel(b, bdelta, count, &st.b, &st.db);
+	Dst::fill(dst, count, st, x, y);
 }
 
-void KColorCircleHsv::keyPressEvent(QKeyEvent *e)
+
+// 三角形的一条边, distance为到边的有向距离(像素), 三角形内部为正
+// one edge of the triangle, distance is the signed distance in pixels to it,
+// positive inside the triangle
+struct TriangleEdge
 {
-	switch (e->key()) 
+	qreal nx, ny, c;
+	
+	void setup(const QPointF &p, const QPointF &q, const QPointF &opposite)
 	{
-		case Qt::Key_Left:
-		{
-			--m_nCurrentHue;
-			if (m_nCurrentHue < 0) m_nCurrentHue += 360;
-			int h,s,v;
-			m_CurrentColor.getHsv(&h, &s, &v);
-			QColor tmp;
-			tmp.setHsv(m_nCurrentHue, s, v);
-			setColor(tmp);
-			emit colorChanged(m_CurrentColor);
-		}
-		break;
-		case Qt::Key_Right:
+		nx = p.y() - q.y();
+		ny = q.x() - p.x();
+		qreal len = sqrt(nx * nx + ny * ny);
+		if (len > 0)
 		{
-			++m_nCurrentHue;
-			if (m_nCurrentHue > 359) m_nCurrentHue -= 360;
-			int h,s,v;
-			m_CurrentColor.getHsv(&h, &s, &v);
-			QColor tmp;
-			tmp.setHsv(m_nCurrentHue, s, v);
-			setColor(tmp);
-			emit colorChanged(m_CurrentColor);
+			nx /= len;
+			ny /= len;
 		}
-		break;
-		case Qt::Key_Up:
+		c = -(nx * p.x() + ny * p.y());
+		if (distance(opposite.x(), opposite.y()) < 0)
 		{
-			int h,s,v;
-			m_CurrentColor.getHsv(&h, &s, &v);
-			QColor tmp;
-			if (v > 5) 
-				v -= 5;
-			else 
-				v = 0;
-			tmp.setHsv(m_nCurrentHue, s, v);
-			setColor(tmp);
-			emit colorChanged(m_CurrentColor);
+			nx = -nx;
+			ny = -ny;
+			c = -c;
 		}
-		break;
-		case Qt::Key_Down:
+	}
+	
+	qreal distance(qreal x, qreal y) const
+	{
+		return nx * x + ny * y + c;
+	}
+	
+	// 把第y行上 distance >= t 的x范围与[*left, *right]求交
+	// intersect [*left, *right] with the x range of row y where distance >= t
+	void clip(qreal y, qreal t, qreal *left, qreal *right) const
+	{
+		qreal k = ny * y + c;
+		if (qAbs(nx) < 1e-9)
 		{
-			int h,s,v;
-			m_CurrentColor.getHsv(&h, &s, &v);
-			QColor tmp;
-			if (v < 250) 
-				v += 5;
-			else 
-				v = 255;
-			tmp.setHsv(m_nCurrentHue, s, v);
-			setColor(tmp);
-			emit colorChanged(m_CurrentColor);
+			if (k < t)
+				*right = *left - 1;
+			return;
 		}
-		break;
-	};
-}
+		qreal x = (t - k) / nx;
+		if (nx > 0)
+			*left = qMax(*left, x);
+		else
+			*right = qMin(*right, x);
+	}
+};
 
+static inline int clampChannel(qreal v)
+{
+	return v <= 0 ? 0 : (v >= 255 ? 255 : (int) v);
+}
 
-void KColorCircleHsv::resizeEvent(QResizeEvent *)
+// 按覆盖率a (0..256)把不透明的fg混合到dst上, 包括alpha通道:
+// RGB32上结果不透明, 透明的预乘tile上得到预乘的fg * a
+// blend opaque fg onto dst by coverage a (0..256), alpha included: opaque on
+// RGB32, premultiplied fg * a on a transparent premultiplied tile
+static inline QRgb blendCoverage(QRgb fg, QRgb dst, int a)
 {
-	m_nOuterRadius = (contentsRect().width() - 1) / 2;
-	if ((contentsRect().height() - 1) / 2 < m_nOuterRadius)
-		m_nOuterRadius = (contentsRect().height() - 1) / 2;
-	
-	m_nPenWidth = (int) floor(m_nOuterRadius / 50.0);
-	m_nSVEllipseSize = (int) floor(m_nOuterRadius / 12.5);
-	m_dOuterInnerWidth = m_nOuterRadius / 5.0;
-	
-	calVertexPoint();
-	
-	m_dSelectorPos = pointFromColor(m_CurrentColor);
-	m_bNeedUpdateBackground = true;
-	paintImage();
-	update();
+	int r = qRed(dst) + (((qRed(fg) - qRed(dst)) * a) >> 8);
+	int g = qGreen(dst) + (((qGreen(fg) - qGreen(dst)) * a) >> 8);
+	int b = qBlue(dst) + (((qBlue(fg) - qBlue(dst)) * a) >> 8);
+	int alpha = qAlpha(dst) + (((255 - qAlpha(dst)) * a) >> 8);
+	return qRgba(r, g, b, alpha);
 }
 
 
-void KColorCircleHsv::paintEvent(QPaintEvent *e)
+// ***************** 像素格式 pixel formats
+
+/* 输出像素格式策略, 编译时选定: 圆环和三角形直接写目标格式, 贴图时不再转换.
+ *   RGB32      : 原来的路径
+ *   RGB565     : 4x4有序抖动, 渐变按定点数的精确值量化, 不先截成8位
+ *   RGBA64     : 16位通道, 三角形的渐变不量化到8位 (Qt 5.12)
+ *   RGBA32FPx4 : 浮点通道 (Qt 6.2)
+ * 不透明图层用Pixel, 三角形tile (预乘, 三角形外透明)用TilePixel; RGB565的tile是
+ * ARGB32预乘, 贴到底图上时才抖动. 策略的接口 (x, y为图像中的位置, 只给抖动用):
+ *   fromRgb(rgb)              : 单色(背景), 与QImage::fill(QColor)一致
+ *   dither(rgb, x, y)         : 渐变中的8位颜色(圆环)
+ *   fill(dst, n, st, x, y)    : 定点数渐变(SpanStep)
+ *   fromFloat(r, g, b, x, y)  : [0, 1]的sRGB
+ *   blend(fg, dst, a, x, y)   : 按覆盖率a混合不透明的fg, 同blendCoverage
+ *   blendFloat(rgb, dst, a, x, y) : 同上, fg为[0, 1]的浮点sRGB (只有RGBA64和RGBA32FPx4,
+ *                                   圆环和三角形的边不量化到8位)
+ *   over(src, dst, x, y)      : 预乘的ARGB32画到dst上(SourceOver)
+ *   overTile(src, dst, x, y)  : tile的像素画到dst上(SourceOver)
+ */
+/* Output pixel format policies, chosen at compile time: the ring and the
+ * triangle write the target format directly and nothing is converted at blit
+ * time.
+ *   RGB32      : the original path
+ *   RGB565     : 4x4 ordered dithering, gradients are quantised from their
+ *                exact fixed-point value rather than truncated to 8 bits first
+ *   RGBA64     : 16-bit channels, triangle gradients are never quantised to
+ *                8 bits (Qt 5.12)
+ *   RGBA32FPx4 : float channels (Qt 6.2)
+ * Opaque layers hold Pixel and triangle tiles (premultiplied, transparent
+ * outside the triangle) hold TilePixel; RGB565 tiles are premultiplied ARGB32
+ * and only dithered when composited onto the base. The policy interface (x, y
+ * are the position in the image, only used for dithering):
+ *   fromRgb(rgb)              : a flat colour (background), as QImage::fill(QColor)
+ *   dither(rgb, x, y)         : an 8-bit colour within a gradient (the ring)
+ *   fill(dst, n, st, x, y)    : a fixed-point gradient (SpanStep)
+ *   fromFloat(r, g, b, x, y)  : sRGB in [0, 1]
+ *   blend(fg, dst, a, x, y)   : opaque fg blended by coverage a, as blendCoverage
+ *   blendFloat(rgb, dst, a, x, y) : the same with fg as float sRGB in [0, 1]
+ *                                   (RGBA64 and RGBA32FPx4 only, so ring and
+ *                                   triangle edges are not quantised to 8 bits)
+ *   over(src, dst, x, y)      : premultiplied ARGB32 over dst (SourceOver)
+ *   overTile(src, dst, x, y)  : a tile pixel over dst (SourceOver)
+ */
+
+// 预乘的src画到不透明的dst上(SourceOver)
+// premultiplied src over opaque dst (SourceOver)
+static inline QRgb overPixel(QRgb src, QRgb dst)
 {
-	QPainter p(this);
-	p.setRenderHint(QPainter::Antialiasing);
-	if (e->rect().intersects(contentsRect()))
-		p.setClipRegion(e->region().intersect(contentsRect()));
-	
-	if (m_CurrentColor != m_OldColor)
-	{
-		paintImage();
-		m_OldColor = m_CurrentColor;
-	}
-	p.drawImage(contentsRect().topLeft(), m_buf);
+	const int a = qAlpha(src);
+	if (a == 255)
+		return src;
+	if (a == 0)
+		return dst;
+	const int ia = 255 - a;
+	return qRgb(qRed(src) + (qRed(dst) * ia + 127) / 255,
+				qGreen(src) + (qGreen(dst) * ia + 127) / 255,
+				qBlue(src) + (qBlue(dst) * ia + 127) / 255);
 }
 
-
-// 缓冲图
-// cache image
-void KColorCircleHsv::paintImage()
+struct KHsvFormatRgb32
 {
-	if (m_bNeedUpdateBackground) 
+	typedef QRgb Pixel;
+	typedef QRgb TilePixel;
+	
+	static inline Pixel fromRgb(QRgb rgb)
 	{
-		createBackground();
-		m_bNeedUpdateBackground = false;
+		return 0xff000000u | rgb;
 	}
 	
-	m_buf = m_imgBG.copy();
-	
-	// ########  三角形
-	// pure hue
-	QColor hueColor;
-	hueColor.setHsv(m_nCurrentHue, 255, 255);
-	drawTriangle(&m_buf, pa, pb, pc, hueColor);
+	static inline Pixel dither(QRgb rgb, int, int)
+	{
+		return rgb;
+	}
 	
-	//QPixmap pix = QPixmap::fromImage(m_buf);
-	QPainter painter(&m_buf);
-	painter.setRenderHint(QPainter::Antialiasing);
+	static inline void fill(Pixel *dst, int count, const SpanStep &st, int, int)
+	{
+		s_spanFiller(dst, count, st);
+	}
 	
-	// ##### 画hue定位线
-	int ri, gi, bi;
-	hueColor.getRgb(&ri, &gi, &bi);
-	// 混合RGB通道 ：red*30% + green*59% + blue*11%=255
-	// 参考http://www.gimp.org/tutorials/Color2BW/
-	if ((ri * 30) + (gi * 59) + (bi * 11) > 12800)
-		painter.setPen(QPen(Qt::black, m_nPenWidth));
-	else
-		painter.setPen(QPen(Qt::white, m_nPenWidth));
-	// 反色效果
-	//painter.setPen(QPen(QColor(255-ri, 255- gi, 255-bi), m_nPenWidth, Qt::SolidLine, Qt::RoundCap));
+	static inline Pixel fromFloat(float r, float g, float b, int, int)
+	{
+		return qRgb((int) (r * 255.0f + 0.5f), (int) (g * 255.0f + 0.5f), (int) (b * 255.0f + 0.5f));
+	}
 	
-//	painter.drawEllipse((int) (pd.x() - m_nSVEllipseSize / 2.0),
-//			(int) (pd.y() - m_nSVEllipseSize / 2.0),
-//			m_nSVEllipseSize, m_nSVEllipseSize);
-	painter.drawLine(pa, pd);
+	static inline Pixel blend(QRgb fg, Pixel dst, int a, int, int)
+	{
+		return blendCoverage(fg, dst, a);
+	}
 	
-	// ##### 画s v定位圈
-	painter.setPen(QPen(QColor(255-ri, 255- gi, 255-bi), m_nPenWidth, Qt::SolidLine, Qt::RoundCap));
+	static inline Pixel over(QRgb src, Pixel dst, int, int)
+	{
+		return overPixel(src, dst);
+	}
 	
-	painter.drawEllipse(QRectF(m_dSelectorPos.x() - m_nSVEllipseSize / 2.0,
-							   m_dSelectorPos.y() - m_nSVEllipseSize / 2.0,
-							   m_nSVEllipseSize + 0.5, m_nSVEllipseSize + 0.5));
-}
+	static inline Pixel overTile(TilePixel src, Pixel dst, int, int)
+	{
+		return overPixel(src, dst);
+	}
+};
 
+// 4x4 Bayer矩阵
+// 4x4 Bayer matrix
+static const uchar s_bayer4[4][4] =
+{
+	{ 0, 8, 2, 10 },
+	{ 12, 4, 14, 6 },
+	{ 3, 11, 1, 9 },
+	{ 15, 7, 13, 5 }
+};
 
-// 画三角形SV
-// TODO    --->  消除锯齿(jagged)
-void KColorCircleHsv::drawTriangle(QImage *buf, const QPointF &pa,
-								const QPointF &pb, const QPointF &pc,
-								const QColor &color)
+struct KHsvFormatRgb565
 {
-	Vertex aa(color, pa);
-	Vertex bb(Qt::black, pb);
-	Vertex cc(Qt::white, pc);
+	typedef quint16 Pixel;
+	typedef QRgb TilePixel;
 	
-	// 冒泡sort
-	// Y : aa < bb < cc.
-	if (aa.point.y() > bb.point.y())
-		std::swap(aa, bb);
-	if (aa.point.y() > cc.point.y())
-		std::swap(aa, cc);
-	if (bb.point.y() > cc.point.y())
-		std::swap(bb, cc);
+	static inline Pixel pack(int r, int g, int b)
+	{
+		return quint16((r << 11) | (g << 5) | b);
+	}
 	
-	qreal aabbydist = bb.point.y() - aa.point.y();
-	qreal aaccydist = cc.point.y() - aa.point.y();
-	qreal bbccydist = cc.point.y() - bb.point.y();
-	qreal aabbxdist = bb.point.x() - aa.point.x();
-	qreal aaccxdist = cc.point.x() - aa.point.x();
-	qreal bbccxdist = cc.point.x() - bb.point.x();
-
-	// 左三角： bb.x < aa.x : 
-	bool lefty = aabbxdist < 0;
+	// 与Qt的RGB32到RGB16转换一致(截断)
+	// matches Qt's RGB32 to RGB16 conversion (truncating)
+	static inline Pixel fromRgb(QRgb rgb)
+	{
+		return pack(qRed(rgb) >> 3, qGreen(rgb) >> 2, qBlue(rgb) >> 3);
+	}
 	
-	QVarLengthArray<DoubleColor, 640> leftColors;
-	QVarLengthArray<DoubleColor, 640> rightColors;
-	QVarLengthArray<qreal, 640> leftX; 
-	QVarLengthArray<qreal, 640> rightX; 
-	int nSize = int(floor(cc.point.y() + 1));
-	leftColors.resize(nSize);
-	rightColors.resize(nSize);
-	leftX.resize(nSize);
-	rightX.resize(nSize);
+	// (x, y)处的阈值, 16.16定点数的(0, 1)
+	// threshold at (x, y), (0, 1) in 16.16 fixed point
+	static inline int threshold(int x, int y)
+	{
+		return (s_bayer4[y & 3][x & 3] * 2 + 1) << 11;
+	}
 	
-	DoubleColor source;
-	DoubleColor dest;
-	qreal r, g, b;
-	qreal rdelta, gdelta, bdelta;
-	qreal x;
-	qreal xdelta;
-	int y1, y2;
-
-	// 
-	x = aa.point.x();
-	source = aa.color;
-	dest = cc.color;
-	r = source.r;
-	g = source.g;
-	b = source.b;
-	y1 = (int) floor(aa.point.y());
-	y2 = (int) floor(cc.point.y());
+	// v为16.16定点数的0～255, 缩放到0～levels, 加上阈值后截断
+	// v is 0 to 255 in 16.16 fixed point, scaled to 0 to levels and truncated
+	// after adding the threshold
+	static inline int quantize(int v, int levels, int t)
+	{
+		return qMin(levels, ((((v >> 8) * (levels * 257)) >> 8) + t) >> 16);
+	}
 	
-	// delta
-	xdelta = aaccxdist / aaccydist;
-	rdelta = (dest.r - r) / aaccydist;
-	gdelta = (dest.g - g) / aaccydist;
-	bdelta = (dest.b - b) / aaccydist;
+	static inline Pixel ditherFixed(int r, int g, int b, int x, int y)
+	{
+		const int t = threshold(x, y);
+		return pack(quantize(r, 31, t), quantize(g, 63, t), quantize(b, 31, t));
+	}
 	
-	// 线性渐变
-	int y;
-	for (y = y1; y < y2; ++y) 
+	static inline Pixel dither(QRgb rgb, int x, int y)
 	{
-		if (lefty) 
+		return ditherFixed(qRed(rgb) << 16, qGreen(rgb) << 16, qBlue(rgb) << 16, x, y);
+	}
+	
+	static void fill(Pixel *dst, int count, const SpanStep &st, int x, int y)
+	{
+		int i = 0;
+		int r = st.r;
+		int g = st.g;
+		int b = st.b;
+#ifdef HSV_HAVE_SSE2
+		// 每次4个像素, 4个连续的x正好是阈值矩阵的一行
+		// 4 pixels at a time, 4 consecutive x are exactly one row of the matrix
+		const __m128 t = _mm_set_ps(threshold(x + 3, y) / 65536.0f, threshold(x + 2, y) / 65536.0f,
+									threshold(x + 1, y) / 65536.0f, threshold(x, y) / 65536.0f);
+		const __m128 k5 = _mm_set1_ps(31.0f / (255.0f * 65536.0f));
+		const __m128 k6 = _mm_set1_ps(63.0f / (255.0f * 65536.0f));
+		__m128i vr = _mm_set_epi32(r + 3 * st.dr, r + 2 * st.dr, r + st.dr, r);
+		__m128i vg = _mm_set_epi32(g + 3 * st.dg, g + 2 * st.dg, g + st.dg, g);
+		__m128i vb = _mm_set_epi32(b + 3 * st.db, b + 2 * st.db, b + st.db, b);
+		const __m128i dr = _mm_set1_epi32(4 * st.dr);
+		const __m128i dg = _mm_set1_epi32(4 * st.dg);
+		const __m128i db = _mm_set1_epi32(4 * st.db);
+		const __m128 max5 = _mm_set1_ps(31.0f);
+		const __m128 max6 = _mm_set1_ps(63.0f);
+		for (; i + 4 <= count; i += 4)
 		{
-			rightColors[y] = DoubleColor(r, g, b);
-			rightX[y] = x;
+			__m128i qr = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(vr), k5), t), max5));
+			__m128i qg = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(vg), k6), t), max6));
+			__m128i qb = _mm_cvttps_epi32(_mm_min_ps(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(vb), k5), t), max5));
+			__m128i px = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(qr, 11), _mm_slli_epi32(qg, 5)), qb);
+			// 有符号饱和打包前移到有符号范围
+			// shifted into the signed range for the saturating pack
+			px = _mm_sub_epi32(px, _mm_set1_epi32(0x8000));
+			px = _mm_xor_si128(_mm_packs_epi32(px, px), _mm_set1_epi16(short(0x8000)));
+			_mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), px);
+			vr = _mm_add_epi32(vr, dr);
+			vg = _mm_add_epi32(vg, dg);
+			vb = _mm_add_epi32(vb, db);
 		}
-		else
+		r += i * st.dr;
+		g += i * st.dg;
+		b += i * st.db;
+#endif
+		for (; i < count; ++i)
 		{
-			leftColors[y] = DoubleColor(r, g, b);
-			leftX[y] = x;
+			dst[i] = ditherFixed(r, g, b, x + i, y);
+			r += st.dr;
+			g += st.dg;
+			b += st.db;
 		}
-		
-		r += rdelta;
-		g += gdelta;
-		b += bdelta;
-		x += xdelta;
 	}
 	
-	x = aa.point.x();
-	source = aa.color;
-	dest = bb.color;
-	r = source.r;
-	g = source.g;
-	b = source.b;
-	y1 = (int) floor(aa.point.y());
-	y2 = (int) floor(bb.point.y());
-	
-	xdelta = aabbxdist / aabbydist;
-	rdelta = (dest.r - r) / aabbydist;
-	gdelta = (dest.g - g) / aabbydist;
-	bdelta = (dest.b - b) / aabbydist;
-	
-	for (y = y1; y < y2; ++y)
+	static inline Pixel fromFloat(float r, float g, float b, int x, int y)
+	{
+		const float scale = 255.0f * 65536.0f;
+		return ditherFixed((int) (r * scale), (int) (g * scale), (int) (b * scale), x, y);
+	}
+	
+	// 展开到8位
+	// expanded to 8 bits
+	static inline QRgb toRgb(Pixel p)
+	{
+		int r = p >> 11, g = (p >> 5) & 0x3f, b = p & 0x1f;
+		return qRgb((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2));
+	}
+	
+	// 混合结果为8.8定点数, 保留小数再抖动
+	// blends come out as 8.8 fixed point, the fraction is kept for dithering
+	static inline Pixel blend(QRgb fg, Pixel dst, int a, int x, int y)
+	{
+		if (a >= 256)
+			return dither(fg, x, y);
+		const QRgb d = toRgb(dst);
+		return ditherFixed(((qRed(d) << 8) + (qRed(fg) - qRed(d)) * a) << 8,
+						   ((qGreen(d) << 8) + (qGreen(fg) - qGreen(d)) * a) << 8,
+						   ((qBlue(d) << 8) + (qBlue(fg) - qBlue(d)) * a) << 8, x, y);
+	}
+	
+	static inline Pixel over(QRgb src, Pixel dst, int x, int y)
+	{
+		const int a = qAlpha(src);
+		if (a == 0)
+			return dst;
+		if (a == 255)
+			return dither(src, x, y);
+		const QRgb d = toRgb(dst);
+		const int ia = 255 - a;
+		return ditherFixed((qRed(src) << 16) + qRed(d) * ia * 257,
+						   (qGreen(src) << 16) + qGreen(d) * ia * 257,
+						   (qBlue(src) << 16) + qBlue(d) * ia * 257, x, y);
+	}
+	
+	static inline Pixel overTile(TilePixel src, Pixel dst, int x, int y)
+	{
+		return over(src, dst, x, y);
+	}
+};
+
+#if QT_VERSION >= 0x050c00
+struct KHsvFormatRgba64
+{
+	typedef QRgba64 Pixel;
+	typedef QRgba64 TilePixel;
+	
+	static inline Pixel fromRgb(QRgb rgb)
+	{
+		return QRgba64::fromArgb32(0xff000000u | rgb);
+	}
+	
+	static inline Pixel dither(QRgb rgb, int, int)
+	{
+		return fromRgb(rgb);
+	}
+	
+	// 16.16定点数的0～255到0～65535
+	// 0 to 255 in 16.16 fixed point to 0 to 65535
+	static inline quint16 widen(int v)
+	{
+		return quint16(qMin(65535, ((v >> 8) * 257 + 128) >> 8));
+	}
+	
+	static inline void fill(Pixel *dst, int count, const SpanStep &st, int, int)
+	{
+		int r = st.r;
+		int g = st.g;
+		int b = st.b;
+		for (int i = 0; i < count; ++i)
+		{
+			dst[i] = QRgba64::fromRgba64(widen(r), widen(g), widen(b), 65535);
+			r += st.dr;
+			g += st.dg;
+			b += st.db;
+		}
+	}
+	
+	static inline Pixel fromFloat(float r, float g, float b, int, int)
+	{
+		return QRgba64::fromRgba64(quint16(r * 65535.0f + 0.5f), quint16(g * 65535.0f + 0.5f),
+								   quint16(b * 65535.0f + 0.5f), 65535);
+	}
+	
+	static inline quint16 mix(int d, int f, int a)
+	{
+		return quint16(d + (((f - d) * a) >> 8));
+	}
+	
+	static inline Pixel blend(QRgb fg, Pixel dst, int a, int, int)
+	{
+		const QRgba64 f = fromRgb(fg);
+		return QRgba64::fromRgba64(mix(dst.red(), f.red(), a), mix(dst.green(), f.green(), a),
+								   mix(dst.blue(), f.blue(), a), mix(dst.alpha(), 65535, a));
+	}
+	
+	static inline Pixel blendFloat(const float *rgb, Pixel dst, int a, int x, int y)
+	{
+		const QRgba64 f = fromFloat(rgb[0], rgb[1], rgb[2], x, y);
+		return QRgba64::fromRgba64(mix(dst.red(), f.red(), a), mix(dst.green(), f.green(), a),
+								   mix(dst.blue(), f.blue(), a), mix(dst.alpha(), 65535, a));
+	}
+	
+	static inline Pixel overTile(TilePixel src, Pixel dst, int, int)
+	{
+		const uint a = src.alpha();
+		if (a == 65535)
+			return src;
+		if (a == 0)
+			return dst;
+		const uint ia = 65535 - a;
+		return QRgba64::fromRgba64(quint16(src.red() + (dst.red() * ia + 32767) / 65535),
+								   quint16(src.green() + (dst.green() * ia + 32767) / 65535),
+								   quint16(src.blue() + (dst.blue() * ia + 32767) / 65535), 65535);
+	}
+	
+	static inline Pixel over(QRgb src, Pixel dst, int x, int y)
+	{
+		return overTile(QRgba64::fromArgb32(src), dst, x, y);
+	}
+};
+#endif
+
+#if QT_VERSION >= 0x060200
+struct KHsvFormatRgbaF
+{
+	typedef QRgbaFloat32 Pixel;
+	typedef QRgbaFloat32 TilePixel;
+	
+	static inline Pixel make(float r, float g, float b, float a)
+	{
+		Pixel p = { r, g, b, a };
+		return p;
+	}
+	
+	static inline Pixel fromRgb(QRgb rgb)
+	{
+		return make(qRed(rgb) / 255.0f, qGreen(rgb) / 255.0f, qBlue(rgb) / 255.0f, 1.0f);
+	}
+	
+	static inline Pixel dither(QRgb rgb, int, int)
+	{
+		return fromRgb(rgb);
+	}
+	
+	static inline void fill(Pixel *dst, int count, const SpanStep &st, int, int)
+	{
+		const float scale = 1.0f / (255.0f * 65536.0f);
+		for (int i = 0; i < count; ++i)
+		{
+			dst[i] = make(qMin(1.0f, (st.r + i * st.dr) * scale), qMin(1.0f, (st.g + i * st.dg) * scale),
+						  qMin(1.0f, (st.b + i * st.db) * scale), 1.0f);
+		}
+	}
+	
+	static inline Pixel fromFloat(float r, float g, float b, int, int)
+	{
+		return make(r, g, b, 1.0f);
+	}
+	
+	static inline Pixel blend(QRgb fg, Pixel dst, int a, int, int)
+	{
+		const float f = a / 256.0f;
+		return make(dst.r + (qRed(fg) / 255.0f - dst.r) * f, dst.g + (qGreen(fg) / 255.0f - dst.g) * f,
+					dst.b + (qBlue(fg) / 255.0f - dst.b) * f, dst.a + (1.0f - dst.a) * f);
+	}
+	
+	static inline Pixel blendFloat(const float *rgb, Pixel dst, int a, int, int)
+	{
+		const float f = a / 256.0f;
+		return make(dst.r + (rgb[0] - dst.r) * f, dst.g + (rgb[1] - dst.g) * f,
+					dst.b + (rgb[2] - dst.b) * f, dst.a + (1.0f - dst.a) * f);
+	}
+	
+	static inline Pixel overTile(TilePixel src, Pixel dst, int, int)
+	{
+		const float ia = 1.0f - src.a;
+		return make(src.r + dst.r * ia, src.g + dst.g * ia, src.b + dst.b * ia, 1.0f);
+	}
+	
+	static inline Pixel over(QRgb src, Pixel dst, int x, int y)
+	{
+		return overTile(make(qRed(src) / 255.0f, qGreen(src) / 255.0f, qBlue(src) / 255.0f,
+							 qAlpha(src) / 255.0f), dst, x, y);
+	}
+};
+#endif
+
+// 图像格式对应的策略; 其它格式按RGB32处理
+// the policy of an image format; other formats are treated as RGB32
+enum KHsvPixelKind
+{
+	KHsvPixelRgb32,
+	KHsvPixelRgb565,
+	KHsvPixelRgba64,
+	KHsvPixelRgbaF
+};
+
+static inline KHsvPixelKind pixelKind(QImage::Format format)
+{
+	switch (format)
+	{
+	case QImage::Format_RGB16:
+		return KHsvPixelRgb565;
+#if QT_VERSION >= 0x050c00
+	case QImage::Format_RGBX64:
+	case QImage::Format_RGBA64:
+	case QImage::Format_RGBA64_Premultiplied:
+		return KHsvPixelRgba64;
+#endif
+#if QT_VERSION >= 0x060200
+	case QImage::Format_RGBX32FPx4:
+	case QImage::Format_RGBA32FPx4:
+	case QImage::Format_RGBA32FPx4_Premultiplied:
+		return KHsvPixelRgbaF;
+#endif
+	default:
+		return KHsvPixelRgb32;
+	}
+}
+
+// 不透明图层的格式和三角形tile的格式
+// the format of the opaque layers and of the triangle tiles
+static QImage::Format layerFormat(QImage::Format format)
+{
+	switch (pixelKind(format))
+	{
+	case KHsvPixelRgb565:
+		return QImage::Format_RGB16;
+#if QT_VERSION >= 0x050c00
+	case KHsvPixelRgba64:
+		return QImage::Format_RGBX64;
+#endif
+#if QT_VERSION >= 0x060200
+	case KHsvPixelRgbaF:
+		return QImage::Format_RGBX32FPx4;
+#endif
+	default:
+		return QImage::Format_RGB32;
+	}
+}
+
+static QImage::Format tileFormat(QImage::Format format)
+{
+	switch (pixelKind(format))
+	{
+#if QT_VERSION >= 0x050c00
+	case KHsvPixelRgba64:
+		return QImage::Format_RGBA64_Premultiplied;
+#endif
+#if QT_VERSION >= 0x060200
+	case KHsvPixelRgbaF:
+		return QImage::Format_RGBA32FPx4_Premultiplied;
+#endif
+	default:
+		return QImage::Format_ARGB32_Premultiplied;
+	}
+}
+
+/* 按图像格式调用模板fn<策略>args, 例如
+ *   HSV_WITH_FORMAT(buf->format(), strokeLineFormat, (buf, clip, ...));
+ */
+/* calls the template fn<policy>args for an image format, e.g.
+ *   HSV_WITH_FORMAT(buf->format(), strokeLineFormat, (buf, clip, ...));
+ */
+#if QT_VERSION >= 0x050c00
+#define HSV_FORMAT_CASE_RGBA64(fn, args) case KHsvPixelRgba64: fn<KHsvFormatRgba64> args; break;
+#else
+#define HSV_FORMAT_CASE_RGBA64(fn, args)
+#endif
+#if QT_VERSION >= 0x060200
+#define HSV_FORMAT_CASE_RGBAF(fn, args) case KHsvPixelRgbaF: fn<KHsvFormatRgbaF> args; break;
+#else
+#define HSV_FORMAT_CASE_RGBAF(fn, args)
+#endif
+#define HSV_WITH_FORMAT(format, fn, args) \
+	switch (pixelKind(format)) \
+	{ \
+	case KHsvPixelRgb565: fn<KHsvFormatRgb565> args; break; \
+	HSV_FORMAT_CASE_RGBA64(fn, args) \
+	HSV_FORMAT_CASE_RGBAF(fn, args) \
+	default: fn<KHsvFormatRgb32> args; break; \
+	}
+
+
+// ***************** SV坐标变换 SV transform
+
+KColorCircleHsv::SvTransform::SvTransform()
+	: ox(0.0), oy(0.0), e1x(0.0), e1y(0.0), e2x(0.0), e2y(0.0),
+	  i11(0.0), i12(0.0), i21(0.0), i22(0.0)
+{
+}
+
+// 顶点改变时计算一次
+// computed once whenever the vertices change
+void KColorCircleHsv::SvTransform::setup(const QPointF &a, const QPointF &b, const QPointF &c)
+{
+	ox = b.x();
+	oy = b.y();
+	e1x = c.x() - b.x();
+	e1y = c.y() - b.y();
+	e2x = a.x() - c.x();
+	e2y = a.y() - c.y();
+	qreal det = e1x * e2y - e2x * e1y;
+	if (qAbs(det) < 1e-12)
+	{
+		i11 = i12 = i21 = i22 = 0.0;
+		return;
+	}
+	i11 = e2y / det;
+	i12 = -e2x / det;
+	i21 = -e1y / det;
+	i22 = e1x / det;
+}
+
+/* 像素 -> (s,v): [v, v*s] = inverse * (P - B), 再截到三角形内.
+ * SSE2一次处理两个点; 与标量部分的运算顺序相同, 结果逐位一致.
+ */
+/* pixel -> (s,v): [v, v*s] = inverse * (P - B), then clamped into the
+ * triangle. SSE2 handles two points at a time with the same operation order
+ * as the scalar tail, so the results are bit identical.
+ */
+void KColorCircleHsv::SvTransform::toSv(const QPointF *points, qreal *s, qreal *v, int count) const
+{
+	int i = 0;
+#ifdef HSV_HAVE_SSE2
+	const __m128d vox = _mm_set1_pd(ox), voy = _mm_set1_pd(oy);
+	const __m128d v11 = _mm_set1_pd(i11), v12 = _mm_set1_pd(i12);
+	const __m128d v21 = _mm_set1_pd(i21), v22 = _mm_set1_pd(i22);
+	const __m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1.0);
+	for (; i + 2 <= count; i += 2)
+	{
+		__m128d p0 = _mm_loadu_pd(reinterpret_cast<const double *>(points + i));
+		__m128d p1 = _mm_loadu_pd(reinterpret_cast<const double *>(points + i + 1));
+		__m128d dx = _mm_sub_pd(_mm_unpacklo_pd(p0, p1), vox);
+		__m128d dy = _mm_sub_pd(_mm_unpackhi_pd(p0, p1), voy);
+		__m128d vv = _mm_add_pd(_mm_mul_pd(v11, dx), _mm_mul_pd(v12, dy));
+		__m128d ww = _mm_add_pd(_mm_mul_pd(v21, dx), _mm_mul_pd(v22, dy));
+		__m128d positive = _mm_cmpgt_pd(vv, zero);
+		// v <= 0 时除以1, 然后清零
+		// divide by 1 where v <= 0, then zero it
+		__m128d ss = _mm_div_pd(ww, _mm_or_pd(_mm_and_pd(positive, vv), _mm_andnot_pd(positive, one)));
+		ss = _mm_and_pd(positive, ss);
+		_mm_storeu_pd(s + i, _mm_min_pd(_mm_max_pd(ss, zero), one));
+		_mm_storeu_pd(v + i, _mm_min_pd(_mm_max_pd(vv, zero), one));
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		qreal dx = points[i].x() - ox;
+		qreal dy = points[i].y() - oy;
+		qreal vv = i11 * dx + i12 * dy;
+		qreal ww = i21 * dx + i22 * dy;
+		qreal ss = vv > 0.0 ? ww / vv : 0.0;
+		s[i] = qMin(qMax(ss, 0.0), 1.0);
+		v[i] = qMin(qMax(vv, 0.0), 1.0);
+	}
+}
+
+// (s,v) -> 像素
+// (s,v) -> pixel
+void KColorCircleHsv::SvTransform::toPoints(const qreal *s, const qreal *v, QPointF *points, int count) const
+{
+	int i = 0;
+#ifdef HSV_HAVE_SSE2
+	const __m128d vox = _mm_set1_pd(ox), voy = _mm_set1_pd(oy);
+	const __m128d ve1x = _mm_set1_pd(e1x), ve1y = _mm_set1_pd(e1y);
+	const __m128d ve2x = _mm_set1_pd(e2x), ve2y = _mm_set1_pd(e2y);
+	for (; i + 2 <= count; i += 2)
+	{
+		__m128d vv = _mm_loadu_pd(v + i);
+		__m128d ww = _mm_mul_pd(vv, _mm_loadu_pd(s + i));
+		__m128d x = _mm_add_pd(_mm_add_pd(vox, _mm_mul_pd(vv, ve1x)), _mm_mul_pd(ww, ve2x));
+		__m128d y = _mm_add_pd(_mm_add_pd(voy, _mm_mul_pd(vv, ve1y)), _mm_mul_pd(ww, ve2y));
+		_mm_storeu_pd(reinterpret_cast<double *>(points + i), _mm_unpacklo_pd(x, y));
+		_mm_storeu_pd(reinterpret_cast<double *>(points + i + 1), _mm_unpackhi_pd(x, y));
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		qreal ww = v[i] * s[i];
+		points[i] = QPointF(ox + v[i] * e1x + ww * e2x, oy + v[i] * e1y + ww * e2y);
+	}
+}
+
+
+// ***************** 三角形缓存 triangle cache
+
+// 色相对应的三个顶点弧度
+// radians of the three vertices for a hue
+static void hueRadians(int hue, qreal *radA, qreal *radB, qreal *radC)
+{
+	qreal a = (((360 - hue) * HSVTWOPI) / 360.0);
+	a += HSVPI / 2.0;
+	if (a > HSVTWOPI)
+		a -= HSVTWOPI;
+	
+	qreal b = a + HSVTWOPI/3;
+	qreal c = b + HSVTWOPI/3;
+	
+	if (b > HSVTWOPI)
+		b -= HSVTWOPI;
+	if (c > HSVTWOPI)
+		c -= HSVTWOPI;
+	
+	*radA = a;
+	*radB = b;
+	*radC = c;
+}
+
+// 三角形覆盖的像素范围, 与drawTriangle的扫描一致, 包括抗锯齿的边界像素
+// pixels covered by a triangle, matching the scan in drawTriangle, with the
+// anti-aliased boundary pixels included
+static QRect triangleBounds(const QPointF &a, const QPointF &b, const QPointF &c)
+{
+	qreal minx = qMin(a.x(), qMin(b.x(), c.x()));
+	qreal miny = qMin(a.y(), qMin(b.y(), c.y()));
+	qreal maxx = qMax(a.x(), qMax(b.x(), c.x()));
+	qreal maxy = qMax(a.y(), qMax(b.y(), c.y()));
+	return QRect(QPoint((int) floor(minx - 1.5), (int) floor(miny - 1.5)),
+				 QPoint((int) floor(maxx + 1.5), (int) floor(maxy + 1.5)));
+}
+
+// 把src中rect区域原样复制到dst (同样的格式)
+// copy rect of src into dst unchanged (same format)
+static void copyImageRect(QImage *dst, const QImage &src, const QRect &rect)
+{
+	QRect r = rect.intersected(src.rect()).intersected(dst->rect());
+	if (r.isEmpty())
+		return;
+	const int pixel = src.depth() / 8;
+	const int bytes = r.width() * pixel;
+	for (int y = r.top(); y <= r.bottom(); ++y)
+		memcpy(dst->scanLine(y) + r.left() * pixel, src.constScanLine(y) + r.left() * pixel, bytes);
+}
+
+// 把预乘的tile画到不透明的dst上(SourceOver), 左上角在offset; tile为Dst的tile格式
+// composite a premultiplied tile over opaque dst (SourceOver), top-left at
+// offset; the tile is in Dst's tile format
+template <class Dst>
+static void compositeImageFormat(QImage *dst, const QImage &src, const QPoint &offset)
+{
+	typedef typename Dst::Pixel Pixel;
+	typedef typename Dst::TilePixel TilePixel;
+	QRect r = QRect(offset, src.size()).intersected(dst->rect());
+	for (int y = r.top(); y <= r.bottom(); ++y)
+	{
+		Pixel *d = reinterpret_cast<Pixel *>(dst->scanLine(y)) + r.left();
+		const TilePixel *s = reinterpret_cast<const TilePixel *>(src.constScanLine(y - offset.y()))
+							 + (r.left() - offset.x());
+		for (int x = 0; x < r.width(); ++x)
+			d[x] = Dst::overTile(s[x], d[x], r.left() + x, y);
+	}
+}
+
+static void compositeImage(QImage *dst, const QImage &src, const QPoint &offset)
+{
+	HSV_WITH_FORMAT(dst->format(), compositeImageFormat, (dst, src, offset));
+}
+
+// 圆心为center, 半径为radius的圆上弧度rad处的点
+// point at radian rad on the circle (center, radius)
+static inline QPointF pointAtRadian(const QPointF &center, qreal rad, qreal radius)
+{
+	return QPointF(center.x() + (cos(rad) * radius), center.y() - (sin(rad) * radius));
+}
+
+
+/* 按色相缓存渲染好的三角形(ARGB, 三角形外透明), 内存有上限, 最近最少使用的先淘汰.
+ * 几何(圆心, 内半径)改变时整个缓存作废.
+ * 与后台预热线程共享, 所有操作都加锁.
+ */
+/* Pre-rendered triangles (ARGB, transparent outside the triangle) keyed by hue,
+ * memory bounded and evicted least recently used first. The whole cache is
+ * dropped when the geometry (center, inner radius) changes.
+ * Shared with the warm-up workers, so every operation is locked.
+ */
+class KHsvTriangleCache
+{
+public:
+	typedef KColorCircleHsv::TriangleGeometry Geometry;
+	typedef KColorCircleHsv::TriangleTile Tile;
+	
+	KHsvTriangleCache() : m_tiles(32 * 1024) {}
+	
+	// 几何改变: 清空缓存并使正在预热的任务失效
+	// geometry changed: drop everything and invalidate running warm-ups
+	int reset(const Geometry &geometry)
+	{
+		QMutexLocker lock(&m_mutex);
+		m_tiles.clear();
+		m_geometry = geometry;
+		return m_generation.fetchAndAddOrdered(1) + 1;
+	}
+	
+	int generation()
+	{
+		return m_generation.fetchAndAddOrdered(0);
+	}
+	
+	bool find(int hue, const Geometry &geometry, Tile *tile)
+	{
+		QMutexLocker lock(&m_mutex);
+		if (!(geometry == m_geometry))
+			return false;
+		Tile *t = m_tiles.object(hue);
+		if (!t)
+			return false;
+		*tile = *t;
+		return true;
+	}
+	
+	bool contains(int hue, int generation)
+	{
+		QMutexLocker lock(&m_mutex);
+		return generation != m_generation.fetchAndAddOrdered(0) || m_tiles.contains(hue);
+	}
+	
+	// evict : 是否允许淘汰旧的tile (预热时不允许)
+	// evict : whether older tiles may be evicted (never while warming up)
+	bool insert(int hue, const Geometry &geometry, const Tile &tile, bool evict)
+	{
+		QMutexLocker lock(&m_mutex);
+		if (!(geometry == m_geometry))
+			return false;
+		int cost = tileCost(tile);
+		if (!evict && m_tiles.totalCost() + cost > m_tiles.maxCost())
+			return false;
+		m_tiles.insert(hue, new Tile(tile), cost);
+		return true;
+	}
+	
+	void setMaxBytes(int bytes)
+	{
+		QMutexLocker lock(&m_mutex);
+		m_tiles.setMaxCost(qMax(1, bytes / 1024));
+	}
+	
+private:
+	static int tileCost(const Tile &tile)
+	{
+		return qMax(1, imageBytes(tile.image) / 1024);
+	}
+	
+	QMutex m_mutex;
+	QCache<int, Tile> m_tiles;	// cost: KB
+	Geometry m_geometry;
+	QAtomicInt m_generation;
+};
+
+
+// 后台预热: 在空闲线程中按顺序渲染色相, 缓存满或几何改变时停止
+// background warm-up: renders hues in order on an idle thread, stops when
+// the cache is full or the geometry changed
+class KHsvTriangleWarmup : public QRunnable
+{
+public:
+	KHsvTriangleWarmup(const QSharedPointer<KHsvTriangleCache> &cache,
+					const KColorCircleHsv::TriangleGeometry &geometry,
+					int generation, const QList<int> &hues)
+		: m_cache(cache), m_geometry(geometry), m_generation(generation), m_hues(hues) {}
+	
+	void run()
+	{
+		for (int i = 0; i < m_hues.size(); ++i)
+		{
+			int hue = m_hues.at(i);
+			if (m_cache->contains(hue, m_generation))
+			{
+				if (m_cache->generation() != m_generation)
+					return;
+				continue;
+			}
+			KColorCircleHsv::TriangleTile tile = KColorCircleHsv::renderTriangleTile(hue, m_geometry);
+			if (!m_cache->insert(hue, m_geometry, tile, false))
+				return;
+		}
+	}
+	
+private:
+	QSharedPointer<KHsvTriangleCache> m_cache;
+	KColorCircleHsv::TriangleGeometry m_geometry;
+	int m_generation;
+	QList<int> m_hues;
+};
+
+
+// ***************** 圆环 ring
+
+// 纯色相(HSV s = v = 1)的浮点sRGB, hue为度数
+// floating-point sRGB of a pure hue (HSV s = v = 1), hue in degrees
+static void pureHue(qreal hue, qreal *rgb)
+{
+	qreal h = hue / 60.0;
+	int sector = (int) h;
+	qreal f = h - sector;
+	switch (sector % 6)
+	{
+	case 0: rgb[0] = 1.0; rgb[1] = f; rgb[2] = 0.0; break;
+	case 1: rgb[0] = 1.0 - f; rgb[1] = 1.0; rgb[2] = 0.0; break;
+	case 2: rgb[0] = 0.0; rgb[1] = 1.0; rgb[2] = f; break;
+	case 3: rgb[0] = 0.0; rgb[1] = 1.0 - f; rgb[2] = 1.0; break;
+	case 4: rgb[0] = f; rgb[1] = 0.0; rgb[2] = 1.0; break;
+	default: rgb[0] = 1.0; rgb[1] = 0.0; rgb[2] = 1.0 - f; break;
+	}
+}
+
+
+/* 查找表: atan(t) (t在[0, 1], 角度) 和色相(0.1度)到纯色.
+ * 只在第一次使用时计算.
+ */
+/* lookup tables: atan(t) for t in [0, 1] in degrees, and hue (0.1 degree
+ * steps) to pure colour. Built on first use.
+ */
+struct KHsvRingTables
+{
+	enum { AtanSize = 1024, HueSize = 3600 };
+	float atanDeg[AtanSize + 2];
+	QRgb hue[HueSize];
+	float hueF[(HueSize + 1) * 3];	// 同上, 浮点sRGB, 末尾重复第一个 the same as float sRGB, the first repeated at the end
+	
+	KHsvRingTables()
+	{
+		for (int i = 0; i <= AtanSize + 1; ++i)
+			atanDeg[i] = (float) (atan((qreal) i / AtanSize) * 180.0 / HSVPI);
+		for (int i = 0; i < HueSize; ++i)
+			hue[i] = QColor::fromHsvF(i / (qreal) HueSize, 1.0, 1.0).rgb();
+		for (int i = 0; i <= HueSize; ++i)
+		{
+			qreal rgb[3];
+			pureHue(i % HueSize * 360.0 / HueSize, rgb);
+			for (int k = 0; k < 3; ++k)
+				hueF[i * 3 + k] = (float) rgb[k];
+		}
+	}
+	
+	// 平面坐标系(y向上)中(x, y)的角度, 在(-180, 180]
+	// angle of (x, y) with y pointing up, in (-180, 180]
+	inline qreal angle(qreal x, qreal y) const
+	{
+		qreal ax = fabs(x);
+		qreal ay = fabs(y);
+		bool steep = ay > ax;
+		qreal hi = steep ? ay : ax;
+		if (hi <= 0.0)
+			return 0.0;
+		qreal f = (steep ? ax : ay) / hi * AtanSize;
+		int i = (int) f;
+		qreal a = atanDeg[i] + (atanDeg[i + 1] - atanDeg[i]) * (f - i);
+		if (steep)
+			a = 90.0 - a;
+		if (x < 0)
+			a = 180.0 - a;
+		return y < 0 ? -a : a;
+	}
+	
+	// 色环：360～0：red-green-blue-red逆时针，90度为起点
+	// hue ring: counter-clockwise from 90 degrees, hue 360 to 0
+	inline qreal hueAt(qreal dx, qreal dy) const
+	{
+		return 90.0 - angle(dx, -dy);
+	}
+	
+	// hues: 颜色模型的HueSize个圆环颜色
+	// hues: the colour model's HueSize ring colours
+	inline QRgb colorAt(qreal dx, qreal dy, const QRgb *hues) const
+	{
+		qreal h = hueAt(dx, dy);
+		int i = (int) (h * (HueSize / 360.0) + 0.5);
+		if (i < 0)
+			i += HueSize;
+		if (i >= HueSize)
+			i -= HueSize;
+		return hues[i];
+	}
+	
+	// 同上, 浮点sRGB, 在相邻的两个色相之间线性插值(HSV的纯色相正是分段线性的)
+	// hues: (HueSize + 1) * 3个浮点数, 见hueF
+	// the same as float sRGB, interpolated linearly between the two
+	// neighbouring hues (HSV's pure hues are exactly piecewise linear)
+	// hues: (HueSize + 1) * 3 floats, see hueF
+	inline void colorAtF(qreal dx, qreal dy, const float *hues, float *rgb) const
+	{
+		qreal h = hueAt(dx, dy) * (HueSize / 360.0);
+		if (h < 0.0)
+			h += HueSize;
+		int i = qMin((int) h, HueSize - 1);
+		const float f = (float) qBound(0.0, h - i, 1.0);
+		const float *p = hues + i * 3;
+		rgb[0] = p[0] + (p[3] - p[0]) * f;
+		rgb[1] = p[1] + (p[4] - p[1]) * f;
+		rgb[2] = p[2] + (p[5] - p[2]) * f;
+	}
+};
+
+static const KHsvRingTables &ringTables()
+{
+	static const KHsvRingTables tables;
+	return tables;
+}
+
+// 按覆盖率a(0～256)混合两种颜色
+// blend two colours by coverage a (0 to 256)
+static inline QRgb blendRgb(QRgb fg, QRgb bg, int a)
+{
+	int r = qRed(bg) + (((qRed(fg) - qRed(bg)) * a) >> 8);
+	int g = qGreen(bg) + (((qGreen(fg) - qGreen(bg)) * a) >> 8);
+	int b = qBlue(bg) + (((qBlue(fg) - qBlue(bg)) * a) >> 8);
+	return qRgb(r, g, b);
+}
+
+
+/* 直接光栅化圆环: 每行解析地求出内外圆之间的两段, 只处理这两段的像素.
+ * 只有两条圆边上的像素才开平方求覆盖率.
+ * center为圆心像素, 半径与原来QPainterPath的椭圆一致(像素中心到边 = radius + 0.5)
+ * 只扫描[yBegin, yEnd)的行. 像素交给sink:
+ *   sink.row(y)                 : 开始一行
+ *   sink.full(x, dx, dy)        : 完全覆盖的像素
+ *   sink.edge(x, dx, dy, a)     : 圆边上的像素, 覆盖率a在(0, 256]
+ */
+/* Rasterises the ring directly: each row's two spans between the inner and
+ * outer circle are solved analytically and only those pixels are touched.
+ * Only pixels on the two circle edges take a square root for their coverage.
+ * center is the center pixel, radii match the former QPainterPath ellipses
+ * (pixel center to edge = radius + 0.5). Only rows [yBegin, yEnd) are
+ * scanned. Pixels go to the sink:
+ *   sink.row(y)                 : a row starts
+ *   sink.full(x, dx, dy)        : a fully covered pixel
+ *   sink.edge(x, dx, dy, a)     : a pixel on a circle edge, coverage a in (0, 256]
+ */
+template <class Sink>
+static void scanRing(Sink &sink, int width, const QPoint &center, qreal outerRadius,
+					 qreal innerRadius, int yBegin, int yEnd)
+{
+	const qreal ro = outerRadius + 0.5;
+	const qreal ri = innerRadius + 0.5;
+	// 完全覆盖的距离平方范围
+	// squared distances that are fully covered
+	const qreal fullIn = (ri + 0.5) * (ri + 0.5);
+	const qreal fullOut = ro > 0.5 ? (ro - 0.5) * (ro - 0.5) : 0.0;
+	const qreal reachOut = ro + 0.5;
+	const qreal reachIn = ri - 0.5;
+	const int cx = center.x();
+	const int cy = center.y();
+	
+	const int y1 = qMax(yBegin, (int) floor(cy - reachOut));
+	const int y2 = qMin(yEnd - 1, (int) ceil(cy + reachOut));
+	for (int y = y1; y <= y2; ++y)
+	{
+		const qreal dy = y - cy;
+		const qreal dy2 = dy * dy;
+		if (dy2 >= reachOut * reachOut)
+			continue;
+		
+		// 外圆跨度, 内圆(空心)跨度
+		// outer span, inner (hole) span
+		const qreal xo = sqrt(reachOut * reachOut - dy2);
+		const qreal xi = dy2 < reachIn * reachIn ? sqrt(reachIn * reachIn - dy2) : -1.0;
+		
+		sink.row(y);
+		// 左右两段 : [cx - xo, cx - xi] 和 [cx + xi, cx + xo]
+		// the left and right spans
+		for (int side = 0; side < 2; ++side)
+		{
+			int xa, xb;
+			if (xi < 0.0)
+			{
+				if (side == 1)
+					break;
+				xa = (int) ceil(cx - xo);
+				xb = (int) floor(cx + xo);
+			}
+			else if (side == 0)
+			{
+				xa = (int) ceil(cx - xo);
+				xb = (int) floor(cx - xi);
+			}
+			else
+			{
+				xa = (int) ceil(cx + xi);
+				xb = (int) floor(cx + xo);
+			}
+			xa = qMax(xa, 0);
+			xb = qMin(xb, width - 1);
+			
+			for (int x = xa; x <= xb; ++x)
+			{
+				const qreal dx = x - cx;
+				const qreal d2 = dx * dx + dy2;
+				if (d2 < fullIn || d2 > fullOut)
+				{
+					const qreal d = sqrt(d2);
+					qreal cov = qBound(0.0, ro - d + 0.5, 1.0) * qBound(0.0, d - ri + 0.5, 1.0);
+					int a = (int) (cov * 256.0 + 0.5);
+					if (a > 0)
+						sink.edge(x, dx, dy, qMin(a, 256));
+				}
+				else
+					sink.full(x, dx, dy);
+			}
+		}
+	}
+}
+
+// 色相查表直接写Dst的像素格式
+// writes Dst's pixel format with the hue from the lookup tables
+template <class Dst>
+struct KHsvRingSink
+{
+	typedef typename Dst::Pixel Pixel;
+	
+	QImage *buf;
+	Pixel background;
+	const KHsvRingTables &tables;
+	const QRgb *hues;
+	Pixel *scanline;
+	int y;
+	
+	KHsvRingSink(QImage *image, QRgb bg, const QRgb *h)
+		: buf(image), background(Dst::fromRgb(bg)), tables(ringTables()), hues(h), scanline(0), y(0) {}
+	
+	inline void row(int line)
+	{
+		y = line;
+		scanline = reinterpret_cast<Pixel *>(buf->scanLine(y));
+	}
+	
+	inline void full(int x, qreal dx, qreal dy)
+	{
+		scanline[x] = Dst::dither(tables.colorAt(dx, dy, hues), x, y);
+	}
+	
+	inline void edge(int x, qreal dx, qreal dy, int a)
+	{
+		QRgb color = tables.colorAt(dx, dy, hues);
+		scanline[x] = a < 256 ? Dst::blend(color, background, a, x, y) : Dst::dither(color, x, y);
+	}
+};
+
+// 深色格式(RGBA64, RGBA32FPx4): 色相查浮点表并插值, 不量化到8位
+// deep formats (RGBA64, RGBA32FPx4): hues come interpolated from the float
+// table and are never quantised to 8 bits
+template <class Dst>
+struct KHsvRingSinkFloat
+{
+	typedef typename Dst::Pixel Pixel;
+	
+	QImage *buf;
+	Pixel background;
+	const KHsvRingTables &tables;
+	const float *hues;
+	Pixel *scanline;
+	int y;
+	
+	KHsvRingSinkFloat(QImage *image, QRgb bg, const float *h)
+		: buf(image), background(Dst::fromRgb(bg)), tables(ringTables()), hues(h), scanline(0), y(0) {}
+	
+	inline void row(int line)
+	{
+		y = line;
+		scanline = reinterpret_cast<Pixel *>(buf->scanLine(y));
+	}
+	
+	inline void full(int x, qreal dx, qreal dy)
+	{
+		float rgb[3];
+		tables.colorAtF(dx, dy, hues, rgb);
+		scanline[x] = Dst::fromFloat(rgb[0], rgb[1], rgb[2], x, y);
+	}
+	
+	inline void edge(int x, qreal dx, qreal dy, int a)
+	{
+		float rgb[3];
+		tables.colorAtF(dx, dy, hues, rgb);
+		scanline[x] = a < 256 ? Dst::blendFloat(rgb, background, a, x, y)
+							  : Dst::fromFloat(rgb[0], rgb[1], rgb[2], x, y);
+	}
+};
+
+// 圆环的颜色: 8位表或浮点表
+// ring colours: the 8-bit table or the float one
+struct KHsvRingHues
+{
+	const QRgb *rgb;
+	const float *rgbF;
+};
+
+template <class Dst>
+struct KHsvRingDraw
+{
+	static void draw(QImage *buf, const QPoint &center, qreal outerRadius, qreal innerRadius,
+					 QRgb background, int yBegin, int yEnd, const KHsvRingHues &hues)
+	{
+		KHsvRingSink<Dst> sink(buf, background, hues.rgb);
+		scanRing(sink, buf->width(), center, outerRadius, innerRadius, yBegin, yEnd);
+	}
+};
+
+template <class Dst>
+struct KHsvRingDrawFloat
+{
+	static void draw(QImage *buf, const QPoint &center, qreal outerRadius, qreal innerRadius,
+					 QRgb background, int yBegin, int yEnd, const KHsvRingHues &hues)
+	{
+		KHsvRingSinkFloat<Dst> sink(buf, background, hues.rgbF);
+		scanRing(sink, buf->width(), center, outerRadius, innerRadius, yBegin, yEnd);
+	}
+};
+
+#if QT_VERSION >= 0x050c00
+template <>
+struct KHsvRingDraw<KHsvFormatRgba64> : KHsvRingDrawFloat<KHsvFormatRgba64> {};
+#endif
+#if QT_VERSION >= 0x060200
+template <>
+struct KHsvRingDraw<KHsvFormatRgbaF> : KHsvRingDrawFloat<KHsvFormatRgbaF> {};
+#endif
+
+template <class Dst>
+static void drawRingFormat(QImage *buf, const QPoint &center, qreal outerRadius, qreal innerRadius,
+						   QRgb background, int yBegin, int yEnd, const KHsvRingHues &hues)
+{
+	KHsvRingDraw<Dst>::draw(buf, center, outerRadius, innerRadius, background, yBegin, yEnd, hues);
+}
+
+// 在颜色模型一节中定义
+// defined in the colour models section
+static const QRgb *modelRingHues(KColorCircleHsv::ColorModel model);
+static const float *modelRingHuesF(KColorCircleHsv::ColorModel model);
+
+void KColorCircleHsv::drawRing(QImage *buf, const QPoint &center, qreal outerRadius,
+							   qreal innerRadius, QRgb background, int yBegin, int yEnd,
+							   ColorModel model)
+{
+	if (yEnd < 0)
+		yEnd = buf->height();
+	KHsvRingHues hues;
+	hues.rgb = modelRingHues(model);
+	hues.rgbF = modelRingHuesF(model);
+	HSV_WITH_FORMAT(buf->format(), drawRingFormat,
+					(buf, center, outerRadius, innerRadius, background, yBegin, yEnd, hues));
+}
+
+
+// ***************** 颜色模型 colour models
+
+/* 圆环和三角形的颜色模型策略, 编译时选定, 内层循环中没有分支和函数指针.
+ * 三角形三个顶点(纯色, 黑, 白)的通道在模型的插值空间中线性插值:
+ *   HSV   : sRGB 0～255, 与原来一样用定点数fillSpan
+ *   OKLCH : OKLab, 每个像素转换到sRGB(立方, 两个3x3矩阵, 色域裁剪, 查表编码), SSE2每次4个像素;
+ *           AVX2的RGB32只精确转换节点, 其间插值
+ * 圆环的颜色只与色相有关, 每个模型一张0.1度一格的表.
+ * 策略的接口:
+ *   vertex(rgb, c)                : 顶点颜色的三个通道
+ *   span<Dst>(dst, n, c, d, x, y) : 从c开始每像素加d的一段, 写成Dst的像素格式(见像素格式一节)
+ *   pixel(c)                      : 单个像素(三角形的边)
+ *   pixelFloat(c, rgb)            : 同上, [0, 1]的浮点sRGB (深色格式的边)
+ *   ringHues()                    : 3600个色相的圆环颜色
+ *   ringHuesF()                   : 同上, 浮点sRGB (深色格式), 见KHsvRingTables::hueF
+ *   color(h, s, v)                : 模型坐标到颜色
+ *   coords(rgb, h, &s, &v)        : 颜色投影到色相h的三角形上
+ */
+/* Colour-model policies for the ring and the triangle, chosen at compile time
+ * so the inner loops have no branches or function pointers. The channels of
+ * the triangle's three vertices (pure colour, black, white) are interpolated
+ * linearly in the model's interpolation space:
+ *   HSV   : sRGB 0 to 255, through the fixed-point fillSpan as before
+ *   OKLCH : OKLab, converted to sRGB per pixel (cube, two 3x3 matrices,
+ *           gamut clipping, table encoding), 4 pixels at a time with SSE2;
+ *           RGB32 with AVX2 converts knots exactly and interpolates between
+ * Ring colours only depend on the hue, one table of 0.1 degree steps per
+ * model. The policy interface:
+ *   vertex(rgb, c)                : the three channels of a vertex colour
+ *   span<Dst>(dst, n, c, d, x, y) : a span starting at c, adding d per pixel,
+ *                                   written in Dst's pixel format (see pixel formats)
+ *   pixel(c)                      : a single pixel (triangle edges)
+ *   pixelFloat(c, rgb)            : the same as float sRGB in [0, 1] (edges in
+ *                                   deep formats)
+ *   ringHues()                    : the ring colours of 3600 hues
+ *   ringHuesF()                   : the same as float sRGB (deep formats), see
+ *                                   KHsvRingTables::hueF
+ *   color(h, s, v)                : model coordinates to a colour
+ *   coords(rgb, h, &s, &v)        : a colour projected onto the triangle of hue h
+ */
+
+struct KHsvModelHsv
+{
+	static inline void vertex(QRgb rgb, qreal *c)
+	{
+		c[0] = qRed(rgb);
+		c[1] = qGreen(rgb);
+		c[2] = qBlue(rgb);
+	}
+	
+	template <class Dst>
+	static inline void span(typename Dst::Pixel *dst, int count, const qreal *c, const qreal *d, int x, int y)
+	{
+		fillSpan<Dst>(dst, count, c[0], c[1], c[2], d[0], d[1], d[2], x, y);
+	}
+	
+	static inline QRgb pixel(const qreal *c)
+	{
+		return qRgb(clampChannel(c[0]), clampChannel(c[1]), clampChannel(c[2]));
+	}
+	
+	static inline void pixelFloat(const qreal *c, float *rgb)
+	{
+		for (int k = 0; k < 3; ++k)
+			rgb[k] = (float) qBound(0.0, c[k] / 255.0, 1.0);
+	}
+	
+	static const QRgb *ringHues()
+	{
+		return ringTables().hue;
+	}
+	
+	static const float *ringHuesF()
+	{
+		return ringTables().hueF;
+	}
+	
+	static inline QColor color(qreal h, qreal s, qreal v)
+	{
+		return QColor::fromHsvF(h / 360.0, s, v);
+	}
+	
+	// 灰色的h < 0
+	// h < 0 for greys
+	static inline void coords(const QColor &color, qreal *h, qreal *s, qreal *v)
+	{
+		*h = color.hsvHueF();
+		*s = color.hsvSaturationF();
+		*v = color.valueF();
+		if (*h >= 0.0)
+			*h = KHsvF::wrapHue(*h * 360.0);
+	}
+};
+
+
+/* OKLab (Björn Ottosson, 2020). 线性sRGB <-> LMS <-> OKLab, 都是单精度.
+ * 立方根: 位运算给出约3%的初值, 再两步牛顿迭代(相对误差约1e-6), 可向量化
+ */
+/* OKLab (Björn Ottosson, 2020). Linear sRGB <-> LMS <-> OKLab, all single
+ * precision. Cube root: a bit trick seeds it within about 3%, two Newton
+ * steps refine it (relative error about 1e-6), vectorisable
+ */
+static inline float cbrtFast(float x)
+{
+	union { float f; quint32 i; } u;
+	u.f = x;
+	u.i = u.i / 3 + 709921077u;
+	float y = u.f;
+	y = (2.0f * y + x / (y * y)) * (1.0f / 3.0f);
+	y = (2.0f * y + x / (y * y)) * (1.0f / 3.0f);
+	return y;
+}
+
+static inline void linearToOklab(float r, float g, float b, float *lab)
+{
+	float l = cbrtFast(qMax(0.0f, 0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b));
+	float m = cbrtFast(qMax(0.0f, 0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b));
+	float s = cbrtFast(qMax(0.0f, 0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b));
+	lab[0] = 0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s;
+	lab[1] = 1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s;
+	lab[2] = 0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s;
+}
+
+// 色域外的颜色沿着到同亮度灰色(L^3)的直线拉回[0, 1]
+// out-of-gamut colours are pulled back into [0, 1] along the line to the
+// grey of the same lightness (L^3)
+static inline void oklabToLinear(float L, float a, float b, float *rgb)
+{
+	float l = L + 0.3963377774f * a + 0.2158037573f * b;
+	float m = L - 0.1055613458f * a - 0.0638541728f * b;
+	float s = L - 0.0894841775f * a - 1.2914855480f * b;
+	l = l * l * l;
+	m = m * m * m;
+	s = s * s * s;
+	float r = 4.0767416621f * l - 3.3077115913f * m + 0.2309699292f * s;
+	float g = -1.2684380046f * l + 2.6097574011f * m - 0.3413193965f * s;
+	float bl = -0.0041960863f * l - 0.7034186147f * m + 1.7076147010f * s;
+	
+	float y = qBound(0.0f, L * L * L, 1.0f);
+	float hi = qMax(r, qMax(g, bl));
+	float lo = qMin(r, qMin(g, bl));
+	float t = qMin(1.0f, qMin((1.0f - y) / qMax(hi - y, 1e-6f), y / qMax(y - lo, 1e-6f)));
+	rgb[0] = y + t * (r - y);
+	rgb[1] = y + t * (g - y);
+	rgb[2] = y + t * (bl - y);
+}
+
+static inline qreal srgbToLinear(qreal c)
+{
+	return c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+}
+
+static inline qreal linearToSrgb(qreal c)
+{
+	return c <= 0.0031308 ? c * 12.92 : 1.055 * pow(c, 1.0 / 2.4) - 0.055;
+}
+
+
+/* OKLCH的查找表, 第一次使用时计算.
+ * 每个色相最大彩度的颜色(cusp)总在sRGB立方体纯色相的那条棱上, 所以沿纯色相
+ * 细分采样, 再按OKLCH色相(单调)反查出每0.1度的cusp. 三角形以cusp为纯色顶点.
+ */
+/* OKLCH lookup tables, built on first use. The most chromatic colour of each
+ * hue (the cusp) always lies on the pure-hue edges of the sRGB cube, so
+ * those are sampled finely and inverted by OKLCH hue (monotonic) into a cusp
+ * per 0.1 degree. The triangle takes the cusp as its pure colour vertex.
+ */
+struct KHsvOklchTables
+{
+	enum { HueSize = 3600, Samples = 8192, EncodeSize = 4096 };
+	QRgb ring[HueSize];
+	float ringF[(HueSize + 1) * 3];	// 同上, 浮点sRGB, 见KHsvRingTables::hueF the same as float sRGB, see KHsvRingTables::hueF
+	float cuspL[HueSize];
+	float cuspC[HueSize];
+	uchar encode[EncodeSize + 1];	// 线性[0, 1]到sRGB linear [0, 1] to sRGB
+	float encodeF[EncodeSize + 2];	// 同上, 插值用 the same, for interpolation
+	
+	KHsvOklchTables()
+	{
+		for (int i = 0; i <= EncodeSize; ++i)
+		{
+			encodeF[i] = (float) linearToSrgb(i / (qreal) EncodeSize);
+			encode[i] = (uchar) qRound(encodeF[i] * 255.0);
+		}
+		encodeF[EncodeSize + 1] = encodeF[EncodeSize];
+		
+		// 采样按OKLCH色相排序, 从最小的开始
+		// samples ordered by OKLCH hue, starting at the smallest
+		QVector<qreal> sampleHue(Samples + 1), okHue(Samples + 1);
+		int first = 0;
+		for (int k = 0; k < Samples; ++k)
+		{
+			qreal rgb[3];
+			float lab[3];
+			sampleHue[k] = k * 360.0 / Samples;
+			pureHue(sampleHue[k], rgb);
+			linearToOklab(srgbToLinear(rgb[0]), srgbToLinear(rgb[1]), srgbToLinear(rgb[2]), lab);
+			okHue[k] = KHsvF::wrapHue(atan2(lab[2], lab[1]) * 180.0 / HSVPI);
+			if (okHue[k] < okHue[first])
+				first = k;
+		}
+		
+		int k = 0;
+		for (int i = 0; i < HueSize; ++i)
+		{
+			const qreal target = i * 360.0 / HueSize;
+			// 第k个和第k + 1个采样夹住target
+			// samples k and k + 1 bracket target
+			while (k < Samples - 1 && unwrapped(okHue, first, k + 1) < target)
+				++k;
+			qreal h0 = unwrapped(okHue, first, k);
+			qreal h1 = unwrapped(okHue, first, k + 1);
+			qreal f = h1 > h0 ? qBound(0.0, (target - h0) / (h1 - h0), 1.0) : 0.0;
+			qreal s0 = sampleHue[(first + k) % Samples];
+			qreal hue = s0 + f * 360.0 / Samples;
+			
+			qreal rgb[3];
+			float lab[3];
+			pureHue(KHsvF::wrapHue(hue), rgb);
+			ring[i] = qRgb(qRound(rgb[0] * 255.0), qRound(rgb[1] * 255.0), qRound(rgb[2] * 255.0));
+			for (int c = 0; c < 3; ++c)
+				ringF[i * 3 + c] = (float) rgb[c];
+			linearToOklab(srgbToLinear(rgb[0]), srgbToLinear(rgb[1]), srgbToLinear(rgb[2]), lab);
+			cuspL[i] = lab[0];
+			cuspC[i] = sqrt(lab[1] * lab[1] + lab[2] * lab[2]);
+		}
+		for (int c = 0; c < 3; ++c)
+			ringF[HueSize * 3 + c] = ringF[c];
+	}
+	
+	// 从first开始的第k个采样的色相, 回绕后单调递增
+	// the hue of sample k counted from first, unwrapped to increase monotonically
+	static qreal unwrapped(const QVector<qreal> &okHue, int first, int k)
+	{
+		if (k >= Samples)
+			return okHue.at(first) + 360.0;
+		qreal h = okHue.at((first + k) % Samples);
+		return h < okHue.at(first) ? h + 360.0 : h;
+	}
+	
+	static inline int index(qreal hue)
+	{
+		int i = (int) (hue * (HueSize / 360.0) + 0.5);
+		return i >= HueSize ? i - HueSize : qMax(i, 0);
+	}
+	
+	// 线性值到[0, 1]的sRGB, 查表插值
+	// a linear value to sRGB in [0, 1], interpolated from the table
+	inline float encodeFloat(float c) const
+	{
+		float f = qBound(0.0f, c, 1.0f) * EncodeSize;
+		int i = (int) f;
+		return encodeF[i] + (encodeF[i + 1] - encodeF[i]) * (f - i);
+	}
+	
+	inline QRgb pack(const float *rgb) const
+	{
+		int r = (int) (qBound(0.0f, rgb[0], 1.0f) * EncodeSize + 0.5f);
+		int g = (int) (qBound(0.0f, rgb[1], 1.0f) * EncodeSize + 0.5f);
+		int b = (int) (qBound(0.0f, rgb[2], 1.0f) * EncodeSize + 0.5f);
+		return qRgb(encode[r], encode[g], encode[b]);
+	}
+};
+
+static const KHsvOklchTables &oklchTables()
+{
+	static const KHsvOklchTables tables;
+	return tables;
+}
+
+
+#ifdef HSV_HAVE_SSE2
+// 1/x: 近似倒数(12位)加一步牛顿迭代, 约22位, 代替除法
+// 1/x: the approximate reciprocal (12 bits) plus one Newton step, about 22
+// bits, instead of a division
+static inline __m128 rcpSSE2(__m128 x)
+{
+	__m128 r = _mm_rcp_ps(x);
+	return _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(2.0f), _mm_mul_ps(x, r)));
+}
+
+// 4路cbrtFast: 初值的整数除3用浮点乘1/3代替(SSE2没有整数除法)
+// 4-lane cbrtFast: the seed's integer division by 3 becomes a float multiply
+// by 1/3 (SSE2 has no integer division)
+static inline __m128 cbrtSSE2(__m128 x)
+{
+	const __m128 third = _mm_set1_ps(1.0f / 3.0f);
+	__m128 bits = _mm_cvtepi32_ps(_mm_castps_si128(x));
+	__m128 y = _mm_castsi128_ps(_mm_add_epi32(_mm_cvttps_epi32(_mm_mul_ps(bits, third)),
+											  _mm_set1_epi32(709921077)));
+	y = _mm_mul_ps(_mm_add_ps(_mm_add_ps(y, y), _mm_mul_ps(x, rcpSSE2(_mm_mul_ps(y, y)))), third);
+	y = _mm_mul_ps(_mm_add_ps(_mm_add_ps(y, y), _mm_mul_ps(x, rcpSSE2(_mm_mul_ps(y, y)))), third);
+	return y;
+}
+
+// 4个像素的LMS'(OKLab经M2逆矩阵)到裁剪后的线性sRGB, 与oklabToLinear相同;
+// 整块都在色域内时跳过裁剪, 三角形内部大多如此
+// 4 pixels of LMS' (OKLab through the inverse M2) to clipped linear sRGB,
+// the same as oklabToLinear; the clip is skipped when the whole block is in
+// gamut, which is most of the triangle's interior
+static inline void lmsToLinearSSE2(__m128 L, __m128 l, __m128 m, __m128 s, __m128 *r, __m128 *g, __m128 *bl)
+{
+#define HSV_MADD(x, k, y) _mm_add_ps(x, _mm_mul_ps(_mm_set1_ps(k), y))
+	l = _mm_mul_ps(l, _mm_mul_ps(l, l));
+	m = _mm_mul_ps(m, _mm_mul_ps(m, m));
+	s = _mm_mul_ps(s, _mm_mul_ps(s, s));
+	__m128 rr = HSV_MADD(HSV_MADD(_mm_mul_ps(_mm_set1_ps(4.0767416621f), l), -3.3077115913f, m), 0.2309699292f, s);
+	__m128 gg = HSV_MADD(HSV_MADD(_mm_mul_ps(_mm_set1_ps(-1.2684380046f), l), 2.6097574011f, m), -0.3413193965f, s);
+	__m128 bb = HSV_MADD(HSV_MADD(_mm_mul_ps(_mm_set1_ps(-0.0041960863f), l), -0.7034186147f, m), 1.7076147010f, s);
+#undef HSV_MADD
+	
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	__m128 hi = _mm_max_ps(rr, _mm_max_ps(gg, bb));
+	__m128 lo = _mm_min_ps(rr, _mm_min_ps(gg, bb));
+	if (!_mm_movemask_ps(_mm_or_ps(_mm_cmpgt_ps(hi, one), _mm_cmplt_ps(lo, zero))))
+	{
+		*r = rr;
+		*g = gg;
+		*bl = bb;
+		return;
+	}
+	
+	const __m128 eps = _mm_set1_ps(1e-6f);
+	__m128 y = _mm_min_ps(_mm_max_ps(_mm_mul_ps(L, _mm_mul_ps(L, L)), zero), one);
+	__m128 t1 = _mm_mul_ps(_mm_sub_ps(one, y), rcpSSE2(_mm_max_ps(_mm_sub_ps(hi, y), eps)));
+	__m128 t0 = _mm_mul_ps(y, rcpSSE2(_mm_max_ps(_mm_sub_ps(y, lo), eps)));
+	__m128 t = _mm_min_ps(one, _mm_min_ps(t0, t1));
+	*r = _mm_add_ps(y, _mm_mul_ps(t, _mm_sub_ps(rr, y)));
+	*g = _mm_add_ps(y, _mm_mul_ps(t, _mm_sub_ps(gg, y)));
+	*bl = _mm_add_ps(y, _mm_mul_ps(t, _mm_sub_ps(bb, y)));
+}
+
+// [0, 1]的线性值到编码表的下标
+// linear values in [0, 1] to encode table indices
+static inline __m128i encodeIndexSSE2(__m128 c)
+{
+	const __m128 scale = _mm_set1_ps((float) KHsvOklchTables::EncodeSize);
+	c = _mm_min_ps(_mm_max_ps(c, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+	return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(c, scale), _mm_set1_ps(0.5f)));
+}
+#endif
+
+#ifdef HSV_HAVE_AVX2
+/* 8路的RGB32整段. 线性段以上sRGB编码是sqrt(c)的5次多项式(最大误差5.4e-4,
+ * 约0.14个8位单位), sqrt用rsqrt近似; 同样的多项式用SSE2做4路时比查表慢, 所以只在这里用.
+ * 逐像素转换约是HSV定点填充的10倍, 所以只在每8个像素的节点上精确计算(一次8个节点,
+ * 覆盖64个像素), 16个像素一段, 段内在sRGB中线性插值. 段中点的精确值与插值相差超过
+ * 1/4个8位单位(色域裁剪的折点, 接近0的通道)时这一段逐像素计算; 每行的第一段和
+ * 最后一段也逐像素计算, 三角形边上的通道常常接近0
+ */
+/* 8-lane RGB32 span. Above the linear segment the sRGB encode is a degree 5
+ * polynomial in sqrt(c) (max error 5.4e-4, about 0.14 of an 8-bit step),
+ * with sqrt from rsqrt; four lanes of SSE2 run the same polynomial slower
+ * than the table lookups, so it is only used here.
+ * Converting every pixel costs about 10x the fixed-point HSV fill, so only
+ * knots every 8 pixels are converted exactly (8 knots at a time, covering
+ * 64 pixels) and 16-pixel segments are interpolated linearly in sRGB. A
+ * segment whose exact midpoint is more than a quarter of an 8-bit step off
+ * the interpolation (gamut clipping kinks, channels close to 0) is
+ * converted per pixel, and so are the first and last segments of a row, as
+ * channels are often close to 0 along the triangle's edges
+ */
+typedef int (*OklchSpanFiller)(QRgb *dst, int count, const float *start, const float *step);
+
+__attribute__((target("avx2,fma")))
+static inline __m256 rcpAVX2(__m256 x)
+{
+	__m256 r = _mm256_rcp_ps(x);
+	return _mm256_mul_ps(r, _mm256_fnmadd_ps(x, r, _mm256_set1_ps(2.0f)));
+}
+
+// [0, 1]的线性值到0～255的sRGB, 不取整
+// linear values in [0, 1] to sRGB in 0 to 255, not rounded
+__attribute__((target("avx2,fma")))
+static inline __m256 encodeAVX2(__m256 c)
+{
+	c = _mm256_min_ps(_mm256_max_ps(c, _mm256_set1_ps(1e-10f)), _mm256_set1_ps(1.0f));
+	__m256 s = _mm256_mul_ps(c, _mm256_rsqrt_ps(c));
+	__m256 s2 = _mm256_mul_ps(s, s);
+	__m256 a0 = _mm256_fmadd_ps(_mm256_set1_ps(1.517966270f), s, _mm256_set1_ps(-0.04011061415f));
+	__m256 a1 = _mm256_fmadd_ps(_mm256_set1_ps(2.031734705f), s, _mm256_set1_ps(-1.402812481f));
+	__m256 a2 = _mm256_fmadd_ps(_mm256_set1_ps(0.5173537135f), s, _mm256_set1_ps(-1.623807788f));
+	__m256 e = _mm256_fmadd_ps(s2, _mm256_fmadd_ps(s2, a2, a1), a0);
+	__m256 linear = _mm256_mul_ps(c, _mm256_set1_ps(12.92f));
+	e = _mm256_blendv_ps(e, linear, _mm256_cmp_ps(c, _mm256_set1_ps(0.0031308f), _CMP_LE_OQ));
+	return _mm256_mul_ps(e, _mm256_set1_ps(255.0f));
+}
+
+// 8个LMS'到0～255的sRGB: 立方, 矩阵, 色域裁剪(同lmsToLinearSSE2), 编码
+// 8 LMS' values to sRGB in 0 to 255: cubes, the matrix, gamut clipping (as
+// in lmsToLinearSSE2) and the encode
+__attribute__((target("avx2,fma")))
+static inline void oklchAVX2(__m256 L, __m256 l, __m256 m, __m256 s, __m256 *red, __m256 *green, __m256 *blue)
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	__m256 l3 = _mm256_mul_ps(l, _mm256_mul_ps(l, l));
+	__m256 m3 = _mm256_mul_ps(m, _mm256_mul_ps(m, m));
+	__m256 s3 = _mm256_mul_ps(s, _mm256_mul_ps(s, s));
+	__m256 r = _mm256_fmadd_ps(_mm256_set1_ps(0.2309699292f), s3,
+				_mm256_fmadd_ps(_mm256_set1_ps(-3.3077115913f), m3, _mm256_mul_ps(_mm256_set1_ps(4.0767416621f), l3)));
+	__m256 g = _mm256_fmadd_ps(_mm256_set1_ps(-0.3413193965f), s3,
+				_mm256_fmadd_ps(_mm256_set1_ps(2.6097574011f), m3, _mm256_mul_ps(_mm256_set1_ps(-1.2684380046f), l3)));
+	__m256 b = _mm256_fmadd_ps(_mm256_set1_ps(1.7076147010f), s3,
+				_mm256_fmadd_ps(_mm256_set1_ps(-0.7034186147f), m3, _mm256_mul_ps(_mm256_set1_ps(-0.0041960863f), l3)));
+	
+	__m256 hi = _mm256_max_ps(r, _mm256_max_ps(g, b));
+	__m256 lo = _mm256_min_ps(r, _mm256_min_ps(g, b));
+	if (_mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(hi, one, _CMP_GT_OQ), _mm256_cmp_ps(lo, zero, _CMP_LT_OQ))))
+	{
+		const __m256 eps = _mm256_set1_ps(1e-6f);
+		__m256 y = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(L, _mm256_mul_ps(L, L)), zero), one);
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(one, y), rcpAVX2(_mm256_max_ps(_mm256_sub_ps(hi, y), eps)));
+		__m256 t0 = _mm256_mul_ps(y, rcpAVX2(_mm256_max_ps(_mm256_sub_ps(y, lo), eps)));
+		__m256 t = _mm256_min_ps(one, _mm256_min_ps(t0, t1));
+		r = _mm256_fmadd_ps(t, _mm256_sub_ps(r, y), y);
+		g = _mm256_fmadd_ps(t, _mm256_sub_ps(g, y), y);
+		b = _mm256_fmadd_ps(t, _mm256_sub_ps(b, y), y);
+	}
+	*red = encodeAVX2(r);
+	*green = encodeAVX2(g);
+	*blue = encodeAVX2(b);
+}
+
+// 0～255的通道(已加0.5)打包成8个QRgb
+// channels in 0 to 255 (0.5 already added) packed into 8 QRgbs
+__attribute__((target("avx2,fma")))
+static inline __m256i packAVX2(__m256 r, __m256 g, __m256 b)
+{
+	__m256i px = _mm256_or_si256(_mm256_slli_epi32(_mm256_cvttps_epi32(r), 16),
+								 _mm256_slli_epi32(_mm256_cvttps_epi32(g), 8));
+	return _mm256_or_si256(px, _mm256_or_si256(_mm256_cvttps_epi32(b), _mm256_set1_epi32(0xff000000)));
+}
+
+// start, step : L, l, m, s (LMS'), 整段都写, 返回count
+// start, step : L, l, m, s (LMS'), writes the whole span and returns count
+__attribute__((target("avx2,fma")))
+static int fillOklchAVX2(QRgb *dst, int count, const float *start, const float *step)
+{
+	enum { KnotStep = 8, Segment = 2 * KnotStep, Group = 8 * KnotStep };
+	const __m256 lane = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+	const __m256 knotLane = _mm256_mul_ps(lane, _mm256_set1_ps((float) KnotStep));
+	const __m256 L0 = _mm256_set1_ps(start[0]), dL = _mm256_set1_ps(step[0]);
+	const __m256 l0 = _mm256_set1_ps(start[1]), dl = _mm256_set1_ps(step[1]);
+	const __m256 m0 = _mm256_set1_ps(start[2]), dm = _mm256_set1_ps(step[2]);
+	const __m256 s0 = _mm256_set1_ps(start[3]), ds = _mm256_set1_ps(step[3]);
+	const __m256i byOne = _mm256_set_epi32(0, 7, 6, 5, 4, 3, 2, 1);
+	const __m256i byTwo = _mm256_set_epi32(1, 0, 7, 6, 5, 4, 3, 2);
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	const __m256 tolerance = _mm256_set1_ps(0.25f);
+	const __m256 perPixel = _mm256_set1_ps(1.0f / Segment);
+	
+	// 节点k在像素k * KnotStep; e为这一组的8个节点, n为下一组的
+	// knot k sits at pixel k * KnotStep; e holds this group's 8 knots, n the next group's
+	__m256 er, eg, eb;
+	oklchAVX2(_mm256_fmadd_ps(knotLane, dL, L0), _mm256_fmadd_ps(knotLane, dl, l0),
+			  _mm256_fmadd_ps(knotLane, dm, m0), _mm256_fmadd_ps(knotLane, ds, s0), &er, &eg, &eb);
+	for (int i = 0; i < count; i += Group)
+	{
+		__m256 nr = _mm256_setzero_ps(), ng = nr, nb = nr;
+		if (i + Group - Segment < count)
+		{
+			const __m256 pos = _mm256_add_ps(knotLane, _mm256_set1_ps((float) (i + Group)));
+			oklchAVX2(_mm256_fmadd_ps(pos, dL, L0), _mm256_fmadd_ps(pos, dl, l0),
+					  _mm256_fmadd_ps(pos, dm, m0), _mm256_fmadd_ps(pos, ds, s0), &nr, &ng, &nb);
+		}
+		
+		// 偶数的节点是段的起点, 后一个是中点, 再后一个是终点
+		// even knots start a segment, the next is its midpoint and the one after its end
+		const __m256 xr = _mm256_blend_ps(_mm256_permutevar8x32_ps(er, byTwo), _mm256_permutevar8x32_ps(nr, byTwo), 0xc0);
+		const __m256 xg = _mm256_blend_ps(_mm256_permutevar8x32_ps(eg, byTwo), _mm256_permutevar8x32_ps(ng, byTwo), 0xc0);
+		const __m256 xb = _mm256_blend_ps(_mm256_permutevar8x32_ps(eb, byTwo), _mm256_permutevar8x32_ps(nb, byTwo), 0xc0);
+		__m256 mid = _mm256_permutevar8x32_ps(er, byOne);
+		__m256 off = _mm256_andnot_ps(sign, _mm256_sub_ps(mid, _mm256_mul_ps(half, _mm256_add_ps(er, xr))));
+		mid = _mm256_permutevar8x32_ps(eg, byOne);
+		off = _mm256_max_ps(off, _mm256_andnot_ps(sign, _mm256_sub_ps(mid, _mm256_mul_ps(half, _mm256_add_ps(eg, xg)))));
+		mid = _mm256_permutevar8x32_ps(eb, byOne);
+		off = _mm256_max_ps(off, _mm256_andnot_ps(sign, _mm256_sub_ps(mid, _mm256_mul_ps(half, _mm256_add_ps(eb, xb)))));
+		const int exact = _mm256_movemask_ps(_mm256_cmp_ps(off, tolerance, _CMP_GT_OQ));
+		
+		float from[3][8], delta[3][8];
+		_mm256_storeu_ps(from[0], _mm256_add_ps(er, half));
+		_mm256_storeu_ps(from[1], _mm256_add_ps(eg, half));
+		_mm256_storeu_ps(from[2], _mm256_add_ps(eb, half));
+		_mm256_storeu_ps(delta[0], _mm256_mul_ps(_mm256_sub_ps(xr, er), perPixel));
+		_mm256_storeu_ps(delta[1], _mm256_mul_ps(_mm256_sub_ps(xg, eg), perPixel));
+		_mm256_storeu_ps(delta[2], _mm256_mul_ps(_mm256_sub_ps(xb, eb), perPixel));
+		for (int k = 0; k < 8; k += 2)
+		{
+			const int p = i + k * KnotStep;
+			if (p >= count)
+				break;
+			__m256i px[2];
+			if ((exact & (1 << k)) || p == 0 || count - p <= Segment)
+			{
+				for (int h = 0; h < 2; ++h)
+				{
+					const __m256 pos = _mm256_add_ps(lane, _mm256_set1_ps((float) (p + 8 * h)));
+					__m256 r, g, b;
+					oklchAVX2(_mm256_fmadd_ps(pos, dL, L0), _mm256_fmadd_ps(pos, dl, l0),
+							  _mm256_fmadd_ps(pos, dm, m0), _mm256_fmadd_ps(pos, ds, s0), &r, &g, &b);
+					px[h] = packAVX2(_mm256_add_ps(r, half), _mm256_add_ps(g, half), _mm256_add_ps(b, half));
+				}
+			}
+			else
+			{
+				const __m256 fr = _mm256_set1_ps(from[0][k]), dr = _mm256_set1_ps(delta[0][k]);
+				const __m256 fg = _mm256_set1_ps(from[1][k]), dg = _mm256_set1_ps(delta[1][k]);
+				const __m256 fb = _mm256_set1_ps(from[2][k]), db = _mm256_set1_ps(delta[2][k]);
+				const __m256 lane8 = _mm256_add_ps(lane, _mm256_set1_ps(8.0f));
+				px[0] = packAVX2(_mm256_fmadd_ps(lane, dr, fr), _mm256_fmadd_ps(lane, dg, fg),
+								 _mm256_fmadd_ps(lane, db, fb));
+				px[1] = packAVX2(_mm256_fmadd_ps(lane8, dr, fr), _mm256_fmadd_ps(lane8, dg, fg),
+								 _mm256_fmadd_ps(lane8, db, fb));
+			}
+			
+			if (count - p >= Segment)
+			{
+				_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + p), px[0]);
+				_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + p + 8), px[1]);
+			}
+			else
+			{
+				QRgb tail[Segment];
+				_mm256_storeu_si256(reinterpret_cast<__m256i *>(tail), px[0]);
+				_mm256_storeu_si256(reinterpret_cast<__m256i *>(tail + 8), px[1]);
+				memcpy(dst + p, tail, (count - p) * sizeof(QRgb));
+			}
+		}
+		er = nr;
+		eg = ng;
+		eb = nb;
+	}
+	return count;
+}
+
+static OklchSpanFiller detectOklchSpanFiller()
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return fillOklchAVX2;
+	return 0;
+}
+
+static const OklchSpanFiller s_oklchSpanFiller = detectOklchSpanFiller();
+#endif
+
+
+// 线性sRGB写成Dst的像素: RGB32直接查8位编码表, 其它格式查浮点编码表, 保留8位以下的精度
+// linear sRGB written as Dst pixels: RGB32 looks up the 8-bit encode table,
+// the other formats the float one, keeping the precision below 8 bits
+template <class Dst>
+struct KHsvOklchStore
+{
+	typedef typename Dst::Pixel Pixel;
+	
+	// 整段的宽向量实现, 返回写了多少个像素; 只有RGB32有
+	// whole-span wide vector path, returns the pixels written; RGB32 only
+	static inline int fillWide(Pixel *, int, const float *, const float *)
+	{
+		return 0;
+	}
+	
+	static inline Pixel store(const float *rgb, int x, int y)
+	{
+		const KHsvOklchTables &tables = oklchTables();
+		return Dst::fromFloat(tables.encodeFloat(rgb[0]), tables.encodeFloat(rgb[1]),
+							  tables.encodeFloat(rgb[2]), x, y);
+	}
+	
+#ifdef HSV_HAVE_SSE2
+	static inline void store4(Pixel *dst, __m128 r, __m128 g, __m128 b, int x, int y)
+	{
+		float rgb[3][4];
+		_mm_storeu_ps(rgb[0], r);
+		_mm_storeu_ps(rgb[1], g);
+		_mm_storeu_ps(rgb[2], b);
+		for (int k = 0; k < 4; ++k)
+		{
+			const float px[3] = { rgb[0][k], rgb[1][k], rgb[2][k] };
+			dst[k] = store(px, x + k, y);
+		}
+	}
+#endif
+};
+
+template <>
+struct KHsvOklchStore<KHsvFormatRgb32>
+{
+	static inline int fillWide(QRgb *dst, int count, const float *start, const float *step)
+	{
+#ifdef HSV_HAVE_AVX2
+		if (s_oklchSpanFiller)
+			return s_oklchSpanFiller(dst, count, start, step);
+#else
+		Q_UNUSED(dst);
+		Q_UNUSED(count);
+		Q_UNUSED(start);
+		Q_UNUSED(step);
+#endif
+		return 0;
+	}
+	
+	static inline QRgb store(const float *rgb, int, int)
+	{
+		return oklchTables().pack(rgb);
+	}
+	
+#ifdef HSV_HAVE_SSE2
+	static inline void store4(QRgb *dst, __m128 r, __m128 g, __m128 b, int, int)
+	{
+		const KHsvOklchTables &tables = oklchTables();
+		int ri[4], gi[4], bi[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(ri), encodeIndexSSE2(r));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(gi), encodeIndexSSE2(g));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(bi), encodeIndexSSE2(b));
+		for (int k = 0; k < 4; ++k)
+			dst[k] = qRgb(tables.encode[ri[k]], tables.encode[gi[k]], tables.encode[bi[k]]);
+	}
+#endif
+};
+
+struct KHsvModelOklch
+{
+	static inline void vertex(QRgb rgb, qreal *c)
+	{
+		float lab[3];
+		linearToOklab(srgbToLinear(qRed(rgb) / 255.0), srgbToLinear(qGreen(rgb) / 255.0),
+					  srgbToLinear(qBlue(rgb) / 255.0), lab);
+		c[0] = lab[0];
+		c[1] = lab[1];
+		c[2] = lab[2];
+	}
+	
+	template <class Dst>
+	static void span(typename Dst::Pixel *dst, int count, const qreal *c, const qreal *d, int x, int y)
+	{
+		int i = 0;
+#ifdef HSV_HAVE_SSE2
+		// LMS'和OKLab是线性关系, 沿扫描线同样等步长
+		// LMS' is linear in OKLab, so it steps along the scanline just the same
+		qreal lms[3], dlms[3];
+		for (int k = 0; k < 2; ++k)
+		{
+			const qreal *from = k ? d : c;
+			qreal *to = k ? dlms : lms;
+			to[0] = from[0] + 0.3963377774 * from[1] + 0.2158037573 * from[2];
+			to[1] = from[0] - 0.1055613458 * from[1] - 0.0638541728 * from[2];
+			to[2] = from[0] - 0.0894841775 * from[1] - 1.2914855480 * from[2];
+		}
+		const float start[4] = { (float) c[0], (float) lms[0], (float) lms[1], (float) lms[2] };
+		const float step[4] = { (float) d[0], (float) dlms[0], (float) dlms[1], (float) dlms[2] };
+		i = KHsvOklchStore<Dst>::fillWide(dst, count, start, step);
+		
+		// 余下的4个一组
+		// the rest in fours
+		const __m128 lane = _mm_set_ps(i + 3.0f, i + 2.0f, i + 1.0f, (float) i);
+		__m128 L = _mm_add_ps(_mm_set1_ps(start[0]), _mm_mul_ps(lane, _mm_set1_ps(step[0])));
+		__m128 l = _mm_add_ps(_mm_set1_ps(start[1]), _mm_mul_ps(lane, _mm_set1_ps(step[1])));
+		__m128 m = _mm_add_ps(_mm_set1_ps(start[2]), _mm_mul_ps(lane, _mm_set1_ps(step[2])));
+		__m128 s = _mm_add_ps(_mm_set1_ps(start[3]), _mm_mul_ps(lane, _mm_set1_ps(step[3])));
+		const __m128 dL = _mm_set1_ps((float) (4.0 * d[0]));
+		const __m128 dl = _mm_set1_ps((float) (4.0 * dlms[0]));
+		const __m128 dm = _mm_set1_ps((float) (4.0 * dlms[1]));
+		const __m128 ds = _mm_set1_ps((float) (4.0 * dlms[2]));
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128 r, g, b;
+			lmsToLinearSSE2(L, l, m, s, &r, &g, &b);
+			KHsvOklchStore<Dst>::store4(dst + i, r, g, b, x + i, y);
+			L = _mm_add_ps(L, dL);
+			l = _mm_add_ps(l, dl);
+			m = _mm_add_ps(m, dm);
+			s = _mm_add_ps(s, ds);
+		}
+#endif
+		for (; i < count; ++i)
+		{
+			float rgb[3];
+			oklabToLinear((float) (c[0] + i * d[0]), (float) (c[1] + i * d[1]),
+						  (float) (c[2] + i * d[2]), rgb);
+			dst[i] = KHsvOklchStore<Dst>::store(rgb, x + i, y);
+		}
+	}
+	
+	static inline QRgb pixel(const qreal *c)
+	{
+		float rgb[3];
+		oklabToLinear((float) c[0], (float) c[1], (float) c[2], rgb);
+		return oklchTables().pack(rgb);
+	}
+	
+	static inline void pixelFloat(const qreal *c, float *rgb)
+	{
+		const KHsvOklchTables &tables = oklchTables();
+		oklabToLinear((float) c[0], (float) c[1], (float) c[2], rgb);
+		for (int k = 0; k < 3; ++k)
+			rgb[k] = tables.encodeFloat(rgb[k]);
+	}
+	
+	static const QRgb *ringHues()
+	{
+		return oklchTables().ring;
+	}
+	
+	static const float *ringHuesF()
+	{
+		return oklchTables().ringF;
+	}
+	
+	// 三角形: 纯色顶点为色相h的cusp, P = B + v(C - B) + v*s(A - C)在OKLab中同样是线性的
+	// the triangle: the pure colour vertex is the cusp of hue h, and
+	// P = B + v(C - B) + v*s(A - C) is just as linear in OKLab
+	static QColor color(qreal h, qreal s, qreal v)
+	{
+		const KHsvOklchTables &tables = oklchTables();
+		int i = KHsvOklchTables::index(h);
+		qreal rad = h * HSVPI / 180.0;
+		qreal chroma = v * s * tables.cuspC[i];
+		float rgb[3];
+		oklabToLinear((float) (v * (1.0 - s) + v * s * tables.cuspL[i]),
+					  (float) (chroma * cos(rad)), (float) (chroma * sin(rad)), rgb);
+		return QColor::fromRgbF(linearToSrgb(qBound(0.0f, rgb[0], 1.0f)),
+								linearToSrgb(qBound(0.0f, rgb[1], 1.0f)),
+								linearToSrgb(qBound(0.0f, rgb[2], 1.0f)));
+	}
+	
+	static void coords(const QColor &color, qreal *h, qreal *s, qreal *v)
+	{
+		float lab[3];
+		linearToOklab(srgbToLinear(color.redF()), srgbToLinear(color.greenF()),
+					  srgbToLinear(color.blueF()), lab);
+		qreal chroma = sqrt(lab[1] * lab[1] + lab[2] * lab[2]);
+		*h = chroma < 1e-4 ? -1.0 : KHsvF::wrapHue(atan2(lab[2], lab[1]) * 180.0 / HSVPI);
+		project(lab[0], chroma, *h < 0.0 ? 0.0 : *h, s, v);
+	}
+	
+	// 亮度L, 彩度chroma投影到色相h的三角形上
+	// lightness L and chroma projected onto the triangle of hue h
+	static inline void project(qreal L, qreal chroma, qreal h, qreal *s, qreal *v)
+	{
+		const KHsvOklchTables &tables = oklchTables();
+		int i = KHsvOklchTables::index(h);
+		// L = v - vs + vs * Lc, chroma = vs * Cc
+		qreal vs = qBound(0.0, chroma / qMax(tables.cuspC[i], 1e-6f), 1.0);
+		*v = qBound(0.0, L + vs * (1.0 - tables.cuspL[i]), 1.0);
+		*s = *v > 0.0 ? qBound(0.0, vs / *v, 1.0) : 0.0;
+	}
+};
+
+
+// 按模型转换颜色和坐标, 分块以便批量转换
+// colours and coordinates converted per model, in chunks for the batch calls
+template <class Model>
+static void modelColors(qreal hue, const qreal *s, const qreal *v, QColor *colors, int count)
+{
+	for (int i = 0; i < count; ++i)
+		colors[i] = Model::color(hue, s[i], v[i]);
+}
+
+template <class Model>
+static void modelCoords(const QColor *colors, qreal hue, qreal *s, qreal *v, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		qreal h;
+		Model::coords(colors[i], &h, s + i, v + i);
+	}
+}
+
+// OKLCH: 颜色到OKLab每次4个, 再投影到当前色相的三角形上
+// OKLCH: colours go to OKLab 4 at a time, then onto the current hue's triangle
+template <>
+void modelCoords<KHsvModelOklch>(const QColor *colors, qreal hue, qreal *s, qreal *v, int count)
+{
+	for (int base = 0; base < count; base += 4)
+	{
+		int n = qMin(4, count - base);
+		float r[4] = { 0 }, g[4] = { 0 }, b[4] = { 0 };
+		float L[4], A[4], B[4];
+		for (int i = 0; i < n; ++i)
+		{
+			r[i] = (float) srgbToLinear(colors[base + i].redF());
+			g[i] = (float) srgbToLinear(colors[base + i].greenF());
+			b[i] = (float) srgbToLinear(colors[base + i].blueF());
+		}
+#ifdef HSV_HAVE_SSE2
+		__m128 vr = _mm_loadu_ps(r), vg = _mm_loadu_ps(g), vb = _mm_loadu_ps(b);
+		const __m128 zero = _mm_setzero_ps();
+#define HSV_DOT(k0, k1, k2) _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(k0), vr), \
+		_mm_mul_ps(_mm_set1_ps(k1), vg)), _mm_mul_ps(_mm_set1_ps(k2), vb))
+		__m128 l = cbrtSSE2(_mm_max_ps(zero, HSV_DOT(0.4122214708f, 0.5363325363f, 0.0514459929f)));
+		__m128 m = cbrtSSE2(_mm_max_ps(zero, HSV_DOT(0.2119034982f, 0.6806995451f, 0.1073969566f)));
+		__m128 sc = cbrtSSE2(_mm_max_ps(zero, HSV_DOT(0.0883024619f, 0.2817188376f, 0.6299787005f)));
+		vr = l;
+		vg = m;
+		vb = sc;
+		_mm_storeu_ps(L, HSV_DOT(0.2104542553f, 0.7936177850f, -0.0040720468f));
+		_mm_storeu_ps(A, HSV_DOT(1.9779984951f, -2.4285922050f, 0.4505937099f));
+		_mm_storeu_ps(B, HSV_DOT(0.0259040371f, 0.7827717662f, -0.8086757660f));
+#undef HSV_DOT
+#else
+		for (int i = 0; i < n; ++i)
+		{
+			float lab[3];
+			linearToOklab(r[i], g[i], b[i], lab);
+			L[i] = lab[0];
+			A[i] = lab[1];
+			B[i] = lab[2];
+		}
+#endif
+		for (int i = 0; i < n; ++i)
+			KHsvModelOklch::project(L[i], sqrt(A[i] * A[i] + B[i] * B[i]), hue, s + base + i, v + base + i);
+	}
+}
+
+static const QRgb *modelRingHues(KColorCircleHsv::ColorModel model)
+{
+	return model == KColorCircleHsv::ModelOklch ? KHsvModelOklch::ringHues() : KHsvModelHsv::ringHues();
+}
+
+static const float *modelRingHuesF(KColorCircleHsv::ColorModel model)
+{
+	return model == KColorCircleHsv::ModelOklch ? KHsvModelOklch::ringHuesF() : KHsvModelHsv::ringHuesF();
+}
+
+// 三角形边上的像素: 8位颜色按覆盖率a混合; 深色格式用浮点颜色, 不量化到8位
+// a pixel on a triangle edge: the 8-bit colour blended by coverage a; deep
+// formats take the float colour so nothing is quantised to 8 bits
+template <class Model, class Dst>
+struct KHsvEdgePixel
+{
+	static inline typename Dst::Pixel blend(const qreal *c, typename Dst::Pixel dst, int a, int x, int y)
+	{
+		return Dst::blend(Model::pixel(c), dst, a, x, y);
+	}
+};
+
+template <class Model, class Dst>
+struct KHsvEdgePixelFloat
+{
+	static inline typename Dst::Pixel blend(const qreal *c, typename Dst::Pixel dst, int a, int x, int y)
+	{
+		float rgb[3];
+		Model::pixelFloat(c, rgb);
+		return Dst::blendFloat(rgb, dst, a, x, y);
+	}
+};
+
+#if QT_VERSION >= 0x050c00
+template <class Model>
+struct KHsvEdgePixel<Model, KHsvFormatRgba64> : KHsvEdgePixelFloat<Model, KHsvFormatRgba64> {};
+#endif
+#if QT_VERSION >= 0x060200
+template <class Model>
+struct KHsvEdgePixel<Model, KHsvFormatRgbaF> : KHsvEdgePixelFloat<Model, KHsvFormatRgbaF> {};
+#endif
+
+
+// ***************** 共享圆环 shared ring
+
+/* 进程内共享的圆环图像. 同样尺寸的控件共用一张圆环(QImage隐式共享),
+ * 引用计数就是QImage自己的: 只剩缓存持有的图像在purge时删除.
+ * 可在任意线程使用.
+ */
+/* Rings shared across the process. Widgets of the same size hold the same
+ * implicitly shared QImage, and QImage's own reference count is the
+ * refcount: purge() drops images only the cache still holds. Usable from
+ * any thread.
+ */
+struct KHsvRingKey
+{
+	QSize size;
+	qreal pixelRatio;
+	QRgb background;
+	qreal ringWidth;
+	KColorCircleHsv::ColorModel model;
+	QImage::Format format;
+	
+	KHsvRingKey()
+		: pixelRatio(1.0), background(0), ringWidth(0.0), model(KColorCircleHsv::ModelHsv),
+		  format(QImage::Format_RGB32) {}
+	bool operator==(const KHsvRingKey &other) const
+	{
+		return size == other.size && pixelRatio == other.pixelRatio
+				&& background == other.background && ringWidth == other.ringWidth
+				&& model == other.model && format == other.format;
+	}
+};
+
+inline uint qHash(const KHsvRingKey &key)
+{
+	return qHash((quint64) key.size.width() << 32 | (uint) key.size.height())
+			^ qHash((quint64) key.background << 32 | (uint) (key.ringWidth * 1024.0))
+			^ (uint) (key.pixelRatio * 64.0) ^ ((uint) key.model << 24) ^ ((uint) key.format << 16);
+}
+
+
+/* 圆环的磁盘缓存: 一个文件, 文件头之后是一条条记录(记录头 + 像素), 都按64字节对齐.
+ * 打开时整个文件映射到内存, 找到的圆环是直接包装映射像素的QImage, 不复制;
+ * 校验和覆盖记录头(键)和像素, 在第一次使用一条记录时检查, 不持有缓存的锁.
+ * 新渲染的圆环在线程池中追加到文件末尾(记录头和像素直接写出), 下次启动时可用;
+ * 追加时持有文件旁的锁文件(Qt 5.1), 多个进程的记录不会交错.
+ * 文件满时压缩: 最近使用的记录拷到新文件(上限的一半), 新文件整个替换旧文件.
+ * 文件头中有布局版本和探针圆环的校验和: 渲染代码改变时探针随之改变, 整个文件重建.
+ * 文件只整个替换, 从不原地截断, 其它进程的映射不受影响; 替换时在旧文件头中置位,
+ * 其它进程在持有锁文件追加或压缩之前看到后映射新文件.
+ * 索引停在不完整的记录处; 追加前检查其它进程追加的记录头, 进程中途退出留下的
+ * 半条记录由压缩去掉.
+ */
+/* On-disk ring cache: one file, a header followed by records (record header
+ * + pixels), all 64-byte aligned. The whole file is mapped when it is
+ * opened and a ring found there is a QImage wrapping the mapped pixels,
+ * without a copy; the checksum covers the record header (the key) and the
+ * pixels and is verified the first time a record is used, outside the
+ * cache's lock. Newly rendered rings are appended on the thread pool (the
+ * record header and pixels are written directly) and available from the
+ * next launch; appends hold a lock file beside the file (Qt 5.1) so records
+ * from several processes do not interleave. A full file is compacted: the
+ * most recently used records are copied to a new file (up to half the
+ * limit) which replaces the old one whole.
+ * The header holds the layout version and the checksum of probe rings: when
+ * the rendering code changes so do the probes, and the whole file is
+ * rebuilt. The file is only ever replaced whole, never truncated in place,
+ * so other processes' mappings stay valid; replacing it sets a flag in the
+ * old file's header, which other processes check under the lock file
+ * before they append or compact, mapping the new file when it is set.
+ * Indexing stops at an incomplete record; before appending the record
+ * headers other processes appended are checked, and half a record left by
+ * a process that died while writing is dropped by compacting.
+ */
+enum { RingFileLayout = 2, RingFileAlign = 64 };
+static const qint64 RingFileMaxBytes = Q_INT64_C(256) * 1024 * 1024;
+
+struct KHsvRingFileHeader
+{
+	char magic[8];		// "KHSVRING"
+	quint32 byteOrder;	// 0x01020304, 其它字节序的文件重建 files of another byte order are rebuilt
+	quint32 layout;
+	quint64 probe;
+	quint32 replaced;	// 文件被压缩或重建替换后为1 1 once the file was replaced by compaction or a rebuild
+	char reserved[36];
+};
+
+struct KHsvRingRecord
+{
+	quint32 magic;		// 'RING'
+	quint32 format;
+	qint32 width, height;
+	qint32 bytesPerLine;
+	quint32 background;
+	quint32 model;
+	quint32 reserved;
+	double pixelRatio;
+	double ringWidth;
+	quint64 bytes;
+	quint64 checksum;
+};
+
+// 32位字的Fletcher-64, 每65536个字取一次模; sum为前面数据的校验和, 可以分段计算
+// Fletcher-64 over 32-bit words, reduced every 65536 words; sum is the
+// checksum of the data before, so it can be computed piecewise
+static quint64 ringChecksum(const uchar *data, qint64 bytes, quint64 sum = 0)
+{
+	const quint32 *words = reinterpret_cast<const quint32 *>(data);
+	qint64 count = bytes / 4;
+	quint64 a = sum & 0xffffffffu, b = sum >> 32;
+	while (count > 0)
+	{
+		const int block = int(qMin(count, qint64(65536)));
+		for (int i = 0; i < block; ++i)
+		{
+			a += words[i];
+			b += a;
+		}
+		a %= 0xffffffffu;
+		b %= 0xffffffffu;
+		words += block;
+		count -= block;
+	}
+	return b << 32 | a;
+}
+
+// 一条记录的校验和: 记录头(checksum记为0)和像素
+// a record's checksum: the record header (with checksum as 0) and the pixels
+static quint64 recordChecksum(const KHsvRingRecord &record, const uchar *pixels)
+{
+	KHsvRingRecord head = record;
+	head.checksum = 0;
+	return ringChecksum(pixels, qint64(record.bytes),
+						ringChecksum(reinterpret_cast<const uchar *>(&head), sizeof(head)));
+}
+
+static inline qint64 ringFilePadded(qint64 bytes)
+{
+	return (bytes + RingFileAlign - 1) / RingFileAlign * RingFileAlign;
+}
+
+
+// 文件旁的锁文件, 多个进程不同时写 (Qt 5.1之前不加锁)
+// a lock file beside the file so processes never write at the same time
+// (unlocked before Qt 5.1)
+class KHsvRingFileLock
+{
+public:
+#if QT_VERSION >= 0x050100
+	explicit KHsvRingFileLock(const QString &fileName) : m_lock(fileName + QLatin1String(".lock"))
+	{
+		m_lock.lock();
+	}
+	
+private:
+	QLockFile m_lock;
+#else
+	explicit KHsvRingFileLock(const QString &) {}
+#endif
+};
+
+
+/* m_mutex保护索引, 查找只短暂持有; m_writeMutex让追加和压缩依次进行.
+ * 两个都持有时先取m_writeMutex.
+ */
+/* m_mutex guards the index and lookups only hold it briefly; m_writeMutex
+ * serialises appends and compaction. When both are held m_writeMutex is
+ * taken first.
+ */
+class KHsvRingStore
+{
+public:
+	KHsvRingStore() : m_probe(0), m_header(0), m_nEnd(0), m_nUse(0) {}
+	
+	// 持有锁文件, 别的进程不会正在写记录
+	// holds the lock file, so no other process is halfway through a record
+	bool open(const QString &fileName, quint64 probe)
+	{
+		QMutexLocker writeLock(&m_writeMutex);
+		m_fileName = fileName;
+		m_probe = probe;
+		KHsvRingFileLock fileLock(m_fileName);
+		{
+			QMutexLocker lock(&m_mutex);
+			if (!mapFile())
+			{
+				// 文件头或探针不符(或者还没有文件)才删掉重建
+				// only a wrong header or probe (or no file yet) is rebuilt
+				QFile old(m_fileName);
+				if (old.open(QIODevice::ReadWrite))
+					retireFile(&old);
+				QFile::remove(m_fileName);
+				QFile file(m_fileName);
+				if (!file.open(QIODevice::WriteOnly) || !writeHeader(&file))
+					return false;
+				file.close();
+				if (!mapFile())
+					return false;
+			}
+		}
+		
+		// 进程中途退出留下的半条记录压缩掉, 压缩不成也能读
+		// compact away half a record left by a process that died, the file
+		// can still be read if that fails
+		if (!checkTail())
+			compact();
+		return true;
+	}
+	
+	// 记录在第一次使用时校验, 校验时不持有锁
+	// a record is verified on first use, without holding the lock
+	QImage find(const KHsvRingKey &key)
+	{
+		QMutexLocker lock(&m_mutex);
+		QHash<KHsvRingKey, Entry>::iterator it = m_index.find(key);
+		if (it == m_index.end())
+			return QImage();
+		const KHsvRingRecord *record = it.value().record;
+		const bool verified = it.value().verified;
+		m_used.insert(key, ++m_nUse);
+		lock.unlock();
+		
+		const uchar *pixels = reinterpret_cast<const uchar *>(record + 1);
+		if (!verified)
+		{
+			const bool ok = recordChecksum(*record, pixels) == record->checksum;
+			// 其间文件可能已经压缩, 只改同一条记录
+			// the file may have been compacted meanwhile, only touch the same record
+			lock.relock();
+			it = m_index.find(key);
+			if (it != m_index.end() && it.value().record == record)
+			{
+				if (ok)
+					it.value().verified = true;
+				else
+					m_index.erase(it);
+			}
+			if (!ok)
+				return QImage();
+		}
+		return QImage(pixels, record->width, record->height, record->bytesPerLine,
+					  QImage::Format(record->format));
+	}
+	
+	// 在线程池中运行: 记录头和像素直接写出, 文件满时先压缩
+	// runs on the thread pool: the record header and pixels are written
+	// directly, compacting first when the file is full
+	void append(const KHsvRingKey &key, const QImage &ring)
+	{
+		const qint64 bytes = qint64(ring.bytesPerLine()) * ring.height();
+		const qint64 size = qint64(sizeof(KHsvRingRecord)) + ringFilePadded(bytes);
+		if (qint64(sizeof(KHsvRingFileHeader)) + size > RingFileMaxBytes / 2)
+			return;
+		
+		KHsvRingRecord record;
+		memset(&record, 0, sizeof(record));
+		record.magic = RecordMagic;
+		record.format = ring.format();
+		record.width = key.size.width();
+		record.height = key.size.height();
+		record.bytesPerLine = ring.bytesPerLine();
+		record.background = key.background;
+		record.model = key.model;
+		record.pixelRatio = key.pixelRatio;
+		record.ringWidth = key.ringWidth;
+		record.bytes = bytes;
+		record.checksum = recordChecksum(record, ring.constBits());
+		
+		QMutexLocker writeLock(&m_writeMutex);
+		{
+			QMutexLocker lock(&m_mutex);
+			if (!m_file || m_index.contains(key) || m_appended.contains(key))
+				return;
+			m_used.insert(key, ++m_nUse);
+		}
+		KHsvRingFileLock fileLock(m_fileName);
+		if (!sync())
+			return;
+		{
+			// 新映射的文件中可能已经有了
+			// a newly mapped file may have it already
+			QMutexLocker lock(&m_mutex);
+			if (m_index.contains(key))
+				return;
+		}
+		if (m_file->size() + size > RingFileMaxBytes && !compact())
+			return;
+		
+		// 写失败留下的半条记录由下次追加时的检查去掉
+		// half a record left by a failed write is caught by the next append's check
+		if (writeRecord(m_file.data(), record, ring.constBits()) && m_file->flush())
+		{
+			m_appended.insert(key);
+			m_nEnd += size;
+		}
+	}
+	
+private:
+	enum { RecordMagic = 0x474e4952 };	// "RING"
+	
+	struct Entry
+	{
+		const KHsvRingRecord *record;
+		bool verified;
+	};
+	
+	// 其它进程替换过文件就映射新文件, 文件尾有半条记录就压缩; 调用者持有
+	// m_writeMutex和锁文件
+	// maps the new file when another process replaced it and compacts when
+	// the file ends in half a record; the caller holds m_writeMutex and the
+	// lock file
+	bool sync()
+	{
+		if (m_header->replaced)
+		{
+			QMutexLocker lock(&m_mutex);
+			if (!mapFile())
+				return false;
+		}
+		return checkTail() || compact();
+	}
+	
+	// 检查m_nEnd之后其它进程追加的记录头并前移m_nEnd, 遇到半条记录时返回false
+	// checks the record headers other processes appended after m_nEnd and
+	// moves m_nEnd past them, false on half a record
+	bool checkTail()
+	{
+		const qint64 size = m_file->size();
+		while (m_nEnd < size)
+		{
+			KHsvRingRecord record;
+			const qint64 room = size - m_nEnd - qint64(sizeof(record));
+			if (!m_file->seek(m_nEnd)
+				|| m_file->read(reinterpret_cast<char *>(&record), sizeof(record)) != sizeof(record)
+				|| !recordValid(record, room))
+				return false;
+			m_nEnd += sizeof(record) + ringFilePadded(qint64(record.bytes));
+		}
+		return true;
+	}
+	
+	// 在被替换的文件头中置位, 映射着它的进程下次追加前换到新文件
+	// sets the flag in the header of a replaced file, processes mapping it
+	// move to the new file before their next append
+	static void retireFile(QFile *file)
+	{
+		const quint32 replaced = 1;
+		if (file->size() >= qint64(sizeof(KHsvRingFileHeader))
+			&& file->seek(offsetof(KHsvRingFileHeader, replaced)))
+			file->write(reinterpret_cast<const char *>(&replaced), sizeof(replaced));
+		file->close();
+	}
+	
+	bool writeHeader(QIODevice *file) const
+	{
+		KHsvRingFileHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, "KHSVRING", 8);
+		header.byteOrder = 0x01020304;
+		header.layout = RingFileLayout;
+		header.probe = m_probe;
+		return file->write(reinterpret_cast<const char *>(&header), sizeof(header)) == sizeof(header);
+	}
+	
+	static bool writeRecord(QIODevice *file, const KHsvRingRecord &record, const uchar *pixels)
+	{
+		static const char zeros[RingFileAlign] = { 0 };
+		const qint64 bytes = qint64(record.bytes);
+		const qint64 padding = ringFilePadded(bytes) - bytes;
+		return file->write(reinterpret_cast<const char *>(&record), sizeof(record)) == sizeof(record)
+				&& file->write(reinterpret_cast<const char *>(pixels), bytes) == bytes
+				&& file->write(zeros, padding) == padding;
+	}
+	
+	// 打开并映射m_fileName, 索引其中的记录; 调用者持有两个锁.
+	// 之前的文件保留映射到进程退出, 仍有圆环图像指向它
+	// opens and maps m_fileName and indexes its records; the caller holds
+	// both locks. The previous file stays mapped until exit as ring images
+	// may still point into it
+	bool mapFile()
+	{
+		if (m_file)
+			m_retired.append(m_file);
+		m_index.clear();
+		m_appended.clear();
+		m_header = 0;
+		m_file = QSharedPointer<QFile>(new QFile(m_fileName));
+		if (m_file->open(QIODevice::ReadWrite | QIODevice::Append))
+		{
+			const qint64 size = m_file->size();
+			const uchar *data = size >= qint64(sizeof(KHsvRingFileHeader)) ? m_file->map(0, size) : 0;
+			if (data && index(data, size, m_probe, &m_index, &m_nEnd))
+			{
+				m_header = reinterpret_cast<const KHsvRingFileHeader *>(data);
+				return true;
+			}
+		}
+		m_index.clear();
+		m_file.clear();
+		return false;
+	}
+	
+	// 最近使用的记录(最多上限的一半)拷到新文件, 替换旧文件后映射新文件.
+	// 调用者持有m_writeMutex和锁文件
+	// copies the most recently used records (up to half the limit) into a
+	// new file, which replaces the old one and is then mapped. The caller
+	// holds m_writeMutex and the lock file
+	bool compact()
+	{
+		// 重新映射整个旧文件, 包括其后追加的记录
+		// map the whole old file again, including the records appended since
+		const qint64 size = m_file->size();
+		const uchar *data = m_file->map(0, size);
+		QHash<KHsvRingKey, Entry> records;
+		qint64 end = 0;
+		if (!data || !index(data, size, m_probe, &records, &end))
+			records.clear();
+		
+		// 本进程用过的按最近使用在前, 其余按文件中的位置从后往前
+		// records used by this process most recent first, then the rest from
+		// the end of the file backwards
+		QMap<quint64, const KHsvRingRecord *> order;
+		{
+			QMutexLocker lock(&m_mutex);
+			for (QHash<KHsvRingKey, Entry>::const_iterator it = records.constBegin();
+				 it != records.constEnd(); ++it)
+			{
+				const quint64 used = m_used.value(it.key());
+				const quint64 rank = used ? Q_UINT64_C(1) << 62 | used
+										  : quint64(reinterpret_cast<const uchar *>(it.value().record) - data);
+				order.insert(rank, it.value().record);
+			}
+		}
+		
+#if QT_VERSION >= 0x050100
+		QSaveFile file(m_fileName);
+#else
+		QFile file(m_fileName + QLatin1String(".new"));
+#endif
+		if (!file.open(QIODevice::WriteOnly) || !writeHeader(&file))
+			return false;
+		qint64 kept = sizeof(KHsvRingFileHeader);
+		QMap<quint64, const KHsvRingRecord *>::const_iterator it = order.constEnd();
+		while (it != order.constBegin())
+		{
+			--it;
+			const KHsvRingRecord *record = it.value();
+			const qint64 bytes = qint64(sizeof(KHsvRingRecord)) + ringFilePadded(qint64(record->bytes));
+			if (kept + bytes > RingFileMaxBytes / 2)
+				continue;
+			if (!writeRecord(&file, *record, reinterpret_cast<const uchar *>(record + 1)))
+				return false;
+			kept += bytes;
+		}
+		
+		// 旧文件先打开, 替换后还能在它的文件头中置位
+		// open the old file first so its header can be flagged once replaced
+		QFile old(m_fileName);
+		old.open(QIODevice::ReadWrite);
+#if QT_VERSION >= 0x050100
+		if (!file.commit())
+			return false;
+#else
+		file.close();
+		QFile::remove(m_fileName);
+		if (!QFile::rename(file.fileName(), m_fileName))
+			return false;
+#endif
+		if (old.isOpen())
+			retireFile(&old);
+		
+		QMutexLocker lock(&m_mutex);
+		return mapFile();
+	}
+	
+	// 记录头是否合理, room为记录头之后文件中的字节数
+	// whether a record header makes sense, room is the bytes in the file
+	// after it
+	static bool recordValid(const KHsvRingRecord &record, qint64 room)
+	{
+		return record.magic == RecordMagic && record.width > 0 && record.height > 0
+				&& record.bytesPerLine > 0
+				&& record.bytes == quint64(qint64(record.bytesPerLine) * record.height)
+				&& ringFilePadded(qint64(record.bytes)) <= room;
+	}
+	
+	// 索引data中的记录, 停在不完整或损坏的记录处, *end为索引到的末尾;
+	// 只有文件头不对时返回false
+	// indexes the records in data, stopping at an incomplete or damaged
+	// record with *end at the end of what was indexed; false only for a
+	// wrong header
+	static bool index(const uchar *data, qint64 size, quint64 probe, QHash<KHsvRingKey, Entry> *records,
+					  qint64 *end)
+	{
+		const KHsvRingFileHeader *header = reinterpret_cast<const KHsvRingFileHeader *>(data);
+		if (memcmp(header->magic, "KHSVRING", 8) != 0 || header->byteOrder != 0x01020304
+			|| header->layout != RingFileLayout || header->probe != probe)
+			return false;
+		
+		// 同一个键后面的记录覆盖前面的(前面的校验失败后重新追加的)
+		// a later record of a key overrides an earlier one (appended again
+		// after the earlier one failed its checksum)
+		qint64 offset = sizeof(KHsvRingFileHeader);
+		while (size - offset >= qint64(sizeof(KHsvRingRecord)))
+		{
+			const KHsvRingRecord *record = reinterpret_cast<const KHsvRingRecord *>(data + offset);
+			if (!recordValid(*record, size - offset - qint64(sizeof(KHsvRingRecord))))
+				break;
+			const qint64 padded = ringFilePadded(qint64(record->bytes));
+			
+			KHsvRingKey key;
+			key.size = QSize(record->width, record->height);
+			key.pixelRatio = record->pixelRatio;
+			key.background = record->background;
+			key.ringWidth = record->ringWidth;
+			key.model = KColorCircleHsv::ColorModel(record->model);
+			key.format = QImage::Format(record->format);
+			Entry entry = { record, false };
+			records->insert(key, entry);
+			offset += sizeof(KHsvRingRecord) + padded;
+		}
+		*end = offset;
+		return true;
+	}
+	
+	QString m_fileName;
+	quint64 m_probe;
+	QMutex m_mutex;
+	QMutex m_writeMutex;
+	QSharedPointer<QFile> m_file;
+	const volatile KHsvRingFileHeader *m_header;	// m_file的映射 m_file's mapping
+	qint64 m_nEnd;	// 检查过的记录的末尾 the end of the records checked
+	QList<QSharedPointer<QFile> > m_retired;
+	QHash<KHsvRingKey, Entry> m_index;
+	QHash<KHsvRingKey, quint64> m_used;	// 最近使用的序号 the latest use, as a counter
+	quint64 m_nUse;
+	QSet<KHsvRingKey> m_appended;
+};
+
+
+// 在线程池中把圆环追加到磁盘缓存
+// appends a ring to the disk cache on the thread pool
+class KHsvRingAppend : public QRunnable
+{
+public:
+	KHsvRingAppend(const QSharedPointer<KHsvRingStore> &store, const KHsvRingKey &key, const QImage &ring)
+		: m_store(store), m_key(key), m_ring(ring) {}
+	
+	void run()
+	{
+		m_store->append(m_key, m_ring);
+	}
+	
+private:
+	QSharedPointer<KHsvRingStore> m_store;
+	KHsvRingKey m_key;
+	QImage m_ring;
+};
+
+
+class KHsvRingCache
+{
+public:
+	// 内存中没有时查磁盘缓存, 磁盘缓存的校验不持有缓存的锁
+	// falls back to the disk cache when the ring is not in memory; the disk
+	// cache verifies without holding the cache's lock
+	QImage find(const KHsvRingKey &key)
+	{
+		QMutexLocker lock(&m_mutex);
+		QImage ring = m_rings.value(key);
+		if (!ring.isNull() || !m_store)
+			return ring;
+		QSharedPointer<KHsvRingStore> store = m_store;
+		lock.unlock();
+		
+		ring = store->find(key);
+		if (ring.isNull())
+			return ring;
+		// 其间别的控件可能已经放入了同样的圆环
+		// another widget may have cached the same ring meanwhile
+		lock.relock();
+		QHash<KHsvRingKey, QImage>::iterator it = m_rings.find(key);
+		if (it != m_rings.end())
+			return it.value();
+		m_rings.insert(key, ring);
+		return ring;
+	}
+	
+	// 已有同样的圆环就返回已有的, 否则缓存ring, 并在线程池中写入磁盘缓存
+	// returns the existing ring if there is one, otherwise caches ring and
+	// writes it to the disk cache on the thread pool
+	QImage insert(const KHsvRingKey &key, const QImage &ring)
+	{
+		QMutexLocker lock(&m_mutex);
+		QHash<KHsvRingKey, QImage>::iterator it = m_rings.find(key);
+		if (it != m_rings.end())
+			return it.value();
+		m_rings.insert(key, ring);
+		if (m_store)
+			QThreadPool::globalInstance()->start(new KHsvRingAppend(m_store, key, ring));
+		return ring;
+	}
+	
+	// 换掉磁盘缓存; 旧文件的映射保留到进程退出, 仍有圆环图像指向它
+	// replaces the disk cache; the old file stays mapped until exit as ring
+	// images may still point into it
+	bool setStore(const QString &fileName, quint64 probe)
+	{
+		QMutexLocker lock(&m_mutex);
+		if (m_store)
+			m_retired.append(m_store);
+		m_store.clear();
+		if (fileName.isEmpty())
+			return true;
+		QSharedPointer<KHsvRingStore> store(new KHsvRingStore);
+		if (!store->open(fileName, probe))
+			return false;
+		m_store = store;
+		return true;
+	}
+	
+	// 删除没有控件使用的圆环
+	// drop the rings no widget uses any more
+	void purge()
+	{
+		QMutexLocker lock(&m_mutex);
+		QHash<KHsvRingKey, QImage>::iterator it = m_rings.begin();
+		while (it != m_rings.end())
+		{
+			if (it.value().isDetached())
+				it = m_rings.erase(it);
+			else
+				++it;
+		}
+	}
+	
+private:
+	QMutex m_mutex;
+	QHash<KHsvRingKey, QImage> m_rings;
+	QSharedPointer<KHsvRingStore> m_store;
+	QList<QSharedPointer<KHsvRingStore> > m_retired;
+};
+
+Q_GLOBAL_STATIC(KHsvRingCache, s_ringCache)
+
+
+// ***************** 显示色彩管理 display colour management
+
+/* 显示器的3D LUT: size^3个节点, 红色变化最快(.cube的顺序), 每个节点是
+ * 0..4080(8位值 x 16)的r, g, b, 0. 8位输入先查每个通道的格点偏移和
+ * 以1/4096为单位的小数, 再在包含该点的四面体的4个顶点间插值(四面体插值):
+ * 权重之和为4096, SSE2中_mm_madd_epi16一次算两个顶点.
+ * 构造后只读, 可在任意线程使用.
+ */
+/* A display 3D LUT: size^3 nodes with red varying fastest (the .cube
+ * order), each node r, g, b, 0 in 0..4080 (8-bit value x 16). An 8-bit
+ * input looks up the grid offset and the fraction (in 1/4096) of each
+ * channel, then interpolates between the 4 vertices of the tetrahedron
+ * holding the point (tetrahedral interpolation): the weights sum to 4096
+ * and in SSE2 _mm_madd_epi16 does two vertices at a time.
+ * Read-only once built, usable from any thread.
+ */
+class KHsvDisplayLut
+{
+public:
+	enum { MaxSize = 129, ProfileSize = 33 };
+	
+	// nodes: size^3个[0, 1]的r, g, b; 输入在[domainMin, domainMax]中
+	// nodes: size^3 r, g, b triples in [0, 1]; the input spans [domainMin, domainMax]
+	KHsvDisplayLut(int size, const QVector<float> &nodes, const float *domainMin, const float *domainMax)
+		: m_size(size), m_nodes(size * size * size * 4)
+	{
+		for (int i = 0; i < size * size * size; ++i)
+		{
+			for (int k = 0; k < 3; ++k)
+			{
+				float v = qBound(0.0f, nodes.at(i * 3 + k), 1.0f);
+				m_nodes[i * 4 + k] = qint16(v * 4080.0f + 0.5f);
+			}
+			m_nodes[i * 4 + 3] = 0;
+		}
+		
+		const int stride[3] = { 4, 4 * size, 4 * size * size };
+		for (int k = 0; k < 3; ++k)
+		{
+			const float range = domainMax[k] - domainMin[k];
+			for (int c = 0; c < 256; ++c)
+			{
+				float p = qBound(0.0f, (c / 255.0f - domainMin[k]) / range, 1.0f) * (size - 1);
+				int i = qMin(int(p), size - 2);
+				m_offset[k][c] = i * stride[k];
+				m_frac[k][c] = qint16(qRound((p - i) * 4096.0f));
+			}
+		}
+	}
+	
+	// 读取Adobe/Resolve的.cube文件, 只支持LUT_3D_SIZE; 失败时返回空
+	// reads an Adobe / Resolve .cube file, 3D tables only; null on failure
+	static QSharedPointer<KHsvDisplayLut> fromCube(const QString &fileName)
+	{
+		QFile file(fileName);
+		if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+			return QSharedPointer<KHsvDisplayLut>();
+		
+		int size = 0;
+		float domainMin[3] = { 0.0f, 0.0f, 0.0f };
+		float domainMax[3] = { 1.0f, 1.0f, 1.0f };
+		QVector<float> nodes;
+		while (!file.atEnd())
+		{
+			QByteArray line = file.readLine().simplified();
+			if (line.isEmpty() || line.startsWith('#') || line.startsWith("TITLE"))
+				continue;
+			QList<QByteArray> fields = line.split(' ');
+			const QByteArray &keyword = fields.first();
+			bool ok = true;
+			if (keyword == "LUT_3D_SIZE" && fields.size() == 2)
+			{
+				size = fields.at(1).toInt(&ok);
+				if (!ok || size < 2 || size > MaxSize)
+					return QSharedPointer<KHsvDisplayLut>();
+				nodes.reserve(size * size * size * 3);
+			}
+			else if ((keyword == "DOMAIN_MIN" || keyword == "DOMAIN_MAX") && fields.size() == 4)
+			{
+				float *domain = keyword == "DOMAIN_MIN" ? domainMin : domainMax;
+				for (int k = 0; k < 3 && ok; ++k)
+					domain[k] = fields.at(k + 1).toFloat(&ok);
+			}
+			else if (keyword == "LUT_3D_INPUT_RANGE" && fields.size() == 3)
+			{
+				// Resolve的写法, 三个通道同一个范围
+				// Resolve's spelling, one range for all three channels
+				bool okMax = true;
+				domainMin[0] = domainMin[1] = domainMin[2] = fields.at(1).toFloat(&ok);
+				domainMax[0] = domainMax[1] = domainMax[2] = fields.at(2).toFloat(&okMax);
+				ok = ok && okMax;
+			}
+			else if (fields.size() == 3 && size > 0)
+			{
+				for (int k = 0; k < 3 && ok; ++k)
+					nodes.append(fields.at(k).toFloat(&ok));
+			}
+			else
+				ok = false;	// LUT_1D_SIZE, 节点在尺寸之前等 LUT_1D_SIZE, nodes before the size...
+			if (!ok)
+				return QSharedPointer<KHsvDisplayLut>();
+		}
+		if (size == 0 || nodes.size() != size * size * size * 3)
+			return QSharedPointer<KHsvDisplayLut>();
+		for (int k = 0; k < 3; ++k)
+		{
+			if (!(domainMax[k] > domainMin[k]))
+				return QSharedPointer<KHsvDisplayLut>();
+		}
+		return QSharedPointer<KHsvDisplayLut>(new KHsvDisplayLut(size, nodes, domainMin, domainMax));
+	}
+	
+	// 从sRGB到ICC配置的变换采样成ProfileSize^3的LUT; 无效的配置或Qt < 5.14返回空
+	// samples the transform from sRGB to an ICC profile into a ProfileSize^3
+	// LUT; null for an invalid profile or Qt < 5.14
+	static QSharedPointer<KHsvDisplayLut> fromIccProfile(const QByteArray &profile)
+	{
+#if QT_VERSION >= 0x050e00
+		QColorSpace space = QColorSpace::fromIccProfile(profile);
+		if (!space.isValid())
+			return QSharedPointer<KHsvDisplayLut>();
+		QColorTransform transform = QColorSpace(QColorSpace::SRgb).transformationToColorSpace(space);
+		
+		const int n = ProfileSize;
+		QVector<float> nodes(n * n * n * 3);
+		float *out = nodes.data();
+		for (int b = 0; b < n; ++b)
+		{
+			for (int g = 0; g < n; ++g)
+			{
+				for (int r = 0; r < n; ++r)
+				{
+					QRgba64 c = transform.map(QRgba64::fromRgba64(quint16(r * 65535 / (n - 1)),
+																  quint16(g * 65535 / (n - 1)),
+																  quint16(b * 65535 / (n - 1)), 65535));
+					*out++ = c.red() / 65535.0f;
+					*out++ = c.green() / 65535.0f;
+					*out++ = c.blue() / 65535.0f;
+				}
+			}
+		}
+		const float domainMin[3] = { 0.0f, 0.0f, 0.0f };
+		const float domainMax[3] = { 1.0f, 1.0f, 1.0f };
+		return QSharedPointer<KHsvDisplayLut>(new KHsvDisplayLut(n, nodes, domainMin, domainMax));
+#else
+		Q_UNUSED(profile);
+		return QSharedPointer<KHsvDisplayLut>();
+#endif
+	}
+	
+	// 包含c的四面体: 4个顶点和权重(和为4096)
+	// the tetrahedron holding c: 4 vertices and their weights (summing to 4096)
+	inline void tetrahedron(QRgb c, const qint16 **v, int *w) const
+	{
+		const int r = qRed(c), g = qGreen(c), b = qBlue(c);
+		const int fr = m_frac[0][r], fg = m_frac[1][g], fb = m_frac[2][b];
+		const int dr = 4, dg = 4 * m_size, db = 4 * m_size * m_size;
+		const qint16 *base = m_nodes.constData() + m_offset[0][r] + m_offset[1][g] + m_offset[2][b];
+		
+		// 按小数从大到小依次走向对角的顶点
+		// walk to the opposite corner in the order of decreasing fractions
+		int d1, d2, f1, f2, f3;
+		if (fr >= fg)
+		{
+			if (fg >= fb)
+				d1 = dr, d2 = dr + dg, f1 = fr, f2 = fg, f3 = fb;
+			else if (fr >= fb)
+				d1 = dr, d2 = dr + db, f1 = fr, f2 = fb, f3 = fg;
+			else
+				d1 = db, d2 = db + dr, f1 = fb, f2 = fr, f3 = fg;
+		}
+		else
+		{
+			if (fr >= fb)
+				d1 = dg, d2 = dg + dr, f1 = fg, f2 = fr, f3 = fb;
+			else if (fg >= fb)
+				d1 = dg, d2 = dg + db, f1 = fg, f2 = fb, f3 = fr;
+			else
+				d1 = db, d2 = db + dg, f1 = fb, f2 = fg, f3 = fr;
+		}
+		v[0] = base;
+		v[1] = base + d1;
+		v[2] = base + d2;
+		v[3] = base + dr + dg + db;
+		w[0] = 4096 - f1;
+		w[1] = f1 - f2;
+		w[2] = f2 - f3;
+		w[3] = f3;
+	}
+	
+	inline QRgb map(QRgb c) const
+	{
+		const qint16 *v[4];
+		int w[4];
+		tetrahedron(c, v, w);
+		int rgb[3];
+		for (int k = 0; k < 3; ++k)
+			rgb[k] = (v[0][k] * w[0] + v[1][k] * w[1] + v[2][k] * w[2] + v[3][k] * w[3] + 32768) >> 16;
+		return (c & 0xff000000) | (rgb[0] << 16) | (rgb[1] << 8) | rgb[2];
+	}
+	
+	// 保留alpha; src和dst可以相同
+	// alpha is kept; src and dst may be the same
+	void map(const QRgb *src, QRgb *dst, int count) const
+	{
+		int i = 0;
+#ifdef HSV_HAVE_SSE2
+		for (; i + 4 <= count; i += 4)
+		{
+			__m128i sums[4];
+			for (int j = 0; j < 4; ++j)
+				sums[j] = mapSSE2(src[i + j]);
+			__m128i rgb = _mm_packus_epi16(_mm_packs_epi32(sums[0], sums[1]),
+										   _mm_packs_epi32(sums[2], sums[3]));
+			__m128i alpha = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)),
+										  _mm_set1_epi32(0xff000000));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_or_si128(rgb, alpha));
+		}
+#endif
+		for (; i < count; ++i)
+			dst[i] = map(src[i]);
+	}
+	
+	// 整幅RGB32图像原地变换
+	// transforms a whole RGB32 image in place
+	void mapImage(QImage *image) const
+	{
+		for (int y = 0; y < image->height(); ++y)
+		{
+			QRgb *line = reinterpret_cast<QRgb *>(image->scanLine(y));
+			map(line, line, image->width());
+		}
+	}
+	
+	/* frame的rect写入out: 与ring相同的像素直接取ringOut(变换过的ring),
+	 * 只有三角形和叠加层改变的像素才查LUT
+	 */
+	/* writes rect of frame into out: pixels equal to ring are taken straight
+	 * from ringOut (the transformed ring), only the pixels the triangle and
+	 * overlays changed go through the LUT
+	 */
+	void mapOverRing(const QImage &frame, const QImage &ring, const QImage &ringOut, QImage *out,
+					 const QRect &rect) const
+	{
+		const int end = rect.right() + 1;
+		for (int y = rect.top(); y <= rect.bottom(); ++y)
+		{
+			const QRgb *src = reinterpret_cast<const QRgb *>(frame.constScanLine(y));
+			const QRgb *bg = reinterpret_cast<const QRgb *>(ring.constScanLine(y));
+			const QRgb *bgOut = reinterpret_cast<const QRgb *>(ringOut.constScanLine(y));
+			QRgb *dst = reinterpret_cast<QRgb *>(out->scanLine(y));
+			int x = rect.left();
+			while (x < end)
+			{
+				int run = x;
+				while (run < end && src[run] == bg[run])
+					++run;
+				memcpy(dst + x, bgOut + x, (run - x) * sizeof(QRgb));
+				x = run;
+				while (run < end && src[run] != bg[run])
+					++run;
+				map(src + x, dst + x, run - x);
+				x = run;
+			}
+		}
+	}
+	
+private:
+#ifdef HSV_HAVE_SSE2
+	// 一个像素的b, g, r, 0 (int32)
+	// b, g, r, 0 (int32) of one pixel
+	inline __m128i mapSSE2(QRgb c) const
+	{
+		const qint16 *v[4];
+		int w[4];
+		tetrahedron(c, v, w);
+		__m128i v01 = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(v[0])),
+										 _mm_loadl_epi64(reinterpret_cast<const __m128i *>(v[1])));
+		__m128i v23 = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(v[2])),
+										 _mm_loadl_epi64(reinterpret_cast<const __m128i *>(v[3])));
+		__m128i w01 = _mm_set1_epi32((w[1] << 16) | w[0]);
+		__m128i w23 = _mm_set1_epi32((w[3] << 16) | w[2]);
+		__m128i sum = _mm_add_epi32(_mm_madd_epi16(v01, w01), _mm_madd_epi16(v23, w23));
+		sum = _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(32768)), 16);
+		return _mm_shuffle_epi32(sum, _MM_SHUFFLE(3, 0, 1, 2));
+	}
+#endif
+	
+	int m_size;
+	QVector<qint16> m_nodes;
+	int m_offset[3][256];
+	qint16 m_frac[3][256];
+};
+
+
+// ***************** 紧凑圆环 compact ring
+
+/* 低内存模式的圆环: 每像素一个字节的色相索引加调色板, 约为RGB32的1/4.
+ * 圆边上的抗锯齿像素很少, 单独按行存精确的颜色. expand把任意矩形展开成RGB32.
+ */
+/* The ring of the low-memory mode: one byte of hue index per pixel plus a
+ * palette, about a quarter of RGB32. The few anti-aliased pixels on the
+ * circle edges are kept exactly in a per-row side list. expand() unpacks
+ * any rectangle to RGB32.
+ */
+class KHsvCompactRing
+{
+public:
+	enum
+	{
+		Hues = 254,			// 索引0～253: 色相 indices 0 to 253: hues
+		Background = 254,
+		Edge = 255			// 颜色在m_edges中 colour is in m_edges
+	};
+	
+	QSize size() const
+	{
+		return m_index.size();
+	}
+	
+	void build(const QSize &size, int outerRadius, qreal innerRadius, QRgb background,
+			   const QRgb *hues)
+	{
+		QVector<QRgb> palette(256);
+		for (int i = 0; i < Hues; ++i)
+			palette[i] = hues[i * KHsvRingTables::HueSize / Hues];
+		palette[Background] = background;
+		palette[Edge] = background;
+		m_palette = palette;
+		
+		m_index = QImage(size, QImage::Format_Indexed8);
+		m_index.setColorTable(palette);
+		m_index.fill(Background);
+		m_edges.clear();
+		m_rowEdges.fill(0, size.height() + 1);
+		
+		Sink sink(this, background, hues);
+		scanRing(sink, size.width(), QRect(QPoint(0, 0), size).center(),
+				 outerRadius, innerRadius, 0, size.height());
+		sink.row(size.height());
+	}
+	
+	// buf的(0, 0)对应圆环的origin
+	// pixel (0, 0) of buf maps to origin in the ring
+	void expand(QImage *buf, const QPoint &origin) const
+	{
+		const QRgb *palette = m_palette.constData();
+		const int width = qMin(buf->width(), m_index.width() - origin.x());
+		const int height = qMin(buf->height(), m_index.height() - origin.y());
+		for (int y = 0; y < height; ++y)
+		{
+			const int ry = origin.y() + y;
+			const uchar *src = m_index.constScanLine(ry) + origin.x();
+			QRgb *dst = reinterpret_cast<QRgb *>(buf->scanLine(y));
+			for (int x = 0; x < width; ++x)
+				dst[x] = palette[src[x]];
+			
+			for (int i = m_rowEdges.at(ry); i < m_rowEdges.at(ry + 1); ++i)
+			{
+				const EdgePixel &e = m_edges.at(i);
+				int x = e.x - origin.x();
+				if (x >= 0 && x < width)
+					dst[x] = e.color;
+			}
+		}
+	}
+	
+	int bytes() const
+	{
+		return imageBytes(m_index) + m_edges.size() * int(sizeof(EdgePixel))
+				+ m_rowEdges.size() * int(sizeof(int));
+	}
+	
+private:
+	struct EdgePixel
+	{
+		int x;
+		QRgb color;
+	};
+	
+	struct Sink
+	{
+		KHsvCompactRing *ring;
+		QRgb background;
+		const KHsvRingTables &tables;
+		const QRgb *hues;
+		uchar *scanline;
+		int lastRow;
+		
+		Sink(KHsvCompactRing *r, QRgb bg, const QRgb *h)
+			: ring(r), background(bg), tables(ringTables()), hues(h), scanline(0), lastRow(-1) {}
+		
+		// 行y之前的行的边像素到此为止
+		// edge pixels of the rows before y end here
+		void row(int y)
+		{
+			while (lastRow < y)
+				ring->m_rowEdges[++lastRow] = ring->m_edges.size();
+			if (y < ring->m_index.height())
+				scanline = ring->m_index.scanLine(y);
+		}
+		
+		inline void full(int x, qreal dx, qreal dy)
+		{
+			int i = (int) (tables.hueAt(dx, dy) * (Hues / 360.0) + 0.5);
+			if (i < 0)
+				i += Hues;
+			if (i >= Hues)
+				i -= Hues;
+			scanline[x] = uchar(i);
+		}
+		
+		inline void edge(int x, qreal dx, qreal dy, int a)
+		{
+			QRgb color = tables.colorAt(dx, dy, hues);
+			EdgePixel e;
+			e.x = x;
+			e.color = a < 256 ? blendRgb(color, background, a) : color;
+			ring->m_edges.append(e);
+			scanline[x] = Edge;
+		}
+	};
+	
+	QImage m_index;
+	QVector<QRgb> m_palette;
+	QVector<EdgePixel> m_edges;
+	QVector<int> m_rowEdges;	// 行y的边像素为[m_rowEdges[y], m_rowEdges[y + 1]) row y's edge pixels
+};
+
+
+// ***************** 颜色信箱 colour mailbox
+
+/* 任意线程写入, GUI线程取最新的一个. 写入者不加锁:
+ * 先占一个空闲的槽(owned 0 -> 1), 写入后在seq里放上新的标记, 再用一次交换把latest
+ * 换成这个标记, 换下来的旧槽由这个写入者释放. 所以latest指向的槽永远不会被占用,
+ * 最后一次交换就是最新的值. 标记 = 序号<<5 | 槽号<<1 | 1, 写入中seq为Busy.
+ * 读者读取前后seq都等于latest才算读到, 否则槽已被重用, 重读latest.
+ * 槽都被占用时(超过Slots - 1个写入者同时在写)写入者不等待: 把latest换成Busy, 接管它的槽
+ * 重写后再发布; latest已经是Busy时另一个写入者正在接管, 这次写入被它随后的发布覆盖, 直接丢弃.
+ * 这些写入者是同时进行的, 哪个在后都符合"最后一个值有效".
+ */
+/* Written from any thread, the GUI thread takes the newest value. Writers
+ * take no lock: a post claims a free slot (owned 0 -> 1), fills it, puts a
+ * new tag in its seq and swaps latest to that tag in one exchange; the slot
+ * it swapped out is released by that same writer. The slot latest points at
+ * is therefore never claimed, and the last exchange is the newest value.
+ * tag = ticket<<5 | slot<<1 | 1, seq is Busy while a slot is written. A read
+ * counts only if seq equals latest both before and after copying, otherwise
+ * the slot was reused and latest is read again. A writer never waits: when
+ * every slot is owned (more than Slots - 1 writers posting at once) it swaps
+ * latest to Busy, takes over that slot, rewrites and publishes it; if latest
+ * already is Busy another writer is taking over and its publish overwrites
+ * this post, which is dropped. Those writers are concurrent, so any order
+ * among them still means the last value wins.
+ */
+class KHsvMailbox
+{
+public:
+	enum { Slots = 16, MaxRetries = 4, Busy = 0 };
+	
+	KHsvMailbox() : m_latest(Busy) {}
+	
+	void post(const KHsvF &hsv)
+	{
+		const int ticket = m_ticket.fetchAndAddRelaxed(1);
+		const int first = ticket & (Slots - 1);
+		int index = first;
+		while (!m_slots[index].owned.testAndSetAcquire(0, 1))
+		{
+			index = (index + 1) & (Slots - 1);
+			if (index == first)
+			{
+				// 满了: 接管latest的槽
+				// full: take over the slot latest points at
+				const int latest = m_latest.fetchAndStoreOrdered(Busy);
+				if (latest == Busy)
+					return;
+				index = slotOf(latest);
+				break;
+			}
+		}
+		
+		Slot &slot = m_slots[index];
+		const int tag = (int) (((uint) ticket << 5) | ((uint) index << 1) | 1u);
+		slot.seq.fetchAndStoreOrdered(Busy);
+		slot.h = hsv.h;
+		slot.s = hsv.s;
+		slot.v = hsv.v;
+		slot.seq.fetchAndStoreOrdered(tag);
+		
+		const int old = m_latest.fetchAndStoreOrdered(tag);
+		if (old != Busy)
+			m_slots[slotOf(old)].owned.fetchAndStoreRelease(0);
+	}
+	
+	// 有比*tag新的值时取出并更新*tag
+	// takes the value if it is newer than *tag, and updates *tag
+	bool take(int *tag, KHsvF *hsv)
+	{
+		for (int i = 0; i < MaxRetries; ++i)
+		{
+			const int latest = m_latest.fetchAndAddOrdered(0);
+			if (latest == *tag)
+				return false;
+			Slot &slot = m_slots[slotOf(latest)];
+			if (slot.seq.fetchAndAddOrdered(0) != latest)
+				continue;
+			KHsvF value(slot.h, slot.s, slot.v);
+			if (slot.seq.fetchAndAddOrdered(0) != latest)
+				continue;
+			*tag = latest;
+			*hsv = value;
+			return true;
+		}
+		// 一直被覆盖, 下一帧再取
+		// kept being overwritten, try again next frame
+		return false;
+	}
+	
+	// 还有没取走的值
+	// whether a value newer than tag is waiting
+	bool pending(int tag)
+	{
+		return m_latest.fetchAndAddOrdered(0) != tag;
+	}
+	
+	// 写入者用来避免重复通知GUI线程
+	// lets writers avoid notifying the GUI thread more than once
+	QAtomicInt notified;
+	
+private:
+	static int slotOf(int tag)
+	{
+		return (tag >> 1) & (Slots - 1);
+	}
+	
+	struct Slot
+	{
+		QAtomicInt owned;
+		QAtomicInt seq;
+		volatile qreal h, s, v;
+		
+		Slot() : h(0.0), s(0.0), v(0.0) {}
+	};
+	
+	Slot m_slots[Slots];
+	QAtomicInt m_ticket;
+	QAtomicInt m_latest;
+};
+
+
+// ***************** 颜色分布 colour distribution
+
+/* 参考图像的HSV直方图: 色相360格(只计彩色的像素), (s,v) 64x64格.
+ * 图像分成512x512的块, 每块有自己的直方图, 子区域改变时只重扫相交的块.
+ * 扫描在线程池中并行, 直接读扫描线, 不复制图像; 每次转换4个像素(SSE2).
+ */
+/* HSV histogram of a reference image: 360 hue bins (chromatic pixels only)
+ * and 64x64 (s,v) bins. The image is split into 512x512 blocks with a
+ * histogram each, so a changed sub-rectangle only rescans the blocks it
+ * touches. Blocks are scanned in parallel on the thread pool straight from
+ * the scanlines, without copying the image, converting 4 pixels at a time
+ * (SSE2).
+ */
+class KHsvDistribution
+{
+public:
+	enum
+	{
+		HueBins = 360,
+		SvBins = 64,
+		BlockSize = 512,
+		MinChroma = 10		// 更灰的像素没有可靠的色相 greyer pixels have no reliable hue
+	};
+	
+	struct Block
+	{
+		QRect rect;
+		QVector<quint32> hue;
+		QVector<quint32> sv;	// [v * SvBins + s]
+	};
+	
+	bool isEmpty() const
+	{
+		return m_blocks.isEmpty();
+	}
+	
+	QSize imageSize() const
+	{
+		return m_size;
+	}
+	
+	void build(const QImage &image);
+	void update(const QImage &image, const QRect &rect);
+	
+	// 预乘的热度颜色
+	// premultiplied heat colours
+	QRgb hueHeat(int hue) const
+	{
+		return m_hueHeat[hue];
+	}
+	
+	QRgb svHeat(int s, int v) const
+	{
+		return m_svHeat[v * SvBins + s];
+	}
+	
+	static void scanBlock(const QImage &image, Block *block);
+	
+private:
+	void scan(const QImage &image, const QVector<int> &indices);
+	void accumulate();
+	
+	QSize m_size;
+	QVector<Block> m_blocks;
+	QRgb m_hueHeat[HueBins];
+	QRgb m_svHeat[SvBins * SvBins];
+};
+
+
+// 一次并行扫描: 各线程(包括调用者)从next领块, 全部完成后唤醒调用者
+// one parallel scan: every thread, the caller included, takes blocks from
+// next; the caller is woken once all are done
+class KHsvDistributionJob
+{
+public:
+	KHsvDistributionJob(const QImage *image, KHsvDistribution::Block *blocks,
+						const QVector<int> &indices)
+		: m_image(image), m_blocks(blocks), m_indices(indices),
+		  m_remaining(indices.size()) {}
+	
+	void work()
+	{
+		for (;;)
+		{
+			int i = m_next.fetchAndAddOrdered(1);
+			// 全部领完后不再访问图像和块, 调用者可能已经返回
+			// nothing is touched once all are taken, the caller may have returned
+			if (i >= m_indices.size())
+				return;
+			KHsvDistribution::scanBlock(*m_image, m_blocks + m_indices.at(i));
+			if (!m_remaining.deref())
+			{
+				QMutexLocker lock(&m_mutex);
+				m_done.wakeAll();
+			}
+		}
+	}
+	
+	void wait()
+	{
+		QMutexLocker lock(&m_mutex);
+		while (m_remaining.fetchAndAddOrdered(0) > 0)
+			m_done.wait(&m_mutex);
+	}
+	
+private:
+	const QImage *m_image;
+	KHsvDistribution::Block *m_blocks;
+	QVector<int> m_indices;
+	QAtomicInt m_next;
+	QAtomicInt m_remaining;
+	QMutex m_mutex;
+	QWaitCondition m_done;
+};
+
+
+class KHsvDistributionScan : public QRunnable
+{
+public:
+	KHsvDistributionScan(const QSharedPointer<KHsvDistributionJob> &job) : m_job(job) {}
+	
+	void run()
+	{
+		m_job->work();
+	}
+	
+private:
+	QSharedPointer<KHsvDistributionJob> m_job;
+};
+
+
+// RGB -> 直方图格, 标量和SSE2的运算顺序相同, 分格一致
+// RGB -> histogram bins, the scalar and SSE2 paths use the same float
+// operations and so pick the same bins
+static inline void countPixel(QRgb p, bool hasAlpha, quint32 *hue, quint32 *sv)
+{
+	if (hasAlpha && qAlpha(p) == 0)
+		return;
+	const float r = (float) qRed(p), g = (float) qGreen(p), b = (float) qBlue(p);
+	const float mx = qMax(r, qMax(g, b));
+	const float c = mx - qMin(r, qMin(g, b));
+	
+	const int sb = (int) qMin(c * KHsvDistribution::SvBins / qMax(mx, 1.0f), 63.0f);
+	sv[((int) mx >> 2) * KHsvDistribution::SvBins + sb]++;
+	
+	if (c < KHsvDistribution::MinChroma)
+		return;
+	float num, off;
+	if (mx == r)
+	{
+		num = g - b;
+		off = 0.0f;
+	}
+	else if (mx == g)
+	{
+		num = b - r;
+		off = 2.0f;
+	}
+	else
+	{
+		num = r - g;
+		off = 4.0f;
+	}
+	float h = (num / c + off) * 60.0f;
+	if (h < 0.0f)
+		h += 360.0f;
+	hue[(int) qMin(h, 359.0f)]++;
+}
+
+#ifdef HSV_HAVE_SSE2
+static void countPixelsSSE2(const QRgb *src, int count, bool hasAlpha, quint32 *hue, quint32 *sv)
+{
+	const __m128i mask = _mm_set1_epi32(0xff);
+	const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), four = _mm_set1_ps(4.0f);
+	const __m128 sixty = _mm_set1_ps(60.0f), full = _mm_set1_ps(360.0f), zero = _mm_setzero_ps();
+	const __m128 bins = _mm_set1_ps((float) KHsvDistribution::SvBins);
+	const __m128 maxS = _mm_set1_ps(63.0f), maxH = _mm_set1_ps(359.0f);
+	
+	int i = 0;
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+		__m128 r = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 16), mask));
+		__m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 8), mask));
+		__m128 b = _mm_cvtepi32_ps(_mm_and_si128(px, mask));
+		__m128 mx = _mm_max_ps(r, _mm_max_ps(g, b));
+		__m128 c = _mm_sub_ps(mx, _mm_min_ps(r, _mm_min_ps(g, b)));
+		
+		__m128 isR = _mm_cmpeq_ps(mx, r);
+		__m128 isG = _mm_andnot_ps(isR, _mm_cmpeq_ps(mx, g));
+		__m128 isB = _mm_andnot_ps(_mm_or_ps(isR, isG), _mm_cmpeq_ps(mx, mx));
+		__m128 num = _mm_or_ps(_mm_and_ps(isR, _mm_sub_ps(g, b)),
+					 _mm_or_ps(_mm_and_ps(isG, _mm_sub_ps(b, r)),
+							   _mm_and_ps(isB, _mm_sub_ps(r, g))));
+		__m128 off = _mm_or_ps(_mm_and_ps(isG, two), _mm_and_ps(isB, four));
+		__m128 h = _mm_mul_ps(_mm_add_ps(_mm_div_ps(num, _mm_max_ps(c, one)), off), sixty);
+		h = _mm_add_ps(h, _mm_and_ps(_mm_cmplt_ps(h, zero), full));
+		
+		__m128 sf = _mm_div_ps(_mm_mul_ps(c, bins), _mm_max_ps(mx, one));
+		
+		int hb[4], sb[4], vb[4], cc[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(hb), _mm_cvttps_epi32(_mm_min_ps(h, maxH)));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(sb), _mm_cvttps_epi32(_mm_min_ps(sf, maxS)));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(vb), _mm_srli_epi32(_mm_cvttps_epi32(mx), 2));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(cc), _mm_cvttps_epi32(c));
+		for (int k = 0; k < 4; ++k)
+		{
+			if (hasAlpha && qAlpha(src[i + k]) == 0)
+				continue;
+			sv[vb[k] * KHsvDistribution::SvBins + sb[k]]++;
+			if (cc[k] >= KHsvDistribution::MinChroma)
+				hue[hb[k]]++;
+		}
+	}
+	for (; i < count; ++i)
+		countPixel(src[i], hasAlpha, hue, sv);
+}
+#endif
+
+// 预乘像素还原为直通alpha: 否则V随alpha变暗. alpha为0的像素不计数, 原样保留
+// premultiplied pixel back to straight alpha, otherwise V darkens with alpha.
+// alpha 0 pixels are not counted and are left as they are
+static inline QRgb unpremultiplied(QRgb p)
+{
+#if QT_VERSION >= 0x050300
+	return qUnpremultiply(p);
+#else
+	int a = qAlpha(p);
+	if (a == 0 || a == 255)
+		return p;
+	return qRgba(qMin(255, (qRed(p) * 255 + a / 2) / a),
+				 qMin(255, (qGreen(p) * 255 + a / 2) / a),
+				 qMin(255, (qBlue(p) * 255 + a / 2) / a), a);
+#endif
+}
+
+static void countPixels(const QRgb *src, int count, bool hasAlpha, quint32 *hue, quint32 *sv)
+{
+#ifdef HSV_HAVE_SSE2
+	countPixelsSSE2(src, count, hasAlpha, hue, sv);
+#else
+	for (int i = 0; i < count; ++i)
+		countPixel(src[i], hasAlpha, hue, sv);
+#endif
+}
+
+
+// 扫描一块, 可在任意线程调用. 32位格式直接读扫描线(预乘的逐行还原), 其它格式只转换这一块
+// scan one block, callable from any thread. 32-bit formats are read in
+// place (premultiplied rows are unpremultiplied first), other formats
+// convert just this block
+void KHsvDistribution::scanBlock(const QImage &image, Block *block)
+{
+	block->hue.fill(0, HueBins);
+	block->sv.fill(0, SvBins * SvBins);
+	quint32 *hue = block->hue.data();
+	quint32 *sv = block->sv.data();
+	
+	const QRect &rc = block->rect;
+	QImage::Format format = image.format();
+	if (format == QImage::Format_RGB32 || format == QImage::Format_ARGB32
+		|| format == QImage::Format_ARGB32_Premultiplied)
+	{
+		const bool hasAlpha = format != QImage::Format_RGB32;
+		const bool premultiplied = format == QImage::Format_ARGB32_Premultiplied;
+		QRgb line[BlockSize];
+		for (int y = rc.top(); y <= rc.bottom(); ++y)
+		{
+			const QRgb *src = reinterpret_cast<const QRgb *>(image.constScanLine(y)) + rc.left();
+			if (premultiplied)
+			{
+				for (int x = 0; x < rc.width(); ++x)
+					line[x] = unpremultiplied(src[x]);
+				src = line;
+			}
+			countPixels(src, rc.width(), hasAlpha, hue, sv);
+		}
+		return;
+	}
+	
+	QImage part = image.copy(rc).convertToFormat(QImage::Format_ARGB32);
+	for (int y = 0; y < part.height(); ++y)
+		countPixels(reinterpret_cast<const QRgb *>(part.constScanLine(y)), part.width(),
+					true, hue, sv);
+}
+
+
+// 并行扫描indices中的块
+// scan the blocks in indices in parallel
+void KHsvDistribution::scan(const QImage &image, const QVector<int> &indices)
+{
+	if (indices.isEmpty())
+		return;
+	QSharedPointer<KHsvDistributionJob> job(
+				new KHsvDistributionJob(&image, m_blocks.data(), indices));
+	
+	QThreadPool *pool = QThreadPool::globalInstance();
+	int nWorkers = qMin(indices.size() - 1, QThread::idealThreadCount() - 1);
+	for (int i = 0; i < nWorkers; ++i)
+		pool->start(new KHsvDistributionScan(job), 1);
+	job->work();
+	job->wait();
+}
+
+
+void KHsvDistribution::build(const QImage &image)
+{
+	m_size = image.size();
+	m_blocks.clear();
+	for (int y = 0; y < image.height(); y += BlockSize)
+	{
+		for (int x = 0; x < image.width(); x += BlockSize)
+		{
+			Block block;
+			block.rect = QRect(x, y, BlockSize, BlockSize) & image.rect();
+			m_blocks.append(block);
+		}
+	}
+	
+	QVector<int> indices(m_blocks.size());
+	for (int i = 0; i < indices.size(); ++i)
+		indices[i] = i;
+	scan(image, indices);
+	accumulate();
+}
+
+
+// 只重扫与rect相交的块
+// rescan only the blocks intersecting rect
+void KHsvDistribution::update(const QImage &image, const QRect &rect)
+{
+	if (image.size() != m_size)
+	{
+		build(image);
+		return;
+	}
+	
+	QVector<int> indices;
+	for (int i = 0; i < m_blocks.size(); ++i)
+	{
+		if (m_blocks.at(i).rect.intersects(rect))
+			indices.append(i);
+	}
+	scan(image, indices);
+	accumulate();
+}
+
+
+// 汇总各块, 按对数密度生成热度颜色 (黑-红-黄-白)
+// sum the blocks and map log density to heat colours (black-red-yellow-white)
+void KHsvDistribution::accumulate()
+{
+	QVector<quint32> hue(HueBins, 0);
+	QVector<quint32> sv(SvBins * SvBins, 0);
+	for (int i = 0; i < m_blocks.size(); ++i)
+	{
+		const Block &block = m_blocks.at(i);
+		for (int k = 0; k < HueBins; ++k)
+			hue[k] += block.hue.at(k);
+		for (int k = 0; k < SvBins * SvBins; ++k)
+			sv[k] += block.sv.at(k);
+	}
+	
+	const QVector<quint32> *hists[2] = { &hue, &sv };
+	QRgb *heats[2] = { m_hueHeat, m_svHeat };
+	for (int n = 0; n < 2; ++n)
+	{
+		const QVector<quint32> &hist = *hists[n];
+		quint32 maxCount = 0;
+		for (int k = 0; k < hist.size(); ++k)
+			maxCount = qMax(maxCount, hist.at(k));
+		
+		for (int k = 0; k < hist.size(); ++k)
+		{
+			if (hist.at(k) == 0)
+			{
+				heats[n][k] = 0;
+				continue;
+			}
+			qreal t = log(1.0 + hist.at(k)) / log(1.0 + maxCount);
+			qreal a = 0.25 + 0.55 * t;
+			qreal r = qMin(1.0, t * 3.0);
+			qreal g = qBound(0.0, t * 3.0 - 1.0, 1.0);
+			qreal b = qBound(0.0, t * 3.0 - 2.0, 1.0);
+			heats[n][k] = qRgba(qRound(r * a * 255), qRound(g * a * 255),
+								qRound(b * a * 255), qRound(a * 255));
+		}
+	}
+}
+
+
+// ***************** 叠加层 overlays
+
+// 不用QPainter, 直接按到笔画的距离求覆盖率, 只画clip内的像素, 不分配内存
+// drawn without QPainter from the distance to the stroke, only pixels inside
+// clip are touched and nothing is allocated
+
+// 线段, 方形端点 (与QPen默认的Qt::SquareCap一致)
+// a line segment with square caps (QPen's default Qt::SquareCap)
+template <class Dst>
+static void strokeLineFormat(QImage *buf, const QRect &clip, const QPointF &p0, const QPointF &p1,
+							 int width, QRgb color, bool antialias)
+{
+	const qreal hw = qMax(width, 1) / 2.0;
+	qreal dx = p1.x() - p0.x();
+	qreal dy = p1.y() - p0.y();
+	qreal len = sqrt(dx * dx + dy * dy);
+	qreal ux = 1.0, uy = 0.0;
+	if (len > 1e-9)
+	{
+		ux = dx / len;
+		uy = dy / len;
+	}
+	
+	QRect area = QRectF(p0, p1).normalized().adjusted(-hw - 1, -hw - 1, hw + 1, hw + 1)
+				 .toAlignedRect() & clip & buf->rect();
+	for (int y = area.top(); y <= area.bottom(); ++y)
+	{
+		typename Dst::Pixel *scanline = reinterpret_cast<typename Dst::Pixel *>(buf->scanLine(y));
+		qreal py = y + 0.5 - p0.y();
+		for (int x = area.left(); x <= area.right(); ++x)
+		{
+			qreal px = x + 0.5 - p0.x();
+			qreal t = px * ux + py * uy;
+			qreal d = qMin(hw - qAbs(py * ux - px * uy), qMin(t + hw, len + hw - t));
+			int a = antialias ? (int) ((d + 0.5) * 256.0 + 0.5) : (d >= 0.0 ? 256 : 0);
+			if (a > 0)
+				scanline[x] = Dst::blend(color, scanline[x], qMin(a, 256), x, y);
+		}
+	}
+}
+
+// 圆周
+// a circle outline
+template <class Dst>
+static void strokeCircleFormat(QImage *buf, const QRect &clip, const QPointF &center, qreal radius,
+							   int width, QRgb color, bool antialias)
+{
+	const qreal hw = qMax(width, 1) / 2.0;
+	const qreal reach = radius + hw + 1;
+	QRect area = QRectF(center.x() - reach, center.y() - reach, reach * 2, reach * 2)
+				 .toAlignedRect() & clip & buf->rect();
+	for (int y = area.top(); y <= area.bottom(); ++y)
+	{
+		typename Dst::Pixel *scanline = reinterpret_cast<typename Dst::Pixel *>(buf->scanLine(y));
+		qreal dy = y + 0.5 - center.y();
+		for (int x = area.left(); x <= area.right(); ++x)
+		{
+			qreal dx = x + 0.5 - center.x();
+			qreal d = hw - qAbs(sqrt(dx * dx + dy * dy) - radius);
+			int a = antialias ? (int) ((d + 0.5) * 256.0 + 0.5) : (d >= 0.0 ? 256 : 0);
+			if (a > 0)
+				scanline[x] = Dst::blend(color, scanline[x], qMin(a, 256), x, y);
+		}
+	}
+}
+
+static void strokeLine(QImage *buf, const QRect &clip, const QPointF &p0, const QPointF &p1,
+					   int width, QRgb color, bool antialias = true)
+{
+	HSV_WITH_FORMAT(buf->format(), strokeLineFormat, (buf, clip, p0, p1, width, color, antialias));
+}
+
+static void strokeCircle(QImage *buf, const QRect &clip, const QPointF &center, qreal radius,
+						 int width, QRgb color, bool antialias = true)
+{
+	HSV_WITH_FORMAT(buf->format(), strokeCircleFormat, (buf, clip, center, radius, width, color, antialias));
+}
+
+
+// ***************** 帧计时 frame timing
+
+#if QT_VERSION >= 0x050300
+Q_LOGGING_CATEGORY(lcHsvFrame, "kcolorcirclehsv.frame")
+#endif
+
+/* 各阶段的耗时和像素数. 每阶段保留最近Window个样本算p50/p99, 另有固定大小的
+ * 事件环用于导出Chrome trace. 只在开启时存在, 记录时不分配内存.
+ * 渲染带在工作线程中记录, 所以加锁.
+ */
+/* Per-stage durations and pixel counts. The last Window samples of each stage
+ * give p50/p99, and a fixed-size event ring feeds the Chrome trace export.
+ * Exists only while enabled and never allocates while recording. Render bands
+ * record from worker threads, hence the lock.
+ */
+class KHsvFrameStats
+{
+public:
+	enum
+	{
+		Window = 256,
+		MaxEvents = 4096,
+		FrameEvent = KColorCircleHsv::StageCount,	// trace中的整帧 whole frames in the trace
+		LogInterval = 120
+	};
+	
+	KHsvFrameStats(bool log) : m_log(log), m_events(MaxEvents)
+	{
+		m_clock.start();
+		reset();
+	}
+	
+	qint64 now() const
+	{
+		return m_clock.nsecsElapsed();
+	}
+	
+	void record(int stage, qint64 start, qint64 duration, qint64 pixels)
+	{
+		QMutexLocker lock(&m_mutex);
+		if (stage < KColorCircleHsv::StageCount)
+		{
+			Stage &s = m_stages[stage];
+			s.samples[s.count % Window] = duration;
+			++s.count;
+			s.pixels += pixels;
+		}
+		
+		Event &e = m_events[m_nEvents % MaxEvents];
+		e.stage = stage;
+		e.thread = quintptr(QThread::currentThreadId());
+		e.start = start;
+		e.duration = duration;
+		e.pixels = pixels;
+		++m_nEvents;
+	}
+	
+	// 一帧结束, 返回是否该输出一次统计
+	// a frame ended, returns whether a summary is due
+	bool endFrame(qint64 start, qint64 duration, bool dropped)
+	{
+		record(FrameEvent, start, duration, 0);
+		QMutexLocker lock(&m_mutex);
+		if (dropped)
+			++m_nDropped;
+		return m_log && ++m_nFrames % LogInterval == 0;
+	}
+	
+	KColorCircleHsv::StageStats stats(int stage) const
+	{
+		qint64 samples[Window];
+		KColorCircleHsv::StageStats result;
+		{
+			QMutexLocker lock(&m_mutex);
+			const Stage &s = m_stages[stage];
+			result.count = s.count;
+			result.pixels = s.pixels;
+			int n = qMin(s.count, int(Window));
+			memcpy(samples, s.samples, n * sizeof(qint64));
+		}
+		
+		int n = qMin(result.count, int(Window));
+		if (n > 0)
+		{
+			result.p50 = percentile(samples, n, 50);
+			result.p99 = percentile(samples, n, 99);
+		}
+		return result;
+	}
+	
+	int droppedFrames() const
+	{
+		QMutexLocker lock(&m_mutex);
+		return m_nDropped;
+	}
+	
+	void reset()
+	{
+		QMutexLocker lock(&m_mutex);
+		for (int i = 0; i < KColorCircleHsv::StageCount; ++i)
+		{
+			m_stages[i].count = 0;
+			m_stages[i].pixels = 0;
+		}
+		m_nEvents = 0;
+		m_nFrames = 0;
+		m_nDropped = 0;
+	}
+	
+	void logSummary() const
+	{
+		static const char *const names[] = { "background", "triangle", "overlays", "blit" };
+		for (int i = 0; i < KColorCircleHsv::StageCount; ++i)
+		{
+			KColorCircleHsv::StageStats s = stats(i);
+			if (!s.count)
+				continue;
+#if QT_VERSION >= 0x050300
+			qCDebug(lcHsvFrame, "%s: n=%d p50=%.3fms p99=%.3fms pixels=%lld",
+					names[i], s.count, s.p50 / 1e6, s.p99 / 1e6, s.pixels);
+#else
+			qDebug("KColorCircleHsv %s: n=%d p50=%.3fms p99=%.3fms pixels=%lld",
+				   names[i], s.count, s.p50 / 1e6, s.p99 / 1e6, s.pixels);
+#endif
+		}
+#if QT_VERSION >= 0x050300
+		qCDebug(lcHsvFrame, "dropped frames: %d", droppedFrames());
+#else
+		qDebug("KColorCircleHsv dropped frames: %d", droppedFrames());
+#endif
+	}
+	
+	// Chrome trace-event JSON (chrome://tracing, Perfetto), 时间单位为微秒
+	// Chrome trace-event JSON (chrome://tracing, Perfetto), times in microseconds
+	bool writeTrace(const QString &fileName) const
+	{
+		static const char *const names[] = { "background", "triangle", "overlays", "blit", "frame" };
+		
+		QVector<Event> events;
+		{
+			QMutexLocker lock(&m_mutex);
+			int n = qMin(m_nEvents, int(MaxEvents));
+			int first = m_nEvents - n;
+			events.reserve(n);
+			for (int i = first; i < m_nEvents; ++i)
+				events.append(m_events.at(i % MaxEvents));
+		}
+		
+		QFile file(fileName);
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			return false;
+		
+		QByteArray json("{\"traceEvents\":[");
+		for (int i = 0; i < events.size(); ++i)
+		{
+			const Event &e = events.at(i);
+			if (i)
+				json += ',';
+			json += "\n{\"name\":\"";
+			json += names[e.stage];
+			json += "\",\"ph\":\"X\",\"pid\":1,\"tid\":";
+			json += QByteArray::number(qint64(e.thread));
+			json += ",\"ts\":";
+			json += QByteArray::number(e.start / 1000.0, 'f', 3);
+			json += ",\"dur\":";
+			json += QByteArray::number(e.duration / 1000.0, 'f', 3);
+			json += ",\"args\":{\"pixels\":";
+			json += QByteArray::number(e.pixels);
+			json += "}}";
+		}
+		json += "\n]}\n";
+		return file.write(json) == json.size();
+	}
+	
+private:
+	struct Stage
+	{
+		qint64 samples[Window];
+		int count;
+		qint64 pixels;
+	};
+	
+	struct Event
+	{
+		int stage;
+		quintptr thread;
+		qint64 start;
+		qint64 duration;
+		qint64 pixels;
+	};
+	
+	static qint64 percentile(qint64 *samples, int n, int p)
+	{
+		int k = qMin(n - 1, n * p / 100);
+		std::nth_element(samples, samples + k, samples + n);
+		return samples[k];
+	}
+	
+	bool m_log;
+	QElapsedTimer m_clock;
+	mutable QMutex m_mutex;
+	Stage m_stages[KColorCircleHsv::StageCount];
+	QVector<Event> m_events;
+	int m_nEvents;
+	int m_nFrames;
+	int m_nDropped;
+};
+
+
+// 作用域计时, stats为空时什么也不做
+// times its scope, does nothing when stats is null
+class KHsvStageTimer
+{
+public:
+	KHsvStageTimer(KHsvFrameStats *stats, int stage, qint64 pixels = 0)
+		: m_stats(stats), m_stage(stage), m_start(0), m_pixels(pixels)
+	{
+		if (m_stats)
+			m_start = m_stats->now();
+	}
+	
+	~KHsvStageTimer()
+	{
+		if (m_stats)
+			m_stats->record(m_stage, m_start, m_stats->now() - m_start, m_pixels);
+	}
+	
+	void setPixels(qint64 pixels)
+	{
+		m_pixels = pixels;
+	}
+	
+private:
+	KHsvFrameStats *m_stats;
+	int m_stage;
+	qint64 m_start;
+	qint64 m_pixels;
+};
+
+
+
+// ***************** 后台渲染 background rendering
+
+/* 一次后台渲染. 按扫描线分成若干带, 每个带在线程池中渲染同一组图像的不同行,
+ * 最后完成的带通知控件. 被更新的尺寸或色相取代时取消, 未开始的带直接退出.
+ *   Frame : 圆环 + 底图(圆环 + 三角形), 尺寸改变时
+ *   Tile  : 一个色相的三角形, 色相改变且不在缓存中时
+ */
+/* One background render. Rows are split into bands, each band renders its
+ * rows of the same images on the thread pool, and the last band to finish
+ * notifies the widget. Cancelled when a newer size or hue supersedes it;
+ * bands that have not started yet just return.
+ *   Frame : ring + base (ring + triangle), on a resize
+ *   Tile  : the triangle of one hue, on a hue change that missed the cache
+ */
+class KHsvRenderJob
+{
+public:
+	enum Kind
+	{
+		Frame,
+		Tile
+	};
+	
+	KHsvRenderJob(Kind k) : kind(k), hue(0), ringShared(false), outerRadius(0),
+		innerRadius(0.0), background(0), ringBits(0), baseBits(0), tileBits(0), m_running(0) {}
+	
+	Kind kind;
+	int hue;
+	QColor hueColor;
+	KColorCircleHsv::TriangleGeometry geometry;
+	QPointF vertices[3];	// 目标图像中的三角形顶点 triangle vertices in the target image
+	
+	// Frame; ringShared: ring来自共享缓存, 只读
+	// Frame; ringShared: ring came from the shared cache and is read-only
+	QImage ring;
+	QImage base;
+	KHsvRingKey ringKey;
+	bool ringShared;
+	QPoint ringCenter;
+	int outerRadius;
+	qreal innerRadius;
+	QRgb background;
+	
+	// Tile
+	KColorCircleHsv::TriangleTile tile;
+	
+	// 各图像的像素, 在GUI线程上取一次: 多个带同时调用bits()会在QImage::detach中竞争
+	// the pixels of each image, taken once on the GUI thread: several bands
+	// calling bits() at once would race inside QImage::detach
+	uchar *ringBits;
+	uchar *baseBits;
+	uchar *tileBits;
+	
+	QSharedPointer<KHsvFrameStats> stats;
+	
+	void setBands(int n)
+	{
+		m_remaining.fetchAndStoreOrdered(n);
+		m_running = n;
+	}
+	
+	void cancel()
+	{
+		m_cancelled.fetchAndStoreOrdered(1);
+	}
+	
+	bool isCancelled()
+	{
+		return m_cancelled.fetchAndAddOrdered(0) != 0;
+	}
+	
+	bool isFinished()
+	{
+		return m_remaining.fetchAndAddOrdered(0) == 0;
+	}
+	
+	// 一个带渲染完成, 返回是否是最后一个
+	// one band rendered, returns whether it was the last
+	bool bandDone()
+	{
+		return !m_remaining.deref();
+	}
+	
+	// 带退出(包括被取消的)
+	// a band exits (cancelled ones included)
+	void bandExit()
+	{
+		QMutexLocker lock(&m_mutex);
+		if (--m_running == 0)
+			m_exited.wakeAll();
+	}
+	
+	bool hasExited()
+	{
+		QMutexLocker lock(&m_mutex);
+		return m_running == 0;
+	}
+	
+	// 等待所有带退出
+	// wait for every band to exit
+	void wait()
+	{
+		QMutexLocker lock(&m_mutex);
+		while (m_running > 0)
+			m_exited.wait(&m_mutex);
+	}
+	
+private:
+	QAtomicInt m_cancelled;
+	QAtomicInt m_remaining;
+	QMutex m_mutex;
+	QWaitCondition m_exited;
+	int m_running;
+};
+
+
+class KHsvRenderBand : public QRunnable
+{
+public:
+	KHsvRenderBand(const QSharedPointer<KHsvRenderJob> &job, int y0, int y1, QObject *receiver)
+		: m_job(job), m_y0(y0), m_y1(y1), m_receiver(receiver) {}
+	
+	void run()
+	{
+		if (!m_job->isCancelled())
+		{
+			KColorCircleHsv::renderBand(m_job.data(), m_y0, m_y1);
+			if (m_job->bandDone() && !m_job->isCancelled())
+				QMetaObject::invokeMethod(m_receiver, "renderFinished", Qt::QueuedConnection);
+		}
+		// 控件析构时等待它启动过的所有任务(包括已被取代的), 所以m_receiver在此之前一直有效
+		// the widget's destructor waits for every job it started (superseded
+		// ones included), so m_receiver is valid until here
+		m_job->bandExit();
+	}
+	
+private:
+	QSharedPointer<KHsvRenderJob> m_job;
+	int m_y0, m_y1;
+	QObject *m_receiver;
+};
+
+
+// 不持有数据的QImage, 各带各自使用, 避免多个线程共用同一个QImage对象
+// a non-owning QImage per band, so threads never share one QImage object
+static QImage imageView(uchar *bits, const QImage &like)
+{
+	return QImage(bits, like.width(), like.height(), like.bytesPerLine(), like.format());
+}
+
+
+// 渲染一个带的行[y0, y1), 在工作线程中调用
+// render the rows [y0, y1) of one band, called on a worker thread
+void KColorCircleHsv::renderBand(KHsvRenderJob *job, int y0, int y1)
+{
+	const QPointF *v = job->vertices;
+	KHsvFrameStats *stats = job->stats.data();
+	if (job->kind == KHsvRenderJob::Frame)
+	{
+		QImage base = imageView(job->baseBits, job->base);
+		if (!job->ringShared)
+		{
+			KHsvStageTimer timer(stats, StageBackground, qint64(y1 - y0) * job->ring.width());
+			QImage ring = imageView(job->ringBits, job->ring);
+			QImage rows(ring.scanLine(y0), ring.width(), y1 - y0, ring.bytesPerLine(), ring.format());
+			rows.fill(QColor(job->background));
+			drawRing(&ring, job->ringCenter, job->outerRadius, job->innerRadius, job->background, y0, y1,
+					 job->ringKey.model);
+		}
+		KHsvStageTimer timer(stats, StageTriangle, qint64(y1 - y0) * job->base.width());
+		const QImage &ring = job->ring;
+		const int bytes = ring.width() * (ring.depth() / 8);
+		for (int y = y0; y < y1; ++y)
+			memcpy(base.scanLine(y), ring.constScanLine(y), bytes);
+		drawTriangle(&base, v[0], v[1], v[2], job->hueColor, y0, y1, 0, true, job->geometry.model);
+	}
+	else
+	{
+		KHsvStageTimer timer(stats, StageTriangle, qint64(y1 - y0) * job->tile.image.width());
+		QImage tile = imageView(job->tileBits, job->tile.image);
+		const int bytes = tile.width() * (tile.depth() / 8);
+		for (int y = y0; y < y1; ++y)
+			memset(tile.scanLine(y), 0, bytes);
+		drawTriangle(&tile, v[0], v[1], v[2], job->hueColor, y0, y1, 0, true, job->geometry.model);
+	}
+}
+
+
+// ***************** 渲染调度 render scheduling
+
+/* 所有控件共用的渲染调度器(只在GUI线程): 尺寸, 主题和设置改变后的渲染
+ * (预热三角形缓存 + paintImage)不立即执行, 而是提交到这里. 每个控件最多一个
+ * 待办请求; 每帧(FrameInterval)按优先级依次执行, 用完FrameBudget毫秒就留到下一帧.
+ * 隐藏或完全被遮住的控件不执行, 直到paintEvent时(显示出来)自己执行.
+ */
+/* The render scheduler shared by every widget (GUI thread only): renders
+ * after a size, theme or setting change (triangle cache warm-up +
+ * paintImage) are submitted here instead of running at once. Each widget
+ * has at most one pending request; every frame (FrameInterval) requests
+ * run in priority order until FrameBudget milliseconds are spent, the rest
+ * wait for the next frame. Hidden or fully covered widgets are skipped
+ * until their paintEvent (when they are exposed) runs the request itself.
+ */
+class KHsvRenderScheduler : public QObject
+{
+public:
+	enum { FrameInterval = 16, FrameBudget = 8 };
+	
+	// 随应用程序对象销毁
+	// destroyed along with the application object
+	static KHsvRenderScheduler *instance(bool create = true)
+	{
+		if (!s_instance && create && QCoreApplication::instance())
+			s_instance = new KHsvRenderScheduler(QCoreApplication::instance());
+		return s_instance;
+	}
+	
+	void submit(KColorCircleHsv *w)
+	{
+		if (!m_pending.contains(w))
+			m_pending.append(w);
+		if (!m_timer.isActive())
+			m_timer.start(0, this);
+	}
+	
+	void cancel(KColorCircleHsv *w)
+	{
+		m_pending.removeAll(w);
+	}
+	
+	// 控件可见时可以执行: 有焦点 > 活动窗口 > 其它可见的; 隐藏的返回-1
+	// a widget runs when it is visible: focused > active window > other
+	// visible ones; -1 for hidden ones
+	static int priority(const KColorCircleHsv *w)
+	{
+		if (!w->isVisible() || w->window()->isMinimized() || w->visibleRegion().isEmpty())
+			return -1;
+		if (w->hasFocus())
+			return 2;
+		return w->isActiveWindow() ? 1 : 0;
+	}
+	
+protected:
+	void timerEvent(QTimerEvent *e)
+	{
+		if (e->timerId() != m_timer.timerId())
+		{
+			QObject::timerEvent(e);
+			return;
+		}
+		m_timer.stop();
+		
+		// 按优先级的稳定排序, 同级的先提交先执行
+		// a stable sort by priority, first submitted first run within a level
+		QVector<int> levels(m_pending.size());
+		for (int i = 0; i < m_pending.size(); ++i)
+			levels[i] = priority(m_pending.at(i));
+		QList<KColorCircleHsv *> queue;
+		for (int level = 2; level >= 0; --level)
+		{
+			for (int i = 0; i < m_pending.size(); ++i)
+			{
+				if (levels.at(i) == level)
+					queue.append(m_pending.at(i));
+			}
+		}
+		
+		QElapsedTimer clock;
+		clock.start();
+		int i = 0;
+		for (; i < queue.size() && (i == 0 || clock.elapsed() < FrameBudget); ++i)
+		{
+			// 前面的渲染可能已经处理了它(例如同步绘制)
+			// an earlier render may have handled it already (a synchronous paint, say)
+			if (m_pending.contains(queue.at(i)))
+				queue.at(i)->runScheduledRender();
+		}
+		if (i < queue.size())
+			m_timer.start(FrameInterval, this);
+	}
+	
+private:
+	KHsvRenderScheduler(QObject *parent) : QObject(parent) {}
+	~KHsvRenderScheduler()
+	{
+		s_instance = 0;
+	}
+	
+	QList<KColorCircleHsv *> m_pending;
+	QBasicTimer m_timer;
+	static KHsvRenderScheduler *s_instance;
+};
+
+KHsvRenderScheduler *KHsvRenderScheduler::s_instance = 0;
+
+
+KColorCircleHsv::KColorCircleHsv(QWidget *parent)
+	: QWidget(parent), m_imgBG(sizeHint(), QImage::Format_RGB32),
+	m_triangleCache(new KHsvTriangleCache), m_selMode(None)
+{
+	setSizePolicy(QSizePolicy::Minimum, QSizePolicy::Minimum);
+	setFocusPolicy(Qt::StrongFocus);
+	setMinimumSize(100, 100);
+	m_bNeedUpdateBackground = true;
+	m_nOuterRadius = 0;
+	m_dOuterInnerWidth = 0.0;
+	m_nPenWidth = 0;
+	m_nSVEllipseSize = 0;
+	m_nCurrentHue = 0;
+	m_nTriangleHue = -1;
+	m_colorDelivery = DeliverImmediate;
+	m_nColorDeliveryRate = 60;
+	m_bColorPending = false;
+	m_bThreadedRendering = true;
+	m_nPaintAllocations = -1;
+	m_bLowMemory = false;
+	m_bPyramidCurrent = false;
+	m_nPreviewBaseHue = -1;
+	m_nPreviewHue = -1;
+	m_dPixelRatio = 1.0;
+	m_nFrameBudget = 0;
+	m_quality = QualityFull;
+	m_dFrameCost = 0.0;
+	m_bDraftTriangle = false;
+	m_bDragPending = false;
+	m_colorModel = ModelHsv;
+	m_outputFormat = QImage::Format_RGB32;
+	m_nDisplayRingKey = 0;
+	m_nScheduledRender = 0;
+	m_mailbox = QSharedPointer<KHsvMailbox>(new KHsvMailbox);
+	m_nMailboxTag = 0;
+#if QT_VERSION >= 0x050300
+	if (lcHsvFrame().isDebugEnabled())
+		setProfilingEnabled(true);
+#endif
+	if (!qgetenv("KCOLORCIRCLEHSV_PROFILE").isEmpty())
+		setProfilingEnabled(true);
+	calRadian(m_nCurrentHue);
+	m_dSelectorPos = pointFromHsv(m_hsv);
+	m_committedHsv = m_hsv;
+}
+
+
+KColorCircleHsv::~KColorCircleHsv()
+{
+	if (KHsvRenderScheduler *scheduler = KHsvRenderScheduler::instance(false))
+		scheduler->cancel(this);
+	
+	// 让后台预热尽快结束, 缓存由它们共享持有
+	// let warm-ups finish early, they share ownership of the cache
+	m_triangleCache->reset(TriangleGeometry());
+	
+	// 带中持有this, 必须等它们都退出, 包括被取代但还在运行的任务
+	// bands hold this, wait for all of them to exit, superseded jobs that
+	// are still running included
+	for (int i = 0; i < m_liveJobs.size(); ++i)
+	{
+		m_liveJobs.at(i)->cancel();
+		m_liveJobs.at(i)->wait();
+	}
+	
+	// 放开共享的圆环 (程序退出时缓存可能已经销毁)
+	// let go of the shared ring (the cache may be gone at exit)
+	m_liveJobs.clear();
+	m_frameJob.clear();
+	m_tileJob.clear();
+	m_imgBG = QImage();
+	if (KHsvRingCache *cache = s_ringCache())
+		cache->purge();
+}
+
+
+// 在线程池中渲染尺寸和色相改变, GUI线程只贴完成的图像(默认开启)
+// render resizes and hue changes on the thread pool, the GUI thread only
+// blits finished images (on by default)
+void KColorCircleHsv::setThreadedRendering(bool on)
+{
+	m_bThreadedRendering = on;
+}
+
+
+bool KColorCircleHsv::threadedRendering() const
+{
+	return m_bThreadedRendering;
+}
+
+
+// 参考图像的颜色分布, 作为热度图画在圆环和三角形上; 空图像清除
+// 并行扫描, 调用返回时已完成
+// colour distribution of a reference image, drawn as a heat map over the
+// ring and triangle; a null image clears it. Scanned in parallel, done when
+// the call returns
+void KColorCircleHsv::setDistributionImage(const QImage &image)
+{
+	if (image.isNull())
+		m_distribution.clear();
+	else
+	{
+		if (!m_distribution)
+			m_distribution = QSharedPointer<KHsvDistribution>(new KHsvDistribution);
+		m_distribution->build(image);
+	}
+	m_dirty.add(m_buf.rect());
+	update();
+}
+
+
+// 参考图像的changed区域改变了, 只重扫这部分
+// the changed area of the reference image was modified, rescan only that
+void KColorCircleHsv::updateDistributionImage(const QImage &image, const QRect &changed)
+{
+	if (!m_distribution || image.isNull())
+	{
+		setDistributionImage(image);
+		return;
+	}
+	m_distribution->update(image, changed);
+	m_dirty.add(m_buf.rect());
+	update();
+}
+
+
+// 上次paintImage中的内存分配次数, 编译时没有定义KCOLORCIRCLEHSV_ALLOC_STATS则为-1
+// heap allocations in the last paintImage, -1 unless built with
+// KCOLORCIRCLEHSV_ALLOC_STATS
+int KColorCircleHsv::paintAllocations() const
+{
+	return m_nPaintAllocations;
+}
+
+// counter()返回GUI线程到目前为止的分配次数; 编译时没有定义KCOLORCIRCLEHSV_ALLOC_STATS则忽略
+// counter() returns the GUI thread's allocations so far; ignored unless built
+// with KCOLORCIRCLEHSV_ALLOC_STATS
+void KColorCircleHsv::setAllocationCounter(int (*counter)())
+{
+#ifdef KCOLORCIRCLEHSV_ALLOC_STATS
+	s_allocationCounter = counter;
+#else
+	Q_UNUSED(counter);
+#endif
+}
+
+
+// 开关逐阶段计时, 关闭时不占内存
+// turns per-stage timing on or off, nothing is allocated while off
+void KColorCircleHsv::setProfilingEnabled(bool on)
+{
+	if (on == !m_frameStats.isNull())
+		return;
+	if (!on)
+	{
+		m_frameStats.clear();
+		return;
+	}
+	
+	bool log = !qgetenv("KCOLORCIRCLEHSV_PROFILE").isEmpty();
+#if QT_VERSION >= 0x050300
+	log = log || lcHsvFrame().isDebugEnabled();
+#endif
+	m_frameStats = QSharedPointer<KHsvFrameStats>(new KHsvFrameStats(log));
+}
+
+
+bool KColorCircleHsv::isProfilingEnabled() const
+{
+	return !m_frameStats.isNull();
+}
+
+
+KColorCircleHsv::StageStats KColorCircleHsv::stageStats(FrameStage stage) const
+{
+	if (!m_frameStats || stage < 0 || stage >= StageCount)
+		return StageStats();
+	return m_frameStats->stats(stage);
+}
+
+
+int KColorCircleHsv::droppedFrames() const
+{
+	return m_frameStats ? m_frameStats->droppedFrames() : 0;
+}
+
+
+void KColorCircleHsv::resetProfiling()
+{
+	if (m_frameStats)
+		m_frameStats->reset();
+}
+
+
+// 导出最近的事件(最多4096个), 未开启计时时返回false
+// dump the most recent events (up to 4096), returns false when profiling is off
+bool KColorCircleHsv::writeTrace(const QString &fileName) const
+{
+	return m_frameStats && m_frameStats->writeTrace(fileName);
+}
+
+
+void KColorCircleHsv::setLowMemoryMode(bool on)
+{
+	if (on == m_bLowMemory)
+		return;
+	m_bLowMemory = on;
+	
+	if (on)
+	{
+		// 放开所有整幅图像和三角形缓存, 取消进行中的渲染
+		// let go of every full-size image and the triangle cache, cancel
+		// the renders in progress
+		if (m_frameJob)
+			m_frameJob->cancel();
+		if (m_tileJob)
+			m_tileJob->cancel();
+		m_frameJob.clear();
+		m_tileJob.clear();
+		m_triangleCache->reset(TriangleGeometry());
+		m_imgBG = QImage();
+		m_imgBase = QImage();
+		m_buf = QImage();
+		m_imgPreview = QImage();
+		m_imgPreviewBase = QImage();
+		m_imgBGDisplay = QImage();
+		m_bufDisplay = QImage();
+		for (int i = 0; i < PyramidLevels; ++i)
+			m_pyramid[i] = PyramidLevel();
+		m_bPyramidCurrent = false;
+		m_settleTimer.stop();
+		s_ringCache()->purge();
+	}
+	else
+	{
+		m_compactRing.clear();
+		m_compactBand = QImage();
+		m_nTriangleHue = -1;
+		m_rcTriangleLayer = QRect();
+		warmTriangleCache();
+	}
+	m_bNeedUpdateBackground = true;
+	m_dirty.clear();
+	m_dirty.add(imageRect());
+	update();
+}
+
+
+bool KColorCircleHsv::lowMemoryMode() const
+{
+	return m_bLowMemory;
+}
+
+
+void KColorCircleHsv::setFrameBudget(int ms)
+{
+	m_nFrameBudget = qMax(0, ms);
+	m_dFrameCost = 0.0;
+	if (!m_nFrameBudget)
+		restoreQuality();
+}
+
+
+int KColorCircleHsv::frameBudget() const
+{
+	return m_nFrameBudget;
+}
+
+
+KColorCircleHsv::RenderQuality KColorCircleHsv::renderQuality() const
+{
+	return m_quality;
+}
+
+
+void KColorCircleHsv::setColorModel(ColorModel model)
+{
+	if (model == m_colorModel)
+		return;
+	QColor col = color();
+	m_colorModel = model;
+	
+	// 同样的颜色在新模型中的坐标
+	// the same colour in the new model's coordinates
+	m_hsv = modelFromColor(col, m_hsv.h, model);
+	m_committedHsv = m_hsv;
+	m_nCurrentHue = KHsvF::wholeHue(m_hsv.h);
+	calRadian(m_nCurrentHue);
+	m_dSelectorPos = pointFromHsv(m_hsv);
+	
+	// 圆环和三角形都要换, 旧模型的预览也不能再用
+	// ring and triangle both change, and the old model's previews are stale
+	if (m_frameJob)
+		m_frameJob->cancel();
+	if (m_tileJob)
+		m_tileJob->cancel();
+	m_frameJob.clear();
+	m_tileJob.clear();
+	for (int i = 0; i < PyramidLevels; ++i)
+		m_pyramid[i] = PyramidLevel();
+	m_bPyramidCurrent = false;
+	m_imgPreview = QImage();
+	m_imgPreviewBase = QImage();
+	m_nTriangleHue = -1;
+	m_rcTriangleLayer = QRect();
+	m_bNeedUpdateBackground = true;
+	m_dirty.clear();
+	m_dirty.add(imageRect());
+	scheduleRender(RenderWarm);
+}
+
+
+KColorCircleHsv::ColorModel KColorCircleHsv::colorModel() const
+{
+	return m_colorModel;
+}
+
+
+void KColorCircleHsv::setOutputFormat(QImage::Format format)
+{
+	format = layerFormat(format);
+	if (format == m_outputFormat)
+		return;
+	m_outputFormat = format;
+	
+	// 圆环, 三角形图块和预览都按旧格式分配
+	// the ring, triangle tiles and previews were all allocated in the old format
+	if (m_frameJob)
+		m_frameJob->cancel();
+	if (m_tileJob)
+		m_tileJob->cancel();
+	m_frameJob.clear();
+	m_tileJob.clear();
+	for (int i = 0; i < PyramidLevels; ++i)
+		m_pyramid[i] = PyramidLevel();
+	m_bPyramidCurrent = false;
+	m_imgPreview = QImage();
+	m_imgPreviewBase = QImage();
+	m_nTriangleHue = -1;
+	m_rcTriangleLayer = QRect();
+	m_bNeedUpdateBackground = true;
+	m_dirty.clear();
+	m_dirty.add(imageRect());
+	scheduleRender(RenderWarm);
+}
+
+
+QImage::Format KColorCircleHsv::outputFormat() const
+{
+	return m_outputFormat;
+}
+
+
+// 只在变大时重新分配
+// reallocates only when growing
+void KColorCircleHsv::TriangleScratch::reserve(int rows)
+{
+	if (leftX.size() >= rows)
+		return;
+	leftColors.resize(rows);
+	rightColors.resize(rows);
+	leftX.resize(rows);
+	rightX.resize(rows);
+}
+
+
+// 与已有的矩形相交就合并, 保持互不相交; 满了就合并成一个
+// merge with any intersecting rectangle so they stay disjoint; collapse into
+// one when full
+void KColorCircleHsv::DirtyRects::add(const QRect &rect)
+{
+	if (rect.isEmpty())
+		return;
+	
+	QRect r = rect;
+	int i = 0;
+	while (i < count)
+	{
+		if (rects[i].intersects(r))
+		{
+			r |= rects[i];
+			rects[i] = rects[--count];
+			i = 0;
+		}
+		else
+			++i;
+	}
+	if (count == MaxRects)
+	{
+		for (i = 0; i < count; ++i)
+			r |= rects[i];
+		count = 0;
+	}
+	rects[count++] = r;
+}
+
+
+// 三角形缓存上限(字节)
+// memory limit of the triangle cache, in bytes
+void KColorCircleHsv::setTriangleCacheSize(int bytes)
+{
+	m_triangleCache->setMaxBytes(bytes);
+}
+
+
+// 探针圆环: 两个颜色模型, 两种格式; 渲染代码改变时它们的校验和随之改变
+// probe rings: both colour models in two formats; their checksum changes
+// with the rendering code
+bool KColorCircleHsv::setRingCacheFile(const QString &fileName)
+{
+	quint64 probe = RingFileLayout;
+	if (!fileName.isEmpty())
+	{
+		const QImage::Format formats[2] = { QImage::Format_RGB32, QImage::Format_RGB16 };
+		for (int m = ModelHsv; m <= ModelOklch; ++m)
+		{
+			for (int f = 0; f < 2; ++f)
+			{
+				QImage ring = renderRing(QSize(47, 47), 23, 15.5, 0xff808080, ColorModel(m), formats[f]);
+				probe = probe * 1000003 ^ ringChecksum(ring.constBits(), qint64(ring.bytesPerLine()) * ring.height());
+			}
+		}
+	}
+	return s_ringCache()->setStore(fileName, probe);
+}
+
+
+void KColorCircleHsv::calRadian(int hue)
+{
+	hueRadians(hue, &m_radA, &m_radB, &m_radC);
+	calVertexPoint();
+}
+
+// 计算顶点 (calculate vertext)
+// a : 颜色顶点
+// b : s = 0 v = 0
+// c : s = 0 v = 255
+void KColorCircleHsv::calVertexPoint()
+{
+	TriangleGeometry geometry = triangleGeometry();
+	pa = pointAtRadian(geometry.center, m_radA, geometry.innerRadius);
+	pb = pointAtRadian(geometry.center, m_radB, geometry.innerRadius);
+	pc = pointAtRadian(geometry.center, m_radC, geometry.innerRadius);
+	pd = QPointF(pa.x() + cos(m_radA) * m_dOuterInnerWidth, 
+				 pa.y() - (sin(m_radA) * m_dOuterInnerWidth));
+	m_svTransform.setup(pa, pb, pc);
+	m_svContents.setup(pa / m_dPixelRatio, pb / m_dPixelRatio, pc / m_dPixelRatio);
+}
+
+
+KColorCircleHsv::TriangleGeometry KColorCircleHsv::triangleGeometry() const
+{
+	qreal cx = (qreal) imageRect().center().x();
+	qreal cy = (qreal) imageRect().center().y();
+	int innerRadius = m_nOuterRadius - m_dOuterInnerWidth;
+	return TriangleGeometry(QPointF(cx, cy), innerRadius, m_colorModel, tileFormat(m_outputFormat));
+}
+
+
+// 一个色相的三角形顶点: 纯色, 黑, 白
+// the triangle vertices of one hue: pure colour, black, white
+void KColorCircleHsv::triangleVertices(int hue, const TriangleGeometry &geometry, QPointF *vertices)
+{
+	qreal radA, radB, radC;
+	hueRadians(hue, &radA, &radB, &radC);
+	vertices[0] = pointAtRadian(geometry.center, radA, geometry.innerRadius);
+	vertices[1] = pointAtRadian(geometry.center, radB, geometry.innerRadius);
+	vertices[2] = pointAtRadian(geometry.center, radC, geometry.innerRadius);
+}
+
+
+// 为一个色相的三角形分配tile(未初始化), vertices返回tile内的三个顶点
+// allocate the (uninitialised) tile of one hue, vertices receives the three
+// vertices inside the tile
+KColorCircleHsv::TriangleTile KColorCircleHsv::allocTriangleTile(int hue,
+									const TriangleGeometry &geometry, QPointF *vertices)
+{
+	QPointF v[3];
+	triangleVertices(hue, geometry, v);
+	const QPointF &a = v[0];
+	const QPointF &b = v[1];
+	const QPointF &c = v[2];
+	
+	// 整数偏移, 平移后逐像素与直接画在背景上一致
+	// integer offset, so the tile is pixel identical to drawing in place
+	QRect bounds = triangleBounds(a, b, c);
+	QPointF offset(bounds.topLeft());
+	vertices[0] = a - offset;
+	vertices[1] = b - offset;
+	vertices[2] = c - offset;
+	
+	TriangleTile tile;
+	tile.offset = bounds.topLeft();
+	tile.image = QImage(bounds.size(), geometry.format);
+	return tile;
+}
+
+
+// 渲染一个色相的三角形, 可在任意线程调用
+// render the triangle of one hue, callable from any thread
+KColorCircleHsv::TriangleTile KColorCircleHsv::renderTriangleTile(int hue,
+									const TriangleGeometry &geometry, TriangleScratch *scratch)
+{
+	QPointF v[3];
+	TriangleTile tile = allocTriangleTile(hue, geometry, v);
+	tile.image.fill(0);
+	
+	drawTriangle(&tile.image, v[0], v[1], v[2], apexColor(hue, geometry.model), 0, -1, scratch,
+				 true, geometry.model);
+	return tile;
+}
+
+
+// 最近邻放大两倍, 只复制像素, 与格式无关
+// nearest-neighbour upscaling by two, pixels are only copied whatever the format
+struct KHsvPixel128
+{
+	quint64 lo, hi;
+};
+
+template <typename T>
+static void upscale2x(QImage *dst, const QImage &half)
+{
+	for (int y = 0; y < dst->height(); ++y)
+	{
+		const T *src = reinterpret_cast<const T *>(half.constScanLine(y / 2));
+		T *line = reinterpret_cast<T *>(dst->scanLine(y));
+		for (int x = 0; x < dst->width(); ++x)
+			line[x] = src[x / 2];
+	}
+}
+
+
+// 降低画质时在GUI线程上画的三角形: 不抗锯齿, 可半分辨率画再放大; 不进缓存
+// the triangle drawn on the GUI thread at reduced quality: no anti-aliasing,
+// optionally drawn at half resolution and scaled up; never cached
+KColorCircleHsv::TriangleTile KColorCircleHsv::renderDraftTile(int hue, const TriangleGeometry &geometry)
+{
+	QPointF v[3];
+	TriangleTile tile = allocTriangleTile(hue, geometry, v);
+	QColor hueColor = apexColor(hue, geometry.model);
+	if (m_quality < QualityHalfResolution)
+	{
+		tile.image.fill(0);
+		drawTriangle(&tile.image, v[0], v[1], v[2], hueColor, 0, -1, &m_triangleScratch, false,
+					 geometry.model);
+		return tile;
+	}
+	
+	QImage half((tile.image.width() + 1) / 2, (tile.image.height() + 1) / 2, geometry.format);
+	half.fill(0);
+	drawTriangle(&half, v[0] / 2.0, v[1] / 2.0, v[2] / 2.0, hueColor, 0, -1, &m_triangleScratch, false,
+				 geometry.model);
+	switch (half.depth())
+	{
+	case 64:
+		upscale2x<quint64>(&tile.image, half);
+		break;
+	case 128:
+		upscale2x<KHsvPixel128>(&tile.image, half);
+		break;
+	default:
+		upscale2x<QRgb>(&tile.image, half);
+		break;
+	}
+	return tile;
+}
+
+
+// 几何改变后, 在空闲线程中由近及远预热当前色相附近的三角形
+// after a geometry change, warm the triangles around the current hue on idle
+// threads, nearest hues first
+void KColorCircleHsv::warmTriangleCache()
+{
+	TriangleGeometry geometry = triangleGeometry();
+	int generation = m_triangleCache->reset(geometry);
+	if (geometry.innerRadius <= 0)
+		return;
+	
+	QThreadPool *pool = QThreadPool::globalInstance();
+	int nWorkers = qMax(1, pool->maxThreadCount() - 1);
+	QVector<QList<int> > hues(nWorkers);
+	for (int i = 1; i < 360; ++i)
+	{
+		// 0, +1, -1, +2, -2 ...
+		int step = (i + 1) / 2;
+		int hue = (i & 1) ? m_nCurrentHue + step : m_nCurrentHue - step;
+		hue = (hue + 360) % 360;
+		hues[i % nWorkers].append(hue);
+	}
+	
+	for (int i = 0; i < nWorkers; ++i)
+		pool->start(new KHsvTriangleWarmup(m_triangleCache, geometry, generation, hues.at(i)));
+}
+
+
+// 把任务按行分带交给线程池, 优先于缓存预热
+// split a job into row bands on the thread pool, ahead of the cache warm-up
+void KColorCircleHsv::startRenderJob(const QSharedPointer<KHsvRenderJob> &job, int height)
+{
+	// 只在这里(GUI线程)取非const的bits, 各带只用裸指针
+	// the non-const bits are taken only here (GUI thread), bands use raw pointers
+	if (job->kind == KHsvRenderJob::Frame)
+	{
+		if (!job->ringShared)
+			job->ringBits = job->ring.bits();
+		job->baseBits = job->base.bits();
+	}
+	else
+		job->tileBits = job->tile.image.bits();
+	
+	// 记下所有启动过的任务, 析构时全部等待; 已退出的顺便丢掉
+	// remember every started job so the destructor can wait for all of
+	// them; exited ones are dropped on the way
+	for (int i = m_liveJobs.size() - 1; i >= 0; --i)
+	{
+		if (m_liveJobs.at(i)->hasExited())
+			m_liveJobs.removeAt(i);
+	}
+	m_liveJobs.append(job);
+	
+	int nBands = qBound(1, height / 64, QThread::idealThreadCount() * 2);
+	job->setBands(nBands);
+	QThreadPool *pool = QThreadPool::globalInstance();
+	for (int i = 0; i < nBands; ++i)
+	{
+		int y0 = height * i / nBands;
+		int y1 = height * (i + 1) / nBands;
+		pool->start(new KHsvRenderBand(job, y0, y1, this), 1);
+	}
+}
+
+
+// 后台渲染新尺寸的圆环和底图, 取消正在进行的旧帧
+// render the ring and base for the new size in the background, cancelling the
+// stale frame in progress
+void KColorCircleHsv::startFrameRender()
+{
+	if (m_frameJob)
+		m_frameJob->cancel();
+	m_frameJob.clear();
+	
+	QSize size = imageSize();
+	if (size.isEmpty())
+		return;
+	
+	QSharedPointer<KHsvRenderJob> job(new KHsvRenderJob(KHsvRenderJob::Frame));
+	job->hue = m_nCurrentHue;
+	job->hueColor = apexColor(m_nCurrentHue, m_colorModel);
+	job->geometry = triangleGeometry();
+	job->vertices[0] = pa;
+	job->vertices[1] = pb;
+	job->vertices[2] = pc;
+	job->ringKey = ringKey();
+	job->ring = s_ringCache()->find(job->ringKey);
+	job->ringShared = !job->ring.isNull();
+	if (!job->ringShared)
+		job->ring = QImage(size, m_outputFormat);
+	job->base = QImage(size, m_outputFormat);
+	job->ringCenter = job->ring.rect().center();
+	job->outerRadius = m_nOuterRadius;
+	job->innerRadius = m_nOuterRadius - m_dOuterInnerWidth;
+	job->background = job->ringKey.background;
+	job->stats = m_frameStats;
+	
+	m_frameJob = job;
+	startRenderJob(job, size.height());
+}
+
+
+// 后台渲染当前色相的三角形, 取消旧色相的任务
+// render the current hue's triangle in the background, cancelling the stale hue
+void KColorCircleHsv::startTileRender()
+{
+	if (m_tileJob)
+	{
+		if (m_tileJob->hue == m_nCurrentHue && !m_tileJob->isCancelled())
+			return;
+		m_tileJob->cancel();
+	}
+	
+	QSharedPointer<KHsvRenderJob> job(new KHsvRenderJob(KHsvRenderJob::Tile));
+	job->hue = m_nCurrentHue;
+	job->hueColor = apexColor(m_nCurrentHue, m_colorModel);
+	job->geometry = triangleGeometry();
+	job->tile = allocTriangleTile(m_nCurrentHue, job->geometry, job->vertices);
+	job->stats = m_frameStats;
+	
+	m_tileJob = job;
+	startRenderJob(job, job->tile.image.height());
+}
+
+
+// 最后一个带完成 (queued, GUI线程), 换上完成的图像
+// the last band finished (queued, GUI thread), swap in the finished images
+void KColorCircleHsv::renderFinished()
+{
+	if (m_frameJob && m_frameJob->isFinished())
+	{
+		QSharedPointer<KHsvRenderJob> job = m_frameJob;
+		m_frameJob.clear();
+		
+		// 同时有别的控件渲染了同样的圆环时用缓存中的那张
+		// take the cached ring if another widget rendered the same one meanwhile
+		m_imgBG = job->ringShared ? job->ring : s_ringCache()->insert(job->ringKey, job->ring);
+		m_imgBase = job->base;
+		m_buf = QImage(m_imgBase.size(), m_imgBase.format());
+		m_nTriangleHue = job->hue;
+		m_rcTriangleLayer = triangleBounds(job->vertices[0], job->vertices[1], job->vertices[2]);
+		m_bPyramidCurrent = false;
+		m_imgPreview = QImage();
+		m_imgPreviewBase = QImage();
+		job.clear();
+		s_ringCache()->purge();
+		m_dirty.clear();
+		m_dirty.add(m_buf.rect());
+		update();
+	}
+	
+	if (m_tileJob && m_tileJob->isFinished())
+	{
+		QSharedPointer<KHsvRenderJob> job = m_tileJob;
+		m_tileJob.clear();
+		
+		m_triangleCache->insert(job->hue, job->geometry, job->tile, true);
+		if (job->hue == m_nCurrentHue && !m_frameJob && job->geometry == triangleGeometry())
+		{
+			QRect changed = setTriangleLayer(job->hue, job->tile);
+			update(mapFromImage(changed));
+		}
+	}
+}
+
+
+//  背景图，仅画圆环
+// drawing background image
+// 圆环从共享缓存中取, 没有才渲染; m_imgBG与其它控件共享, 只读
+// the ring comes from the shared cache and is rendered only on a miss;
+// m_imgBG is shared with other widgets and read-only
+void KColorCircleHsv::createBackground()
+{
+	KHsvRingKey key = ringKey();
+	QImage ring = s_ringCache()->find(key);
+	if (ring.isNull())
+	{
+		KHsvStageTimer timer(m_frameStats.data(), StageBackground,
+							 qint64(key.size.width()) * key.size.height());
+		ring = renderRing(key.size, m_nOuterRadius, m_nOuterRadius - m_dOuterInnerWidth,
+						  key.background, key.model, key.format);
+		ring = s_ringCache()->insert(key, ring);
+	}
+	m_imgBG = ring;
+	s_ringCache()->purge();
+}
+
+
+// 共享缓存中的圆环, 没有就渲染
+// the ring from the shared cache, rendered on a miss
+QImage KColorCircleHsv::sharedRing(const QSize &size, qreal pixelRatio, int outerRadius,
+								   qreal ringWidth, QRgb background, ColorModel model,
+								   QImage::Format format)
+{
+	KHsvRingKey key;
+	key.size = size;
+	key.pixelRatio = pixelRatio;
+	key.background = background;
+	key.ringWidth = ringWidth;
+	key.model = model;
+	key.format = format;
+	QImage ring = s_ringCache()->find(key);
+	if (ring.isNull())
+		ring = s_ringCache()->insert(key, renderRing(size, outerRadius, outerRadius - ringWidth,
+													 background, model, format));
+	s_ringCache()->purge();
+	return ring;
+}
+
+// 放开sharedRing返回的圆环, 没有别人用时从缓存中移除 (程序退出时缓存可能已经销毁)
+// let go of a ring returned by sharedRing, dropping it from the cache when
+// nobody else uses it (the cache may be gone at exit)
+void KColorCircleHsv::releaseSharedRing(QImage *ring)
+{
+	*ring = QImage();
+	if (KHsvRingCache *cache = s_ringCache())
+		cache->purge();
+}
+
+
+QImage KColorCircleHsv::renderRing(const QSize &size, int outerRadius, qreal innerRadius,
+								   QRgb background, ColorModel model, QImage::Format format)
+{
+	QImage ring(size, format);
+	ring.fill(QColor(background));
+	drawRing(&ring, ring.rect().center(), outerRadius, innerRadius, background, 0, -1, model);
+	return ring;
+}
+
+
+// 共享圆环的键
+// key of the shared ring
+KHsvRingKey KColorCircleHsv::ringKey() const
+{
+	KHsvRingKey key;
+	key.size = imageSize();
+	key.pixelRatio = m_dPixelRatio;
+	key.background = palette().window().color().rgb();
+	key.ringWidth = m_dOuterInnerWidth;
+	key.model = m_colorModel;
+	key.format = m_outputFormat;
+	return key;
+}
+
+
+qreal KColorCircleHsv::pixelRatio() const
+{
+#if QT_VERSION >= 0x050600
+	return devicePixelRatioF();
+#elif QT_VERSION >= 0x050000
+	return devicePixelRatio();
+#else
+	return 1.0;
+#endif
+}
+
+
+QSize KColorCircleHsv::imageSize() const
+{
+	return QSize(qRound(contentsRect().width() * m_dPixelRatio),
+				 qRound(contentsRect().height() * m_dPixelRatio));
+}
+
+
+QRect KColorCircleHsv::imageRect() const
+{
+	return QRect(QPoint(0, 0), imageSize());
+}
+
+
+// 控件坐标 -> 图像坐标
+// widget coordinates -> image coordinates
+QPointF KColorCircleHsv::mapToImage(const QPointF &pos) const
+{
+	return (pos - QPointF(contentsRect().topLeft())) * m_dPixelRatio;
+}
+
+
+QRect KColorCircleHsv::mapToImage(const QRect &rect) const
+{
+	QRect r = rect.translated(-contentsRect().topLeft());
+	return QRectF(r.x() * m_dPixelRatio, r.y() * m_dPixelRatio,
+				  r.width() * m_dPixelRatio, r.height() * m_dPixelRatio).toAlignedRect() & imageRect();
+}
+
+
+// 图像坐标 -> 控件坐标, 向外取整
+// image coordinates -> widget coordinates, rounded outwards
+QRect KColorCircleHsv::mapFromImage(const QRect &rect) const
+{
+	return QRectF(rect.x() / m_dPixelRatio, rect.y() / m_dPixelRatio,
+				  rect.width() / m_dPixelRatio, rect.height() / m_dPixelRatio)
+			.toAlignedRect().translated(contentsRect().topLeft());
+}
+
+
+// 把image中from处的像素贴到图像坐标的rect上, 一个图像像素对应一个设备像素
+// blit the pixels of image at from onto rect (image coordinates), one image
+// pixel per device pixel
+void KColorCircleHsv::blit(QPainter *p, const QRect &rect, const QImage &image, const QPoint &from)
+{
+	QPoint origin = contentsRect().topLeft();
+	if (m_dPixelRatio == 1.0)
+	{
+		p->drawImage(rect.topLeft() + origin, image, QRect(from, rect.size()));
+		return;
+	}
+	QRectF target(rect.x() / m_dPixelRatio + origin.x(), rect.y() / m_dPixelRatio + origin.y(),
+				  rect.width() / m_dPixelRatio, rect.height() / m_dPixelRatio);
+	p->drawImage(target, image, QRectF(QRect(from, rect.size())));
+}
+
+
+// rect中心周围pos处的色相
+// the hue at pos around the center of rect
+qreal KColorCircleHsv::hueAt(const QPointF &pos, const QRect &rect)
+{
+	// 选中点平面坐标系的弧度
+	qreal rad = radianAt(pos, rect);
+	qreal am = rad - HSVPI/2;
+	if (am < 0) am += HSVTWOPI;
+	return KHsvF::wrapHue(360.0 - (am * 360.0) / HSVTWOPI);
+}
+
+
+// 三角形外的点移到三角形上最近的点
+// points outside the triangle move to the nearest point on it
+QPointF KColorCircleHsv::clampToTriangle(const QPointF &p, const QPointF &a, const QPointF &b,
+										 const QPointF &c)
+{
+	if (calTriangleContainsPt(p, a, b, c))
+		return p;
+	return p2triangleMinPos(p, a, b, c);
+}
+
+
+bool KColorCircleHsv::triangleContains(const QPointF &p, const QPointF &a, const QPointF &b,
+									   const QPointF &c)
+{
+	return calTriangleContainsPt(p, a, b, c);
+}
+
+
+// 鼠标坐标改变
+// mouse point changed
+bool KColorCircleHsv::pointChanged(QPointF point)
+{
+	bool newColor = false;
+	if (m_selMode == SelCircle)
+	{
+		// 更新顶点
+		// 选中点平面坐标系的弧度
+		qreal hue = hueAt(point, imageRect());
+		if (hue != m_hsv.h)
+		{
+			newColor = true;
+			m_hsv.h = hue;
+		}
+		// 三角形与缓存一样对齐到整数色相, 颜色保留精确的色相
+		// the triangle snaps to whole hues like the cache, the colour keeps
+		// the exact hue
+		m_nCurrentHue = KHsvF::wholeHue(hue);
+		calRadian(m_nCurrentHue);
+		m_dSelectorPos = pointFromHsv(m_hsv);
+	}
+	else if(m_selMode == SelTriangle)
+	{
+		// 是否在三角形内
+		m_dSelectorPos = clampToTriangle(point, pa, pb, pc);
+		KHsvF hsv = hsvFromPoint(m_dSelectorPos);
+		if (hsv != m_hsv) 
+		{
+			m_hsv = hsv;
+			newColor = true;
+		}
+	}
+	
+	return newColor;
+}
+
+void KColorCircleHsv::mouseMoveEvent(QMouseEvent *e)
+{
+	if ((e->buttons() & Qt::LeftButton) == 0)
+		return;
+	
+	QPointF fpos = mapToImage(eventPos(e));
+	if (m_nFrameBudget > 0)
+	{
+		m_idleTimer.start(IdleDelay, this);
+		
+		// 跳帧: 每个帧预算最多处理一次拖动, 中间的只保留最新的位置
+		// skipping frames: at most one drag step per frame budget, only the
+		// latest position in between is kept
+		if (m_quality >= QualitySkipFrames && m_dragClock.isValid()
+				&& m_dragClock.elapsed() < m_nFrameBudget)
+		{
+			m_pendingDragPos = fpos;
+			m_bDragPending = true;
+			if (!m_dragTimer.isActive())
+				m_dragTimer.start(int(m_nFrameBudget - m_dragClock.elapsed()), this);
+			return;
+		}
+		m_dragClock.start();
+	}
+	dragTo(fpos);
+}
+
+
+void KColorCircleHsv::dragTo(const QPointF &pos)
+{
+	m_bDragPending = false;
+	m_dragTimer.stop();
+	bool newColor = this->pointChanged(pos);
+	if (newColor)
+		notifyColorChanged();
+	
+	markDirty();
+}
+
+
+void KColorCircleHsv::mousePressEvent(QMouseEvent *e)
+{
+	if (e->button() != Qt::LeftButton)
+		return;
+	QPointF fPos = mapToImage(eventPos(e));
+	qreal rad = p2pdist(fPos, imageRect().center());
+	if (rad > (m_nOuterRadius - m_dOuterInnerWidth))
+	{
+		m_selMode = SelCircle;
+	}
+	else
+	{
+		// 是否在三角形内
+		if (triangleContains(fPos, pa, pb, pc))
+			m_selMode = SelTriangle;
+		else
+			m_selMode = None;
+	}
+	
+	bool newColor = this->pointChanged(fPos);
+	if (newColor)
+		notifyColorChanged();
+	
+	markDirty();
+}
+
+void KColorCircleHsv::mouseReleaseEvent(QMouseEvent *e)
+{
+	if (e->button() != Qt::LeftButton)
+		return;
+	if (m_bDragPending)
+		dragTo(m_pendingDragPos);
+	if (m_selMode != None)
+		commitColor();
+	m_selMode = None;
+	restoreQuality();
+}
+
+
+// 拖动时按最近的帧耗时调整画质, 每次调整后重新积累
+// adjust the quality from the recent frame cost while dragging, starting
+// over after each step
+void KColorCircleHsv::governFrame(qreal ms)
+{
+	m_dFrameCost = m_dFrameCost * 0.75 + ms * 0.25;
+	if (m_selMode == None)
+		return;
+	
+	if (m_dFrameCost > m_nFrameBudget && m_quality < QualitySkipFrames)
+	{
+		m_quality = RenderQuality(m_quality + 1);
+		m_dFrameCost = m_nFrameBudget * 0.75;
+	}
+	else if (m_dFrameCost < m_nFrameBudget * 0.5 && m_quality > QualityFull)
+	{
+		m_quality = RenderQuality(m_quality - 1);
+		m_dFrameCost = m_nFrameBudget * 0.75;
+	}
+}
+
+
+// 恢复完整画质, 重画降低画质时画的三角形和叠加层
+// restore full quality and redraw the triangle and overlays drawn at reduced quality
+void KColorCircleHsv::restoreQuality()
+{
+	m_idleTimer.stop();
+	if (m_quality == QualityFull && !m_bDraftTriangle)
+		return;
+	m_quality = QualityFull;
+	// 低内存模式每帧都直接画三角形
+	// the low-memory mode draws the triangle directly every frame
+	if (m_bDraftTriangle || m_bLowMemory)
+		m_nTriangleHue = -1;
+	markDirty();
+}
+
+void KColorCircleHsv::keyPressEvent(QKeyEvent *e)
+{
+	KHsvF hsv = m_hsv;
+	switch (e->key()) 
+	{
+		case Qt::Key_Left:
+			hsv.h = KHsvF::wrapHue(hsv.h - 1.0);
+		break;
+		case Qt::Key_Right:
+			hsv.h = KHsvF::wrapHue(hsv.h + 1.0);
+		break;
+		case Qt::Key_Up:
+			hsv.v = KHsvF::clamp01(hsv.v - 5.0 / 255.0);
+		break;
+		case Qt::Key_Down:
+			hsv.v = KHsvF::clamp01(hsv.v + 5.0 / 255.0);
+		break;
+		default:
+			QWidget::keyPressEvent(e);
+			return;
+	};
+	setHsv(hsv);
+	notifyColorChanged();
+}
+
+
+void KColorCircleHsv::keyReleaseEvent(QKeyEvent *e)
+{
+	switch (e->key()) 
+	{
+		case Qt::Key_Left:
+		case Qt::Key_Right:
+		case Qt::Key_Up:
+		case Qt::Key_Down:
+			// 按住不放时的自动重复不算提交
+			// auto-repeat while the key is held is not a commit
+			if (!e->isAutoRepeat())
+				commitColor();
+		break;
+		default:
+			QWidget::keyReleaseEvent(e);
+		break;
+	};
+}
+
+
+// 颜色改变通知
+// Immediate : 每个事件都发出colorChanged
+// Coalesced : 先立即发出, 之后每帧最多一次, 只发最新的颜色
+// colour change notification
+// Immediate : colorChanged for every event
+// Coalesced : emit at once, then at most once per frame with the latest colour
+void KColorCircleHsv::notifyColorChanged()
+{
+	if (m_colorDelivery == DeliverImmediate)
+	{
+		emit colorChanged(color());
+		return;
+	}
+	
+	if (m_colorTimer.isActive())
+	{
+		m_bColorPending = true;
+		return;
+	}
+	emit colorChanged(color());
+	m_colorTimer.start(1000 / m_nColorDeliveryRate, this);
+}
+
+
+// 交互结束(松开鼠标/按键): 先补发被合并的颜色, 再发出colorCommitted
+// interaction finished (mouse/key release): flush the coalesced colour,
+// then emit colorCommitted
+void KColorCircleHsv::commitColor()
+{
+	m_colorTimer.stop();
+	if (m_bColorPending)
+	{
+		m_bColorPending = false;
+		emit colorChanged(color());
+	}
+	if (m_hsv != m_committedHsv)
+	{
+		m_committedHsv = m_hsv;
+		emit colorCommitted(color());
+	}
+}
+
+
+void KColorCircleHsv::timerEvent(QTimerEvent *e)
+{
+	// 信箱的帧定时器: 没有新颜色就停下
+	// mailbox frame timer: stop once nothing new arrives
+	if (e->timerId() == m_mailboxTimer.timerId())
+	{
+		if (!takeMailbox())
+			m_mailboxTimer.stop();
+		return;
+	}
+	
+	// 拖动停下了, 或者该处理跳过的拖动了
+	// the drag went idle, or a held-back drag step is due
+	if (e->timerId() == m_idleTimer.timerId())
+	{
+		restoreQuality();
+		return;
+	}
+	if (e->timerId() == m_dragTimer.timerId())
+	{
+		m_dragClock.start();
+		dragTo(m_pendingDragPos);
+		return;
+	}
+	
+	// 尺寸稳定了, 按精确的分辨率渲染
+	// the size settled, render the exact resolution
+	if (e->timerId() == m_settleTimer.timerId())
+	{
+		m_settleTimer.stop();
+		scheduleRender(RenderWarm);
+		return;
+	}
+	
+	if (e->timerId() != m_colorTimer.timerId())
+	{
+		QWidget::timerEvent(e);
+		return;
+	}
+	
+	if (!m_bColorPending)
+	{
+		m_colorTimer.stop();
+		return;
+	}
+	m_bColorPending = false;
+	emit colorChanged(color());
+}
+
+
+void KColorCircleHsv::setColorDelivery(ColorDelivery mode)
+{
+	if (mode == m_colorDelivery)
+		return;
+	m_colorDelivery = mode;
+	if (mode == DeliverImmediate && m_colorTimer.isActive())
+	{
+		m_colorTimer.stop();
+		if (m_bColorPending)
+		{
+			m_bColorPending = false;
+			emit colorChanged(color());
+		}
+	}
+}
+
+
+KColorCircleHsv::ColorDelivery KColorCircleHsv::colorDelivery() const
+{
+	return m_colorDelivery;
+}
+
+
+// 合并模式下每秒最多发出colorChanged的次数
+// maximum colorChanged emissions per second in coalesced mode
+void KColorCircleHsv::setColorDeliveryRate(int hz)
+{
+	m_nColorDeliveryRate = qBound(1, hz, 1000);
+}
+
+
+int KColorCircleHsv::colorDeliveryRate() const
+{
+	return m_nColorDeliveryRate;
+}
+
+
+void KColorCircleHsv::resizeEvent(QResizeEvent *)
+{
+	relayout();
+}
+
+
+// 设备像素比的变化: 显示时(和换了父窗口后)连接顶层窗口的QWindow::screenChanged;
+// Qt 6.6起同一屏幕上缩放比例改变时还有DevicePixelRatioChange
+// device pixel ratio changes: the top-level window's QWindow::screenChanged
+// is connected when shown (and after a parent change); from Qt 6.6 a scale
+// change on the same screen also sends DevicePixelRatioChange
+bool KColorCircleHsv::event(QEvent *e)
+{
+	const bool result = QWidget::event(e);
+#if QT_VERSION >= 0x050000
+	if (e->type() == QEvent::Show || e->type() == QEvent::ParentChange)
+	{
+		if (QWindow *handle = window()->windowHandle())
+			connect(handle, SIGNAL(screenChanged(QScreen *)), this, SLOT(updatePixelRatio()),
+					Qt::UniqueConnection);
+	}
+#endif
+#if QT_VERSION >= 0x060600
+	if (e->type() == QEvent::DevicePixelRatioChange)
+		updatePixelRatio();
+#endif
+	return result;
+}
+
+
+// 移到了设备像素比不同的屏幕上: 在绘制之外重新布局
+// moved to a screen with another device pixel ratio: relayout outside of painting
+void KColorCircleHsv::updatePixelRatio()
+{
+	if (pixelRatio() != m_dPixelRatio)
+		relayout();
+}
+
+
+// 主题改变: 圆环的背景色来自调色板; 背景色没变时圆环从缓存中取
+// theme changes: the ring's background comes from the palette; when it did
+// not change the ring comes from the cache
+void KColorCircleHsv::changeEvent(QEvent *e)
+{
+	QWidget::changeEvent(e);
+	if (e->type() != QEvent::PaletteChange && e->type() != QEvent::StyleChange)
+		return;
+	m_bNeedUpdateBackground = true;
+	m_dirty.clear();
+	m_dirty.add(imageRect());
+	scheduleRender();
+}
+
+
+// 提交给全局调度器, 同一个控件的请求合并
+// submitted to the shared scheduler, requests of one widget are merged
+void KColorCircleHsv::scheduleRender(int request)
+{
+	KHsvRenderScheduler *scheduler = KHsvRenderScheduler::instance();
+	if (!scheduler)
+	{
+		m_nScheduledRender |= request;
+		runScheduledRender();
+		return;
+	}
+	m_nScheduledRender |= request;
+	scheduler->submit(this);
+}
+
+
+// exposed: 在paintEvent中, 不需要再update
+// exposed: inside paintEvent, no further update needed
+void KColorCircleHsv::runScheduledRender(bool exposed)
+{
+	const int request = m_nScheduledRender;
+	m_nScheduledRender = 0;
+	if (KHsvRenderScheduler *scheduler = KHsvRenderScheduler::instance(false))
+		scheduler->cancel(this);
+	if ((request & RenderWarm) && !m_bLowMemory)
+		warmTriangleCache();
+	paintImage();
+	if (!exposed)
+		update();
+}
+
+
+// 按新的尺寸和设备像素比重新计算几何.
+// 第一帧和低内存模式立即渲染; 否则先贴金字塔的预览, 尺寸稳定后再按精确的分辨率渲染
+// recompute the geometry for the new size and device pixel ratio.
+// The first frame and the low-memory mode render at once; otherwise a
+// preview from the pyramid is shown and the exact resolution is rendered
+// once the size settles
+void KColorCircleHsv::relayout()
+{
+	// 旧尺寸的完整帧先存进金字塔
+	// keep the finished frame of the old size in the pyramid first
+	if (!m_bLowMemory)
+		updatePyramid();
+	
+	m_dPixelRatio = pixelRatio();
+	QSize size = imageSize();
+	m_nOuterRadius = (size.width() - 1) / 2;
+	if ((size.height() - 1) / 2 < m_nOuterRadius)
+		m_nOuterRadius = (size.height() - 1) / 2;
+	
+	m_nPenWidth = (int) floor(m_nOuterRadius / 50.0);
+	m_nSVEllipseSize = (int) floor(m_nOuterRadius / 12.5);
+	m_dOuterInnerWidth = m_nOuterRadius / 5.0;
+	
+	calVertexPoint();
+	// 任意色相的三角形都不超过内圆直径的行数, 之后拖动时不再分配
+	// no hue's triangle spans more rows than the inner diameter, so dragging
+	// never grows it afterwards
+	m_triangleScratch.reserve(2 * triangleGeometry().innerRadius + 3);
+	
+	m_dSelectorPos = pointFromHsv(m_hsv);
+	m_bNeedUpdateBackground = true;
+	if (m_bLowMemory || m_buf.isNull() || !isVisible())
+	{
+		// 隐藏的控件不画预览, 显示出来时直接按精确的分辨率渲染
+		// hidden widgets get no preview, the exact resolution is rendered
+		// once they are exposed
+		m_settleTimer.stop();
+		m_imgPreview = QImage();
+		m_imgPreviewBase = QImage();
+		scheduleRender(RenderWarm);
+	}
+	else
+	{
+		renderPreview();
+		m_settleTimer.start(SettleDelay, this);
+	}
+	update();
+}
+
+
+// 把当前完整的底图(圆环 + 三角形)缩小进金字塔: 不大于它的各级换成新的, 更大的级保留
+// scale the finished base (ring + triangle) down into the pyramid: the levels
+// up to its size are replaced, larger ones are kept
+void KColorCircleHsv::updatePyramid()
+{
+	if (m_bPyramidCurrent || m_frameJob || m_imgBase.isNull() || m_nTriangleHue < 0)
+		return;
+	
+	int radius = (qMin(m_imgBase.width(), m_imgBase.height()) - 1) / 2;
+	int side = 2 * radius + 1;
+	QPoint center = m_imgBase.rect().center();
+	QImage level = m_imgBase.copy(center.x() - radius, center.y() - radius, side, side);
+	QRgb background = ringKey().background;
+	for (int k = PyramidLevels - 1; k >= 0; --k)
+	{
+		int levelSide = PyramidBase << k;
+		if (levelSide > side)
+			continue;
+		level = level.scaled(levelSide, levelSide, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+		m_pyramid[k].image = level;
+		m_pyramid[k].hue = m_nTriangleHue;
+		m_pyramid[k].background = background;
+	}
+	m_bPyramidCurrent = true;
+}
+
+
+// 预览: 不小于目标的最小一级(缩小, 清晰), 没有就用最大的一级; 三角形色相不对时重画,
+// 叠加层按当前几何精确地画. 缩放的一级存为预览底图, 只在尺寸改变时重建
+// preview: the smallest level no smaller than the target (scaled down, sharp),
+// else the largest one; the triangle is redrawn when its hue is stale and the
+// overlays are drawn exactly for the current geometry. The scaled level is
+// kept as the preview base and only rebuilt when the size changes
+void KColorCircleHsv::renderPreview()
+{
+	QRgb background = ringKey().background;
+	int side = 2 * m_nOuterRadius + 1;
+	const PyramidLevel *level = 0;
+	for (int k = 0; k < PyramidLevels; ++k)
+	{
+		const PyramidLevel &l = m_pyramid[k];
+		if (l.image.isNull() || l.background != background)
+			continue;
+		level = &l;
+		if (l.image.width() >= side)
+			break;
+	}
+	if (!level || imageSize().isEmpty())
+	{
+		m_imgPreview = QImage();
+		m_imgPreviewBase = QImage();
+		return;
+	}
+	
+	if (m_imgPreviewBase.size() != imageSize() || m_imgPreviewBase.format() != m_outputFormat)
+		m_imgPreviewBase = QImage(imageSize(), m_outputFormat);
+	m_imgPreviewBase.fill(QColor(background));
+	QPoint center = imageRect().center();
+	{
+		QPainter p(&m_imgPreviewBase);
+		p.setRenderHint(QPainter::SmoothPixmapTransform);
+		p.drawImage(QRect(center.x() - m_nOuterRadius, center.y() - m_nOuterRadius, side, side),
+					level->image);
+	}
+	m_nPreviewBaseHue = level->hue;
+	m_nPreviewHue = -1;
+	
+	if (m_imgPreview.size() != imageSize() || m_imgPreview.format() != m_outputFormat)
+		m_imgPreview = QImage(imageSize(), m_outputFormat);
+	m_rcPreviewTriangle = QRect();
+	const QRect all = m_imgPreview.rect();
+	updatePreview(&all, 1);
+}
+
+
+// 预览中只重画rects: 从预览底图恢复, 色相变了时连同新旧三角形区域重画三角形, 再画叠加层
+// redraw only rects of the preview: restore them from the preview base,
+// redraw the triangle over the old and new triangle areas when the hue
+// changed, then draw the overlays
+void KColorCircleHsv::updatePreview(const QRect *rects, int count)
+{
+	DirtyRects dirty;
+	for (int i = 0; i < count; ++i)
+		dirty.add(rects[i] & m_imgPreview.rect());
+	const bool hueChanged = m_nPreviewHue != m_nCurrentHue;
+	if (hueChanged)
+	{
+		dirty.add(m_rcPreviewTriangle & m_imgPreview.rect());
+		dirty.add(triangleRect() & m_imgPreview.rect());
+	}
+	
+	for (int i = 0; i < dirty.count; ++i)
+		copyImageRect(&m_imgPreview, m_imgPreviewBase, dirty.rects[i]);
+	if (hueChanged)
+	{
+		if (m_nPreviewBaseHue != m_nCurrentHue)
+		{
+			drawTriangle(&m_imgPreview, pa, pb, pc, apexColor(m_nCurrentHue, m_colorModel), 0, -1,
+						 &m_triangleScratch, true, m_colorModel);
+		}
+		m_nPreviewHue = m_nCurrentHue;
+		m_rcPreviewTriangle = triangleRect();
+	}
+	for (int i = 0; i < dirty.count; ++i)
+	{
+		const QRect &r = dirty.rects[i];
+		if (r.isEmpty())
+			continue;
+		paintDistribution(&m_imgPreview, r);
+		paintOverlays(&m_imgPreview, r);
+		if (displayManaged())
+		{
+			const int pixel = m_imgPreview.depth() / 8;
+			QImage view(m_imgPreview.scanLine(r.top()) + r.left() * pixel, r.width(), r.height(),
+						m_imgPreview.bytesPerLine(), m_imgPreview.format());
+			m_displayLut->mapImage(&view);
+		}
+		update(mapFromImage(r));
+	}
+}
+
+
+void KColorCircleHsv::paintEvent(QPaintEvent *e)
+{
+	KHsvFrameStats *stats = m_frameStats.data();
+	qint64 frameStart = stats ? stats->now() : 0;
+	bool stale = false;
+	QElapsedTimer cost;
+	if (m_nFrameBudget > 0)
+		cost.start();
+	{
+		QPainter p(this);
+		
+		// 显示出来了, 等待调度的渲染马上执行
+		// exposed now, a pending scheduled render runs at once
+		if (m_nScheduledRender)
+			runScheduledRender(true);
+		
+		if (!m_dirty.isEmpty())
+			paintImage();
+		
+		// paintCompact自己分阶段计时
+		// paintCompact times its own stages
+		KHsvStageTimer timer(m_bLowMemory ? 0 : stats, StageBlit);
+		const QImage *frame = 0;
+		if (m_buf.size() == imageSize())
+			frame = displayManaged() && m_bufDisplay.size() == m_buf.size() ? &m_bufDisplay : &m_buf;
+		else if (m_imgPreview.size() == imageSize())
+			frame = &m_imgPreview;
+		
+		if (m_bLowMemory)
+			paintCompact(&p, e->region());
+		else if (!frame)
+		{
+			// 新尺寸的帧和预览都没有: 先缩放贴上一帧
+			// neither the frame nor a preview for the new size: scale the previous one
+			stale = true;
+			if (m_buf.isNull())
+				p.fillRect(contentsRect(), palette().window());
+			else if (displayManaged() && m_bufDisplay.size() == m_buf.size())
+				p.drawImage(contentsRect(), m_bufDisplay);
+			else
+				p.drawImage(contentsRect(), m_buf);
+			timer.setPixels(qint64(contentsRect().width()) * contentsRect().height());
+		}
+		else
+		{
+			// 只贴需要重画的部分, 一个图像像素对应一个设备像素
+			// blit only the exposed part, one image pixel per device pixel
+			QVector<QRect> rects = regionRects(e->region().intersected(contentsRect()));
+			qint64 pixels = 0;
+			for (int i = 0; i < rects.size(); ++i)
+			{
+				QRect rect = mapToImage(rects.at(i));
+				blit(&p, rect, *frame, rect.topLeft());
+				pixels += qint64(rect.width()) * rect.height();
+			}
+			timer.setPixels(pixels);
+		}
+	}
+	
+	if (m_nFrameBudget > 0)
+		governFrame(cost.nsecsElapsed() / 1e6);
+	
+	// 超过一帧(60Hz)或只能显示旧帧的算掉帧
+	// a frame is dropped when it overran 60Hz or could only show the stale one
+	if (stats)
+	{
+		qint64 duration = stats->now() - frameStart;
+		if (stats->endFrame(frameStart, duration, stale || duration > 1000000000 / 60))
+			stats->logSummary();
+	}
+}
+
+
+// s v定位圈所占区域(含画笔宽度和反走样)
+// area of the s v selector, including pen width and antialiasing
+QRect KColorCircleHsv::selectorRect() const
+{
+	qreal margin = m_nPenWidth + 2;
+	return QRectF(m_dSelectorPos.x() - m_nSVEllipseSize / 2.0 - margin,
+				  m_dSelectorPos.y() - m_nSVEllipseSize / 2.0 - margin,
+				  m_nSVEllipseSize + 0.5 + margin * 2, m_nSVEllipseSize + 0.5 + margin * 2).toAlignedRect();
+}
+
+// hue定位线所占区域
+// area of the hue marker line
+QRect KColorCircleHsv::hueLineRect() const
+{
+	qreal margin = m_nPenWidth + 2;
+	return QRectF(pa, pd).normalized().adjusted(-margin, -margin, margin, margin).toAlignedRect();
+}
+
+// 三角形所占区域
+// area of the triangle
+QRect KColorCircleHsv::triangleRect() const
+{
+	return triangleBounds(pa, pb, pc).adjusted(-1, -1, 1, 1);
+}
+
+
+// 状态改变后, 标记旧的和新的定位圈/定位线区域为脏, 色相改变时加上三角形
+// after a state change, mark the old and new selector / marker areas dirty,
+// plus the triangle when the hue changed
+void KColorCircleHsv::markDirty()
+{
+	QRect rects[6];
+	int n = 0;
+	rects[n++] = m_rcPaintedSelector;
+	rects[n++] = m_rcPaintedHueLine;
+	rects[n++] = selectorRect();
+	rects[n++] = hueLineRect();
+	if (m_nCurrentHue != m_nTriangleHue)
+	{
+		rects[n++] = m_rcTriangleLayer;
+		rects[n++] = triangleRect();
+	}
+	
+	// 新尺寸的帧完成之前只更新预览的这些区域
+	// only these areas of the preview are updated until the frame for the
+	// new size is done
+	if (!m_imgPreview.isNull())
+	{
+		updatePreview(rects, n);
+		return;
+	}
+	
+	QRect bounds = m_bLowMemory ? imageRect() : m_buf.rect();
+	for (int i = 0; i < n; ++i)
+	{
+		QRect r = rects[i] & bounds;
+		if (r.isEmpty())
+			continue;
+		m_dirty.add(r);
+		update(mapFromImage(r));
+	}
+}
+
+
+/* 缓冲图: 三层合成, 每层只因自己依赖的状态而重画
+ *   圆环 m_imgBG      : 几何/调色板改变
+ *   底图 m_imgBase    : 圆环 + 三角形, 色相改变时只重画三角形区域
+ *   叠加 m_buf        : 底图 + 定位线/定位圈, 只重画脏区域
+ * 只拖动s v时只有叠加层的脏区域需要合成.
+ */
+/* cache image: three retained layers, each redrawn only for the state it depends on
+ *   ring     m_imgBG   : geometry / palette
+ *   base     m_imgBase : ring + triangle, only the triangle area is redrawn on a hue change
+ *   overlay  m_buf     : base + hue line / selector, only the dirty region is redrawn
+ * A pure s v drag only composites the dirty part of the overlay layer.
+ */
+void KColorCircleHsv::paintImage()
+{
+#ifdef KCOLORCIRCLEHSV_ALLOC_STATS
+	KHsvAllocationScope allocationScope(&m_nPaintAllocations);
+#endif
+	if (m_bLowMemory)
+	{
+		// 只准备索引圆环, 其余在paintCompact中按带画
+		// only the indexed ring is prepared here, paintCompact draws the rest
+		// band by band
+		if (m_bNeedUpdateBackground)
+		{
+			m_bNeedUpdateBackground = false;
+			KHsvRingKey key = ringKey();
+			KHsvStageTimer timer(m_frameStats.data(), StageBackground,
+								 qint64(key.size.width()) * key.size.height());
+			if (!m_compactRing)
+				m_compactRing = QSharedPointer<KHsvCompactRing>(new KHsvCompactRing);
+			m_compactRing->build(key.size, m_nOuterRadius, m_nOuterRadius - m_dOuterInnerWidth,
+								 key.background, modelRingHues(key.model));
+		}
+		m_dirty.clear();
+		return;
+	}
+	// 尺寸稳定前不渲染新的背景
+	// no new background until the size settles
+	if (m_bNeedUpdateBackground && !m_settleTimer.isActive())
+	{
+		m_bNeedUpdateBackground = false;
+		if (m_bThreadedRendering)
+			startFrameRender();
+		else
+		{
+			// 尺寸不变时重用原来的图像
+			// keep the existing images when the size is unchanged
+			createBackground();
+			if (m_imgBase.size() != m_imgBG.size() || m_imgBase.format() != m_imgBG.format())
+				m_imgBase = QImage(m_imgBG.size(), m_imgBG.format());
+			if (m_buf.size() != m_imgBG.size() || m_buf.format() != m_imgBG.format())
+				m_buf = QImage(m_imgBG.size(), m_imgBG.format());
+			copyImageRect(&m_imgBase, m_imgBG, m_imgBG.rect());
+			m_nTriangleHue = -1;
+			m_rcTriangleLayer = QRect();
+			m_bPyramidCurrent = false;
+			m_imgPreview = QImage();
+			m_imgPreviewBase = QImage();
+			m_dirty.clear();
+			m_dirty.add(m_buf.rect());
+		}
+	}
+	// 新尺寸的帧还没渲染完
+	// the frame for the new size is not finished yet
+	if (m_frameJob || m_imgBase.size() != imageSize())
+		return;
+	if (m_nTriangleHue != m_nCurrentHue)
+		updateTriangleLayer();
+	
+	// 从底图恢复脏区域, 再画叠加层
+	// restore the dirty rectangles from the base layer, then the overlays
+	KHsvStageTimer timer(m_frameStats.data(), StageOverlays);
+	qint64 pixels = 0;
+	for (int i = 0; i < m_dirty.count; ++i)
+	{
+		pixels += qint64(m_dirty.rects[i].width()) * m_dirty.rects[i].height();
+		copyImageRect(&m_buf, m_imgBase, m_dirty.rects[i]);
+		paintDistribution(&m_buf, m_dirty.rects[i]);
+		paintOverlays(&m_buf, m_dirty.rects[i]);
+	}
+	if (displayManaged())
+		updateDisplayImage();
+	timer.setPixels(pixels);
+	
+	m_rcPaintedSelector = selectorRect();
+	m_rcPaintedHueLine = hueLineRect();
+	m_dirty.clear();
+}
+
+
+bool KColorCircleHsv::displayManaged() const
+{
+	return m_displayLut && m_outputFormat == QImage::Format_RGB32;
+}
+
+
+/* 脏区域从m_buf变换到m_bufDisplay. 圆环每个m_imgBG只变换一次,
+ * 之后只有三角形和叠加层的像素经过LUT.
+ */
+/* transforms the dirty rectangles from m_buf into m_bufDisplay. The ring is
+ * transformed once per m_imgBG, after that only the triangle and overlay
+ * pixels go through the LUT.
+ */
+void KColorCircleHsv::updateDisplayImage()
+{
+	if (m_imgBGDisplay.size() != m_imgBG.size() || m_nDisplayRingKey != m_imgBG.cacheKey())
+	{
+		m_imgBGDisplay = m_imgBG.copy();
+		m_displayLut->mapImage(&m_imgBGDisplay);
+		m_nDisplayRingKey = m_imgBG.cacheKey();
+	}
+	if (m_bufDisplay.size() != m_buf.size())
+	{
+		m_bufDisplay = QImage(m_buf.size(), m_buf.format());
+		m_displayLut->mapOverRing(m_buf, m_imgBG, m_imgBGDisplay, &m_bufDisplay, m_buf.rect());
+		return;
+	}
+	for (int i = 0; i < m_dirty.count; ++i)
+		m_displayLut->mapOverRing(m_buf, m_imgBG, m_imgBGDisplay, &m_bufDisplay, m_dirty.rects[i]);
+}
+
+
+bool KColorCircleHsv::setDisplayLut(const QString &fileName)
+{
+	QSharedPointer<KHsvDisplayLut> lut;
+	if (!fileName.isEmpty())
+	{
+		lut = KHsvDisplayLut::fromCube(fileName);
+		if (!lut)
+			return false;
+	}
+	setDisplayTransform(lut);
+	return true;
+}
+
+
+bool KColorCircleHsv::setDisplayProfile(const QByteArray &iccProfile)
+{
+	QSharedPointer<KHsvDisplayLut> lut;
+	if (!iccProfile.isEmpty())
+	{
+		lut = KHsvDisplayLut::fromIccProfile(iccProfile);
+		if (!lut)
+			return false;
+	}
+	setDisplayTransform(lut);
+	return true;
+}
+
+
+bool KColorCircleHsv::isColorManaged() const
+{
+	return !m_displayLut.isNull();
+}
+
+
+void KColorCircleHsv::setDisplayTransform(const QSharedPointer<KHsvDisplayLut> &lut)
+{
+	m_displayLut = lut;
+	m_imgBGDisplay = QImage();
+	m_bufDisplay = QImage();
+	if (!m_imgPreview.isNull())
+		renderPreview();
+	m_dirty.clear();
+	m_dirty.add(imageRect());
+	scheduleRender();
+}
+
+
+/* 低内存模式: 每个暴露的矩形按CompactBandRows行一带, 在同一个带缓冲中
+ * 依次展开圆环, 画三角形和叠加层, 再贴到窗口上.
+ */
+/* low-memory mode: each exposed rectangle goes in bands of CompactBandRows
+ * rows through one band buffer, which gets the ring unpacked, the triangle
+ * and the overlays drawn, and is then blitted to the window.
+ */
+void KColorCircleHsv::paintCompact(QPainter *p, const QRegion &region)
+{
+	if (!m_compactRing || m_compactRing->size() != imageSize())
+	{
+		p->fillRect(contentsRect(), palette().window());
+		return;
+	}
+	
+	if (m_compactBand.width() < imageSize().width())
+		m_compactBand = QImage(imageSize().width(), CompactBandRows, QImage::Format_RGB32);
+	
+	KHsvFrameStats *stats = m_frameStats.data();
+	const QColor hueColor = apexColor(m_nCurrentHue, m_colorModel);
+	const QRect triangle = triangleRect();
+	QVector<QRect> rects = regionRects(region.intersected(contentsRect()));
+	for (int i = 0; i < rects.size(); ++i)
+	{
+		QRect rect = mapToImage(rects.at(i));
+		for (int y = rect.top(); y <= rect.bottom(); y += CompactBandRows)
+		{
+			QRect band(rect.left(), y, rect.width(), qMin(int(CompactBandRows), rect.bottom() + 1 - y));
+			QImage view(m_compactBand.bits(), band.width(), band.height(),
+						m_compactBand.bytesPerLine(), m_compactBand.format());
+			const QPointF offset = band.topLeft();
+			{
+				KHsvStageTimer timer(stats, StageBackground, qint64(band.width()) * band.height());
+				m_compactRing->expand(&view, band.topLeft());
+			}
+			if (band.intersects(triangle))
+			{
+				KHsvStageTimer timer(stats, StageTriangle, qint64(band.width()) * band.height());
+				drawTriangle(&view, pa - offset, pb - offset, pc - offset, hueColor, 0, -1,
+							 &m_triangleScratch, m_quality < QualityNoAntialias, m_colorModel);
+			}
+			{
+				KHsvStageTimer timer(stats, StageOverlays, qint64(band.width()) * band.height());
+				paintDistribution(&view, band, band.topLeft());
+				paintOverlays(&view, band, band.topLeft());
+				if (m_displayLut)
+					m_displayLut->mapImage(&view);
+			}
+			KHsvStageTimer timer(stats, StageBlit, qint64(band.width()) * band.height());
+			blit(p, band, view, QPoint(0, 0));
+		}
+	}
+	
+	m_nTriangleHue = m_nCurrentHue;
+	m_rcTriangleLayer = triangle;
+	m_rcPaintedSelector = selectorRect();
+	m_rcPaintedHueLine = hueLineRect();
+}
+
+
+// 底图换成当前色相的三角形: 缓存中有就直接贴, 否则后台渲染(完成前保留旧的三角形)
+// bring the base layer to the current hue: blit a cached triangle, otherwise
+// render it in the background and keep the old triangle until it is done
+void KColorCircleHsv::updateTriangleLayer()
+{
+	// ########  三角形
+	KHsvStageTimer timer(m_frameStats.data(), StageTriangle);
+	TriangleGeometry geometry = triangleGeometry();
+	TriangleTile tile;
+	if (m_triangleCache->find(m_nCurrentHue, geometry, &tile))
+	{
+		QRect changed = setTriangleLayer(m_nCurrentHue, tile);
+		timer.setPixels(qint64(changed.width()) * changed.height());
+		return;
+	}
+	
+	// 降低画质时先画草图, 完整的三角形之后再换上
+	// at reduced quality draw a draft now, the full triangle replaces it later
+	if (m_quality > QualityFull)
+	{
+		QRect changed = setTriangleLayer(m_nCurrentHue, renderDraftTile(m_nCurrentHue, geometry));
+		timer.setPixels(qint64(changed.width()) * changed.height());
+		m_bDraftTriangle = true;
+		if (m_bThreadedRendering)
+			startTileRender();
+		return;
+	}
+	
+	if (m_bThreadedRendering)
+	{
+		startTileRender();
+		return;
+	}
+	
+	tile = renderTriangleTile(m_nCurrentHue, geometry, &m_triangleScratch);
+	m_triangleCache->insert(m_nCurrentHue, geometry, tile, true);
+	QRect changed = setTriangleLayer(m_nCurrentHue, tile);
+	timer.setPixels(qint64(changed.width()) * changed.height());
+}
+
+
+// 底图: 擦掉旧的三角形, 贴上新的, 返回改变的区域(已加入脏区域)
+// base layer: erase the old triangle and blit the new one, returns the changed
+// area (already added to the dirty region)
+QRect KColorCircleHsv::setTriangleLayer(int hue, const TriangleTile &tile)
+{
+	QRect changed = m_rcTriangleLayer;
+	copyImageRect(&m_imgBase, m_imgBG, m_rcTriangleLayer);
+	
+	compositeImage(&m_imgBase, tile.image, tile.offset);
+	
+	m_rcTriangleLayer = QRect(tile.offset, tile.image.size());
+	m_nTriangleHue = hue;
+	m_bPyramidCurrent = false;
+	m_bDraftTriangle = false;
+	m_dirty.add(changed);
+	m_dirty.add(m_rcTriangleLayer);
+	return changed | m_rcTriangleLayer;
+}
+
+
+// 叠加层: hue定位线和s v定位圈
+// overlay layer: hue marker line and s v selector
+// 颜色分布热度图: 色相画在圆环内侧40%, (s,v)画在三角形上(与色相无关)
+// distribution heat map: hue over the inner 40% of the ring, (s,v) over the
+// triangle (independent of the hue)
+void KColorCircleHsv::paintDistribution(QImage *buf, const QRect &clip, const QPoint &origin)
+{
+	// 直方图按HSV分格, 只画在HSV的布局上
+	// the histogram is binned in HSV and only drawn over the HSV layout
+	if (!m_distribution || m_colorModel != ModelHsv)
+		return;
+	HSV_WITH_FORMAT(buf->format(), paintDistributionFormat, (buf, clip, origin));
+}
+
+template <class Dst>
+void KColorCircleHsv::paintDistributionFormat(QImage *buf, const QRect &clip, const QPoint &origin)
+{
+	const KHsvRingTables &tables = ringTables();
+	const KHsvDistribution &dist = *m_distribution;
+	const SvTransform &t = m_svTransform;
+	const qreal ox = t.ox - origin.x();
+	const qreal oy = t.oy - origin.y();
+	const QPoint center = imageRect().center() - origin;
+	const qreal innerRadius = m_nOuterRadius - m_dOuterInnerWidth + 0.5;
+	const qreal hole = innerRadius * innerRadius;
+	const qreal r0 = (innerRadius + 1.0) * (innerRadius + 1.0);
+	const qreal r1 = (innerRadius + m_dOuterInnerWidth * 0.4) * (innerRadius + m_dOuterInnerWidth * 0.4);
+	
+	QRect area = clip.translated(-origin) & buf->rect();
+	for (int y = area.top(); y <= area.bottom(); ++y)
+	{
+		typename Dst::Pixel *scanline = reinterpret_cast<typename Dst::Pixel *>(buf->scanLine(y));
+		const qreal dy = y - center.y();
+		const qreal ty = y + 0.5 - oy;
+		for (int x = area.left(); x <= area.right(); ++x)
+		{
+			const qreal dx = x - center.x();
+			const qreal d2 = dx * dx + dy * dy;
+			if (d2 >= r0 && d2 <= r1)
+			{
+				qreal h = 90.0 - tables.angle(dx, -dy);
+				if (h < 0.0)
+					h += 360.0;
+				int bin = (int) h;
+				if (bin >= KHsvDistribution::HueBins)
+					bin -= KHsvDistribution::HueBins;
+				scanline[x] = Dst::over(dist.hueHeat(bin), scanline[x], x, y);
+			}
+			else if (d2 < hole)
+			{
+				const qreal tx = x + 0.5 - ox;
+				const qreal v = t.i11 * tx + t.i12 * ty;
+				const qreal w = t.i21 * tx + t.i22 * ty;
+				if (v < 0.0 || v > 1.0 || w < 0.0 || w > v)
+					continue;
+				int sb = v > 0.0 ? qMin((int) (w / v * KHsvDistribution::SvBins), KHsvDistribution::SvBins - 1) : 0;
+				int vb = qMin((int) (v * KHsvDistribution::SvBins), KHsvDistribution::SvBins - 1);
+				scanline[x] = Dst::over(dist.svHeat(sb, vb), scanline[x], x, y);
+			}
+		}
+	}
+}
+
+
+void KColorCircleHsv::paintOverlays(QImage *buf, const QRect &clip, const QPoint &origin)
+{
+	// ##### 画hue定位线
+	QRgb lineColor, selectorColor;
+	markerColors(apexColor(m_nCurrentHue, m_colorModel).rgb(), &lineColor, &selectorColor);
+	const bool antialias = m_quality < QualityNoAntialias;
+	QRect area = clip.translated(-origin);
+	strokeLine(buf, area, pa - origin, pd - origin, m_nPenWidth, lineColor, antialias);
+	
+	// ##### 画s v定位圈
+	// 反色效果
+	qreal radius = (m_nSVEllipseSize + 0.5) / 2.0;
+	QPointF center(m_dSelectorPos.x() - m_nSVEllipseSize / 2.0 + radius - origin.x(),
+				   m_dSelectorPos.y() - m_nSVEllipseSize / 2.0 + radius - origin.y());
+	strokeCircle(buf, area, center, radius, m_nPenWidth, selectorColor, antialias);
+}
+
+
+// 定位线: 纯色顶点亮时黑色, 暗时白色; 定位圈: 纯色顶点的反色
+// marker line: black over light pure colours, white over dark ones;
+// selector: the inverse of the pure colour
+void KColorCircleHsv::markerColors(QRgb hueColor, QRgb *lineColor, QRgb *selectorColor)
+{
+	int ri = qRed(hueColor), gi = qGreen(hueColor), bi = qBlue(hueColor);
+	// 混合RGB通道 ：red*30% + green*59% + blue*11%=255
+	// 参考http://www.gimp.org/tutorials/Color2BW/
+	if ((ri * 30) + (gi * 59) + (bi * 11) > 12800)
+		*lineColor = qRgb(0, 0, 0);
+	else
+		*lineColor = qRgb(255, 255, 255);
+	*selectorColor = qRgb(255 - ri, 255 - gi, 255 - bi);
+}
+
+
+// 白色画在黑底上的覆盖率转成color的预乘ARGB
+// turns coverage drawn white on black into premultiplied ARGB of color
+static QImage coverageSprite(const QImage &mask, QRgb color)
+{
+	QImage sprite(mask.size(), QImage::Format_ARGB32_Premultiplied);
+	for (int y = 0; y < mask.height(); ++y)
+	{
+		const QRgb *src = reinterpret_cast<const QRgb *>(mask.constScanLine(y));
+		QRgb *dst = reinterpret_cast<QRgb *>(sprite.scanLine(y));
+		for (int x = 0; x < mask.width(); ++x)
+		{
+			int a = qRed(src[x]);
+			dst[x] = qRgba((qRed(color) * a + 127) / 255, (qGreen(color) * a + 127) / 255,
+						   (qBlue(color) * a + 127) / 255, a);
+		}
+	}
+	return sprite;
+}
+
+
+// 水平的定位线图块, 长length; anchor返回线的起点在图块中的位置
+// a horizontal marker line sprite of the given length; anchor receives where
+// the line starts in the sprite
+QImage KColorCircleHsv::renderLineMarker(qreal length, int penWidth, QRgb color, QPointF *anchor)
+{
+	qreal margin = penWidth + 2;
+	QImage mask((int) ceil(length + margin * 2), (int) ceil(margin * 2), QImage::Format_RGB32);
+	mask.fill(qRgb(0, 0, 0));
+	*anchor = QPointF(margin, margin);
+	strokeLine(&mask, mask.rect(), *anchor, *anchor + QPointF(length, 0.0), penWidth, qRgb(255, 255, 255));
+	return coverageSprite(mask, color);
+}
+
+
+// 定位圈图块; anchor返回圆心在图块中的位置
+// a selector circle sprite; anchor receives the circle's center in the sprite
+QImage KColorCircleHsv::renderCircleMarker(qreal radius, int penWidth, QRgb color, QPointF *anchor)
+{
+	qreal margin = radius + penWidth + 2;
+	int side = (int) ceil(margin * 2);
+	QImage mask(side, side, QImage::Format_RGB32);
+	mask.fill(qRgb(0, 0, 0));
+	*anchor = QPointF(margin, margin);
+	strokeCircle(&mask, mask.rect(), *anchor, radius, penWidth, qRgb(255, 255, 255));
+	return coverageSprite(mask, color);
+}
+
+
+// 画三角形SV, 只画[yBegin, yEnd)的行, yEnd < 0 : 到图像底部
+// 边缘解析抗锯齿
+// draws the SV triangle with analytic edge anti-aliasing, only rows [yBegin, yEnd), yEnd < 0 : to the bottom of the image
+void KColorCircleHsv::drawTriangle(QImage *buf, const QPointF &pa,
+								const QPointF &pb, const QPointF &pc,
+								const QColor &color, int yBegin, int yEnd,
+								TriangleScratch *scratch, bool antialias, ColorModel model)
+{
+	HSV_WITH_FORMAT(buf->format(), drawTriangleFormat,
+					(buf, pa, pb, pc, color, yBegin, yEnd, scratch, antialias, model));
+}
+
+template <class Dst>
+void KColorCircleHsv::drawTriangleFormat(QImage *buf, const QPointF &pa,
+								const QPointF &pb, const QPointF &pc,
+								const QColor &color, int yBegin, int yEnd,
+								TriangleScratch *scratch, bool antialias, ColorModel model)
+{
+	if (model == ModelOklch)
+		drawTriangleModel<KHsvModelOklch, Dst>(buf, pa, pb, pc, color, yBegin, yEnd, scratch, antialias);
+	else
+		drawTriangleModel<KHsvModelHsv, Dst>(buf, pa, pb, pc, color, yBegin, yEnd, scratch, antialias);
+}
+
+// 顶点的颜色在Model的插值空间中线性插值, 由Model转换成像素, 写成Dst的像素格式
+// vertex colours are interpolated linearly in Model's space, turned into
+// pixels by Model and written in Dst's pixel format
+template <class Model, class Dst>
+void KColorCircleHsv::drawTriangleModel(QImage *buf, const QPointF &pa,
+								const QPointF &pb, const QPointF &pc,
+								const QColor &color, int yBegin, int yEnd,
+								TriangleScratch *scratch, bool antialias)
+{
+	if (yEnd < 0)
+		yEnd = buf->height();
+	
+	Vertex aa(color, pa);
+	Vertex bb(Qt::black, pb);
+	Vertex cc(Qt::white, pc);
+	qreal channels[3];
+	Model::vertex(color.rgb(), channels);
+	aa.color = DoubleColor(channels[0], channels[1], channels[2]);
+	Model::vertex(qRgb(0, 0, 0), channels);
+	bb.color = DoubleColor(channels[0], channels[1], channels[2]);
+	Model::vertex(qRgb(255, 255, 255), channels);
+	cc.color = DoubleColor(channels[0], channels[1], channels[2]);
+	
+	// 冒泡sort
+	// Y : aa < bb < cc.
+	if (aa.point.y() > bb.point.y())
+		std::swap(aa, bb);
+	if (aa.point.y() > cc.point.y())
+		std::swap(aa, cc);
+	if (bb.point.y() > cc.point.y())
+		std::swap(bb, cc);
+	
+	qreal aabbydist = bb.point.y() - aa.point.y();
+	qreal aaccydist = cc.point.y() - aa.point.y();
+	qreal bbccydist = cc.point.y() - bb.point.y();
+	qreal aabbxdist = bb.point.x() - aa.point.x();
+	qreal aaccxdist = cc.point.x() - aa.point.x();
+	qreal bbccxdist = cc.point.x() - bb.point.x();
+
+	// 左三角： bb.x < aa.x : 
+	bool lefty = aabbxdist < 0;
+	
+	// 每行的边界, 从三角形的第一行yTop开始存
+	// per-row edges, stored from the triangle's first row yTop
+	const int yTop = int(floor(aa.point.y()));
+	TriangleScratch localScratch;
+	if (!scratch)
+		scratch = &localScratch;
+	scratch->reserve(int(floor(cc.point.y())) - yTop + 1);
+	DoubleColor *leftColors = scratch->leftColors.data();
+	DoubleColor *rightColors = scratch->rightColors.data();
+	qreal *leftX = scratch->leftX.data();
+	qreal *rightX = scratch->rightX.data();
+	
+	// 只走扫描会读到的行: 按带绘制时每带只算自己的几行
+	// only walk the rows the scan below reads: drawn in bands, each band
+	// computes just its own rows
+	const int colorBegin = yTop;
+	const int colorEnd = int(floor(cc.point.y()));
+	const int ybegin = qMax(qMax(yBegin, 0), colorBegin - 1);
+	const int yend = qMin(qMin(yEnd, buf->height()), colorEnd + 2);
+	if (colorEnd <= colorBegin || ybegin >= yend)
+		return;
+	const int rowBegin = qBound(colorBegin, ybegin, colorEnd - 1);
+	const int rowEnd = qBound(colorBegin, yend - 1, colorEnd - 1) + 1;
+	
+	DoubleColor source;
+	DoubleColor dest;
+	qreal r, g, b;
+	qreal rdelta, gdelta, bdelta;
+	qreal x;
+	qreal xdelta;
+	int y1, y2;
+
+	// 
+	x = aa.point.x();
+	source = aa.color;
+	dest = cc.color;
+	r = source.r;
+	g = source.g;
+	b = source.b;
+	y1 = (int) floor(aa.point.y());
+	y2 = qMin((int) floor(cc.point.y()), rowEnd);
+	
+	// delta
+	xdelta = aaccxdist / aaccydist;
+	rdelta = (dest.r - r) / aaccydist;
+	gdelta = (dest.g - g) / aaccydist;
+	bdelta = (dest.b - b) / aaccydist;
+	if (y1 < rowBegin)
+	{
+		const int skip = rowBegin - y1;
+		r += skip * rdelta;
+		g += skip * gdelta;
+		b += skip * bdelta;
+		x += skip * xdelta;
+		y1 = rowBegin;
+	}
+	
+	// 线性渐变
+	int y;
+	for (y = y1; y < y2; ++y) 
+	{
+		if (lefty) 
+		{
+			rightColors[y - yTop] = DoubleColor(r, g, b);
+			rightX[y - yTop] = x;
+		}
+		else
+		{
+			leftColors[y - yTop] = DoubleColor(r, g, b);
+			leftX[y - yTop] = x;
+		}
+		
+		r += rdelta;
+		g += gdelta;
+		b += bdelta;
+		x += xdelta;
+	}
+	
+	x = aa.point.x();
+	source = aa.color;
+	dest = bb.color;
+	r = source.r;
+	g = source.g;
+	b = source.b;
+	y1 = (int) floor(aa.point.y());
+	y2 = qMin((int) floor(bb.point.y()), rowEnd);
+	
+	xdelta = aabbxdist / aabbydist;
+	rdelta = (dest.r - r) / aabbydist;
+	gdelta = (dest.g - g) / aabbydist;
+	bdelta = (dest.b - b) / aabbydist;
+	if (y1 < rowBegin)
+	{
+		const int skip = rowBegin - y1;
+		r += skip * rdelta;
+		g += skip * gdelta;
+		b += skip * bdelta;
+		x += skip * xdelta;
+		y1 = rowBegin;
+	}
+	
+	for (y = y1; y < y2; ++y)
 	{
 		if (lefty)
 		{
-			leftColors[y] = DoubleColor(r, g, b);
-			leftX[y] = x;
+			leftColors[y - yTop] = DoubleColor(r, g, b);
+			leftX[y - yTop] = x;
 		}
 		else
 		{
-			rightColors[y] = DoubleColor(r, g, b);
-			rightX[y] = x;
+			rightColors[y - yTop] = DoubleColor(r, g, b);
+			rightX[y - yTop] = x;
 		}
 		
 		r += rdelta;
@@ -650,24 +7020,33 @@ void KColorCircleHsv::drawTriangle(QImage *buf, const QPointF &pa,
 	g = source.g;
 	b = source.b;
 	y1 = (int) floor(bb.point.y());
-	y2 = (int) floor(cc.point.y());
+	y2 = qMin((int) floor(cc.point.y()), rowEnd);
 	
 	xdelta = bbccxdist / bbccydist;
 	rdelta = (dest.r - r) / bbccydist;
 	gdelta = (dest.g - g) / bbccydist;
 	bdelta = (dest.b - b) / bbccydist;
+	if (y1 < rowBegin)
+	{
+		const int skip = rowBegin - y1;
+		r += skip * rdelta;
+		g += skip * gdelta;
+		b += skip * bdelta;
+		x += skip * xdelta;
+		y1 = rowBegin;
+	}
 	
 	for (y = y1; y < y2; ++y)
 	{
 		if (lefty)
 		{
-			leftColors[y] = DoubleColor(r, g, b);
-			leftX[y] = x;
+			leftColors[y - yTop] = DoubleColor(r, g, b);
+			leftX[y - yTop] = x;
 		}
 		else
 		{
-			rightColors[y] = DoubleColor(r, g, b);
-			rightX[y] = x;
+			rightColors[y - yTop] = DoubleColor(r, g, b);
+			rightX[y - yTop] = x;
 		}
 		
 		r += rdelta;
@@ -678,71 +7057,104 @@ void KColorCircleHsv::drawTriangle(QImage *buf, const QPointF &pa,
 	
 	// 从上到下，从左到右扫描buf，在(pa,pb,pc范围内)
 	// 从左到右：从leftColor到rightColor做线性变换
-	//	从 上到下
-	const int ccyfloor = int(floor(cc.point.y()));
-	for (int y = int(floor(aa.point.y())); y < ccyfloor; ++y)
+	// 完全覆盖的像素用fillSpan, 两端的边界像素按到边的距离求覆盖率, 与底下的像素混合
+	// top to bottom, left to right: fully covered pixels go through fillSpan,
+	// the boundary pixels at both ends blend with what is underneath by their
+	// analytic distance coverage
+	TriangleEdge edges[3];
+	edges[0].setup(pa, pb, pc);
+	edges[1].setup(pb, pc, pa);
+	edges[2].setup(pc, pa, pb);
+	
+	const int width = buf->width();
+	for (int y = ybegin; y < yend; ++y)
 	{
-		qreal lx = leftX[y];
-		qreal rx = rightX[y];
+		const qreal yc = y + 0.5;
 		
-		int lxi = (int) floor(lx);
-		int rxi = (int) floor(rx);
-		DoubleColor rc = rightColors[y];
-		DoubleColor lc = leftColors[y];
+		// 像素中心在(outerL, outerR)内的有覆盖, 在[innerL, innerR]内的完全覆盖
+		// pixel centers inside (outerL, outerR) are covered, inside
+		// [innerL, innerR] fully covered
+		qreal outerL = -1e9, outerR = 1e9;
+		qreal innerL = -1e9, innerR = 1e9;
+		// 不抗锯齿: 像素中心在三角形内的完全覆盖, 其余不画
+		// no anti-aliasing: pixels whose center is inside are fully covered,
+		// the rest are left alone
+		const qreal reach = antialias ? 0.5 : 0.0;
+		for (int k = 0; k < 3; ++k)
+		{
+			edges[k].clip(yc, -reach, &outerL, &outerR);
+			edges[k].clip(yc, reach, &innerL, &innerR);
+		}
+		int ol = qMax(0, (int) ceil(qMax(outerL, -1.0) - 0.5));
+		int orr = qMin(width - 1, (int) floor(qMin(outerR, (qreal) width) - 0.5));
+		if (ol > orr)
+			continue;
+		int il = qMax(ol, (int) ceil(qMax(innerL, -1.0) - 0.5));
+		int ir = qMin(orr, (int) floor(qMin(innerR, (qreal) width) - 0.5));
+		if (il > ir)
+		{
+			il = orr + 1;
+			ir = orr;
+		}
 		
-		double xdist = rx - lx;
+		// 最上/最下的部分行用最近一行的颜色
+		// the partial rows above / below use the nearest row's colours
+		int cy = qBound(colorBegin, y, colorEnd - 1);
+		qreal lx = leftX[cy - yTop];
+		DoubleColor lc = leftColors[cy - yTop];
+		DoubleColor rc = rightColors[cy - yTop];
+		qreal xdist = rightX[cy - yTop] - lx;
+		qreal rdelta = 0.0, gdelta = 0.0, bdelta = 0.0;
 		if (!qFuzzyCompare(xdist, 0.0))
 		{
-			qreal r = lc.r;
-			qreal g = lc.g;
-			qreal b = lc.b;
-			qreal rdelta = (rc.r - r) / xdist;
-			qreal gdelta = (rc.g - g) / xdist;
-			qreal bdelta = (rc.b - b) / xdist;
-			
-			QRgb *scanline = reinterpret_cast<QRgb *>(buf->scanLine(y));
-			scanline += lxi;
-			
-			// 从左到右
-			for (int i = lxi; i < rxi; ++i)
+			rdelta = (rc.r - lc.r) / xdist;
+			gdelta = (rc.g - lc.g) / xdist;
+			bdelta = (rc.b - lc.b) / xdist;
+		}
+		// 与原来一样, lc在像素floor(lx)上
+		// as before, lc sits on pixel floor(lx)
+		const qreal x0 = floor(lx);
+		
+		typename Dst::Pixel *scanline = reinterpret_cast<typename Dst::Pixel *>(buf->scanLine(y));
+		
+		// 从左到右
+		const qreal delta[3] = { rdelta, gdelta, bdelta };
+		if (ir >= il)
+		{
+			const qreal start[3] = { lc.r + (il - x0) * rdelta, lc.g + (il - x0) * gdelta,
+									 lc.b + (il - x0) * bdelta };
+			Model::template span<Dst>(scanline + il, ir - il + 1, start, delta, il, y);
+		}
+		
+		for (int x = ol; x <= orr; ++x)
+		{
+			if (x == il)
 			{
-				*scanline++ = qRgb((int) r, (int) g, (int) b);
-				r += rdelta;
-				g += gdelta;
-				b += bdelta;
+				x = ir;
+				continue;
 			}
+			qreal xc = x + 0.5;
+			qreal d = qMin(edges[0].distance(xc, yc),
+						   qMin(edges[1].distance(xc, yc), edges[2].distance(xc, yc)));
+			int a = (int) ((d + 0.5) * 256.0 + 0.5);
+			if (a <= 0)
+				continue;
+			const qreal at[3] = { lc.r + (x - x0) * rdelta, lc.g + (x - x0) * gdelta,
+								  lc.b + (x - x0) * bdelta };
+			scanline[x] = KHsvEdgePixel<Model, Dst>::blend(at, scanline[x], qMin(a, 256), x, y);
 		}
 	}
 }
 
 
+// 灰色没有色相, 保留当前的色相. 程序设置的颜色同时是已提交的颜色,
+// 之后松开鼠标时不会再发出colorCommitted
+// greys have no hue, the current one is kept. A colour set by the program
+// is also the committed one, so a later mouse release emits no colorCommitted
 void KColorCircleHsv::setColor(const QColor &col)
 {
-	if (col.toHsl() == m_CurrentColor.toHsl())
-		return;
-	
-	int oldhue = m_CurrentColor.hslHue();
-	m_CurrentColor = col;
-	
-	if (oldhue != col.hslHue())
-	{
-		int hsvHue = col.hsvHue();
-		int hslHue = col.hslHue();
-		if (hsvHue != -1)
-		{
-			m_nCurrentHue = hsvHue;
-			calRadian(m_nCurrentHue);
-		}
-		else if (hsvHue == -1 && hslHue != -1)
-		{
-			m_nCurrentHue = hslHue;
-			calRadian(m_nCurrentHue);
-		}
-		
-	}
-	m_dSelectorPos = pointFromColor(m_CurrentColor);
-	
-	update();
+	setHsv(modelFromColor(col, m_hsv.h, m_colorModel));
+	m_committedHsv = m_hsv;
 }
 
 void KColorCircleHsv::setColor(qreal h, qreal s, qreal l)
@@ -751,96 +7163,203 @@ void KColorCircleHsv::setColor(qreal h, qreal s, qreal l)
 	setColor(col);
 }
 
+// 可从任意线程调用, 不阻塞. 只保留最新的颜色, GUI线程每帧最多取一次.
+// 调用者保证控件在调用期间存在
+// callable from any thread without blocking. Only the newest colour is kept,
+// and the GUI thread takes it at most once per frame. The caller keeps the
+// widget alive during the call
+void KColorCircleHsv::postColor(const QColor &col)
+{
+	// 灰色: h < 0, 取出时保留当前色相
+	// greys: h < 0, the current hue is kept when taken
+	postHsv(modelFromColor(col, -1.0, m_colorModel));
+}
 
+void KColorCircleHsv::postHsvF(qreal h, qreal s, qreal v)
+{
+	postHsv(KHsvF(KHsvF::wrapHue(h), KHsvF::clamp01(s), KHsvF::clamp01(v)));
+}
 
-QColor KColorCircleHsv::color() const
+void KColorCircleHsv::postHsv(const KHsvF &hsv)
 {
-	return m_CurrentColor;
+	m_mailbox->post(hsv);
+	// 只有第一次写入排队通知, 直到GUI线程取走
+	// only the first post queues a notification until the GUI thread takes it
+	if (m_mailbox->notified.testAndSetOrdered(0, 1))
+		QMetaObject::invokeMethod(this, "drainMailbox", Qt::QueuedConnection);
 }
 
 
-QPointF KColorCircleHsv::pointFromColor(const QColor &col) const
+// 通知到达: 本帧还没取过就立即取, 否则等帧定时器
+// notification arrived: take at once unless this frame already did, in
+// which case the frame timer takes it
+void KColorCircleHsv::drainMailbox()
 {
+	if (m_mailboxTimer.isActive())
+		return;
+	if (takeMailbox())
+		m_mailboxTimer.start(1000 / MailboxRate, this);
+}
+
+
+// 取出最新的颜色并显示, 返回是否有新的或还有没取到的
+// take and show the newest colour, returns whether there was one or one is
+// still waiting
+bool KColorCircleHsv::takeMailbox()
+{
+	m_mailbox->notified.fetchAndStoreOrdered(0);
+	KHsvF hsv;
+	if (!m_mailbox->take(&m_nMailboxTag, &hsv))
+		return m_mailbox->pending(m_nMailboxTag);	// 被覆盖时下一帧再取 overwritten: next frame
+	if (hsv.h < 0.0)
+		hsv.h = m_hsv.h;
+	setHsv(hsv);
+	m_committedHsv = m_hsv;
+	return true;
+}
+
+
+// h为度数[0, 360), s, v在[0, 1], 不经过QColor
+// h in degrees [0, 360), s and v in [0, 1], no QColor involved
+void KColorCircleHsv::setHsvF(qreal h, qreal s, qreal v)
+{
+	setHsv(KHsvF(KHsvF::wrapHue(h), KHsvF::clamp01(s), KHsvF::clamp01(v)));
+	m_committedHsv = m_hsv;
+}
+
+void KColorCircleHsv::setHsv(const KHsvF &hsv)
+{
+	if (hsv == m_hsv)
+		return;
 	
-	if (col == Qt::black)
-		return pb;
-	else if (col == Qt::white)
-		return pc;
-	
-	// 
-	qreal abX = pb.x() - pa.x();
-	qreal abY = pb.y() - pa.y();
-	qreal bcX = pc.x() - pb.x();
-	qreal bcY = pc.y() - pb.y();
-	qreal acX = pc.x() - pa.x();
-	qreal acY = pc.y() - pa.y();
-	
-	int hue, sat, val;
-	//qreal hue,sat,val;
-	col.getHsv(&hue, &sat, &val);
-	//KColorConverter::getHsl(col, &hue, &sat, &val);
-	
-	// 饱和度：a到c（100%-0）渐变的，可以理解为垂直于ac轴
-	// 亮度：a and c的亮度是一样的，所以亮度就是由b到a和c进行渐变的，可以理解于平行于ac
-	// 求出亮度和饱和度相交就是色彩的位置了。
-	
-	// a到b，b到c：亮度渐变
-	// color to black ： color ~ 0
-	// a 到 b渐变过程中
-	qreal abxV = pa.x() + (abX * (qreal) (255 - val)) / 255.0;
-	qreal abyV = pa.y() + (abY * (qreal) (255 - val)) / 255.0;
-	// black to white : 0 ～ color
-	// b to c 渐变
-	qreal bcxV = pb.x() + (bcX * (qreal) val) / 255.0;
-	qreal bcyV = pb.y() + (bcY * (qreal) val) / 255.0;
-	
-	// a到c：饱和度渐变
-	// white to color : s由color to 0
-	// 
-	qreal acxS = pa.x() + (acX * (qreal) (255 - sat)) / 255.0;
-	qreal acyS = pa.y() + (acY * (qreal) (255 - sat)) / 255.0;
-	qreal p4 = pb.x();
-	qreal q4 = pb.y();
-	
-	qreal x = 0;
-	qreal y = 0;
-	if (!qFuzzyCompare(abxV-bcxV, 0.0))
+	m_hsv = hsv;
+	int hue = KHsvF::wholeHue(hsv.h);
+	if (hue != m_nCurrentHue)
 	{
-		qreal a = (bcyV - abyV) / (bcxV - abxV);	// 亮度线的斜率
-		qreal c = (q4 - acyS) / (p4 - acxS);		// 饱和线斜率
-		qreal b = abyV - a * abxV;
-		qreal d = acyS - c * acxS;
-		// 求交点
-		x = (d - b) / (a - c);
-		y = a * x + b;
-	}
-	else {
-		x = abxV;
-		y = acyS + (x - acxS) * (q4 - acyS) / (p4 - acxS);
+		m_nCurrentHue = hue;
+		calRadian(m_nCurrentHue);
 	}
+	m_dSelectorPos = pointFromHsv(m_hsv);
 	
-	return QPointF(x, y);
+	markDirty();
+}
+
+
+
+QColor KColorCircleHsv::color() const
+{
+	return colorFromModel(m_hsv, m_colorModel);
+}
+
+
+QColor KColorCircleHsv::apexColor(int hue, ColorModel model)
+{
+	if (model == ModelOklch)
+		return QColor(KHsvModelOklch::ringHues()[KHsvOklchTables::index(hue)]);
+	QColor color;
+	color.setHsv(hue, 255, 255);
+	return color;
+}
+
+QColor KColorCircleHsv::colorFromModel(const KHsvF &hsv, ColorModel model)
+{
+	if (model == ModelOklch)
+		return KHsvModelOklch::color(hsv.h, hsv.s, hsv.v);
+	return hsv.toColor();
+}
+
+// 无色相的颜色(灰色)保留fallbackHue
+// achromatic colours (greys) keep fallbackHue
+KHsvF KColorCircleHsv::modelFromColor(const QColor &color, qreal fallbackHue, ColorModel model)
+{
+	if (model != ModelOklch)
+		return KHsvF::fromColor(color, fallbackHue);
+	KHsvF hsv;
+	KHsvModelOklch::coords(color, &hsv.h, &hsv.s, &hsv.v);
+	if (hsv.h < 0.0)
+	{
+		// 灰色在任何色相的三角形上位置都一样
+		// a grey sits at the same place on every hue's triangle
+		hsv.h = fallbackHue;
+	}
+	return hsv;
+}
+
+void KColorCircleHsv::getHsvF(qreal *h, qreal *s, qreal *v) const
+{
+	*h = m_hsv.h;
+	*s = m_hsv.s;
+	*v = m_hsv.v;
+}
+
+
+QPointF KColorCircleHsv::pointFromHsv(const KHsvF &hsv) const
+{
+	QPointF point;
+	m_svTransform.toPoints(&hsv.s, &hsv.v, &point, 1);
+	return point;
+}
+
+// 当前色相
+// with the current hue
+KHsvF KColorCircleHsv::hsvFromPoint(const QPointF &p) const
+{
+	KHsvF hsv(m_hsv.h, 0.0, 0.0);
+	m_svTransform.toSv(&p, &hsv.s, &hsv.v, 1);
+	return hsv;
 }
 
 
-// 
+QPointF KColorCircleHsv::pointFromColor(const QColor &col) const
+{
+	QPointF point;
+	pointsFromColors(&col, &point, 1);
+	return point;
+}
+
 QColor KColorCircleHsv::colorFromPoint(const QPointF &p)  const
 {
-	// valuef(亮度比)
-	qreal a2b = p2pdist(pa, pb);
-	qreal b2ac = a2b * sin(60.0 * HSVPI / 180.0);
-	
-	// p to ac
-	qreal p2ac = p2ldist(p, QLineF(pa, pc));
-	qreal valuef = (b2ac - p2ac) / b2ac;
-	
-	qreal a2c = p2pdist(pa, pc);
-	qreal p2c = p2pdist(p, pc);
-	qreal m2c = pythagorean(p2c, p2ac, true);
-	qreal satf = m2c / a2c; 
-	
-	valuef = qBound(0.0, valuef, 1.0);
-	satf = qBound(0.0, satf, 1.0);
-	QColor c = QColor::fromHsvF(m_nCurrentHue / 360.0, satf, valuef);
-	return c;
+	QColor color;
+	colorsFromPoints(&p, &color, 1);
+	return color;
+}
+
+
+// 饱和度：a到c（100%-0）渐变的，可以理解为垂直于ac轴
+// 亮度：a and c的亮度是一样的，所以亮度就是由b到a和c进行渐变的，可以理解于平行于ac
+// 亮度线与b到饱和度点的连线相交就是色彩的位置, 即 P = B + v(C - B) + v*s(A - C)
+// saturation runs from a to c, value from b towards the ac edge; the colour
+// sits where the value line meets the line from b to the saturation point,
+// i.e. P = B + v(C - B) + v*s(A - C)
+
+// 分块处理, 块内先算好s,v再转换
+// processed in chunks, s and v are gathered per chunk before converting
+enum { SvChunk = 256 };
+
+void KColorCircleHsv::colorsFromPoints(const QPointF *points, QColor *colors, int count) const
+{
+	qreal s[SvChunk], v[SvChunk];
+	for (int base = 0; base < count; base += SvChunk)
+	{
+		int n = qMin(int(SvChunk), count - base);
+		m_svContents.toSv(points + base, s, v, n);
+		if (m_colorModel == ModelOklch)
+			modelColors<KHsvModelOklch>(m_hsv.h, s, v, colors + base, n);
+		else
+			modelColors<KHsvModelHsv>(m_hsv.h, s, v, colors + base, n);
+	}
+}
+
+void KColorCircleHsv::pointsFromColors(const QColor *colors, QPointF *points, int count) const
+{
+	qreal s[SvChunk], v[SvChunk];
+	for (int base = 0; base < count; base += SvChunk)
+	{
+		int n = qMin(int(SvChunk), count - base);
+		if (m_colorModel == ModelOklch)
+			modelCoords<KHsvModelOklch>(colors + base, m_hsv.h, s, v, n);
+		else
+			modelCoords<KHsvModelHsv>(colors + base, m_hsv.h, s, v, n);
+		m_svContents.toPoints(s, v, points + base, n);
+	}
 }
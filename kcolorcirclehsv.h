@@ -7,10 +7,90 @@
 ****************************************************************************/
 #ifndef __KCOLORCIRCLEHSV_H__
 #define __KCOLORCIRCLEHSV_H__
+#include <QtCore/QtGlobal>
+#include <QtGui/QColor>
 #include <QtGui/QImage>
+#if QT_VERSION >= 0x050000
+#include <QtWidgets/QWidget>
+#else
 #include <QtGui/QWidget>
+#endif
+#include <QtCore/QBasicTimer>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QList>
+#include <QtCore/QSharedPointer>
+#include <QtCore/QVector>
+#include <cmath>
 
 
+// 浮点HSV颜色: h为度数[0, 360), s, v在[0, 1]. 控件内部状态, 只在公开接口处转换为QColor
+// floating-point HSV: h in degrees [0, 360), s and v in [0, 1]. The widget's
+// internal state, converted to QColor only at the public API
+struct KHsvF
+{
+	qreal h, s, v;
+	
+	Q_DECL_CONSTEXPR KHsvF() : h(0.0), s(0.0), v(0.0) {}
+	Q_DECL_CONSTEXPR KHsvF(qreal hue, qreal sat, qreal val) : h(hue), s(sat), v(val) {}
+	
+	Q_DECL_CONSTEXPR bool operator==(const KHsvF &other) const
+	{
+		return h == other.h && s == other.s && v == other.v;
+	}
+	Q_DECL_CONSTEXPR bool operator!=(const KHsvF &other) const
+	{
+		return !(*this == other);
+	}
+	
+	// 把任意色相折回[0, 360). 极小的负数加上360后会舍入成360, 归为0
+	// wrap any hue into [0, 360). A tiny negative hue rounds to 360 once 360
+	// is added, so that becomes 0
+	static inline qreal wrapHue(qreal hue)
+	{
+		hue = std::fmod(hue, 360.0);
+		if (hue < 0.0)
+			hue += 360.0;
+		return hue < 360.0 ? hue : 0.0;
+	}
+	
+	// 最近的整数色相 (三角形和缓存用)
+	// nearest whole hue (for the triangle and its cache)
+	static Q_DECL_CONSTEXPR int wholeHue(qreal hue)
+	{
+		return int(hue + 0.5) % 360;
+	}
+	
+	static Q_DECL_CONSTEXPR qreal clamp01(qreal x)
+	{
+		return x < 0.0 ? 0.0 : (x > 1.0 ? 1.0 : x);
+	}
+	
+	// 无色相的颜色(灰色)保留fallbackHue
+	// achromatic colours (greys) keep fallbackHue
+	static inline KHsvF fromColor(const QColor &color, qreal fallbackHue)
+	{
+		// Qt 6的getHsvF是float, 逐个取
+		// Qt 6's getHsvF takes floats, so read them one by one
+		const qreal hue = color.hsvHueF();
+		return KHsvF(hue < 0.0 ? fallbackHue : wrapHue(hue * 360.0), color.hsvSaturationF(), color.valueF());
+	}
+	
+	inline QColor toColor() const
+	{
+		return QColor::fromHsvF(h / 360.0, s, v);
+	}
+};
+
+
+class QPainter;
+class KHsvTriangleCache;
+class KHsvRenderJob;
+class KHsvDistribution;
+class KHsvMailbox;
+class KHsvFrameStats;
+class KHsvCompactRing;
+class KHsvDisplayLut;
+struct KHsvRingKey;
 
 
 class  KColorCircleHsv : public QWidget
@@ -18,16 +98,158 @@ class  KColorCircleHsv : public QWidget
 	Q_OBJECT
 
 public:
+	// colorChanged的发出方式
+	// how colorChanged is delivered
+	enum ColorDelivery
+	{
+		DeliverImmediate,	// 每个事件 every event
+		DeliverCoalesced	// 每帧最多一次 at most once per frame
+	};
+	
+	// 计时的绘制阶段
+	// timed painting stages
+	enum FrameStage
+	{
+		StageBackground,	// 圆环 ring (createBackground, 后台帧 background frames)
+		StageTriangle,		// 三角形 triangle (drawTriangle, 缓存贴图 cached blits)
+		StageOverlays,		// paintImage中的脏区域合成 dirty-rect compositing in paintImage
+		StageBlit,			// paintEvent中的drawImage drawImage in paintEvent
+		StageCount
+	};
+	
+	// 拖动时的画质, 按降低的顺序
+	// quality while dragging, in degrading order
+	enum RenderQuality
+	{
+		QualityFull,
+		QualityNoAntialias,		// 不抗锯齿 no anti-aliasing
+		QualityHalfResolution,	// 三角形半分辨率 half-resolution triangle
+		QualitySkipFrames		// 跳过中间帧 skip intermediate frames
+	};
+	
+	// 圆环和三角形的颜色模型; h, s, v (setHsvF等)是模型的坐标:
+	// ModelOklch中h为OKLCH色相, s, v为三角形上的位置
+	// colour model of the ring and the triangle; h, s, v (setHsvF and the
+	// like) are the model's coordinates: in ModelOklch h is the OKLCH hue and
+	// s, v are the position on the triangle
+	enum ColorModel
+	{
+		ModelHsv,
+		ModelOklch		// 感知均匀 perceptually uniform
+	};
+	
+	// 一个阶段的统计; p50, p99为最近256次的纳秒数
+	// statistics of one stage; p50 and p99 are nanoseconds over the last 256 runs
+	struct StageStats
+	{
+		int count;
+		qint64 pixels;
+		qint64 p50, p99;
+		
+		StageStats() : count(0), pixels(0), p50(0), p99(0) {}
+	};
+	
 	KColorCircleHsv(QWidget *parent = 0);
 	~KColorCircleHsv();
 	QColor color() const;
+	void getHsvF(qreal *h, qreal *s, qreal *v) const;
+	
+	void setTriangleCacheSize(int bytes);
+	
+	// 圆环的磁盘缓存, 进程内所有控件共用(默认关闭): 启动时映射文件, 圆环直接使用映射的像素.
+	// fileName为空时关闭; 不能打开或创建文件时返回false
+	// on-disk ring cache shared by every widget in the process (off by default):
+	// the file is mapped and rings use the mapped pixels directly. An empty
+	// fileName turns it off; returns false when the file cannot be opened or created
+	static bool setRingCacheFile(const QString &fileName);
+	void setThreadedRendering(bool on);
+	bool threadedRendering() const;
+	
+	int paintAllocations() const;
+	static void setAllocationCounter(int (*counter)());
+	
+	// 分阶段计时(默认关闭, 或设置环境变量KCOLORCIRCLEHSV_PROFILE);
+	// writeTrace输出Chrome trace-event JSON
+	// per-stage timing (off by default, or set KCOLORCIRCLEHSV_PROFILE);
+	// writeTrace dumps Chrome trace-event JSON
+	void setProfilingEnabled(bool on);
+	bool isProfilingEnabled() const;
+	StageStats stageStats(FrameStage stage) const;
+	int droppedFrames() const;
+	void resetProfiling();
+	bool writeTrace(const QString &fileName) const;
+	
+	// 低内存模式: 不保留整幅的RGB32图像, 按带直接画到窗口上(默认关闭)
+	// low-memory mode: keeps no full-size RGB32 images and paints straight to
+	// the window band by band (off by default)
+	void setLowMemoryMode(bool on);
+	bool lowMemoryMode() const;
+	
+	// 自适应画质: 拖动时帧耗时超过ms毫秒就逐级降低画质, 松开鼠标或空闲时恢复.
+	// 0 : 关闭(默认)
+	// adaptive quality: while dragging, quality steps down as long as frames
+	// cost more than ms milliseconds and is restored on release or when idle.
+	// 0 : off (default)
+	void setFrameBudget(int ms);
+	int frameBudget() const;
+	RenderQuality renderQuality() const;
+	
+	// 颜色模型(默认ModelHsv), 切换时保持当前颜色
+	// colour model (ModelHsv by default), the current colour is kept on a switch
+	void setColorModel(ColorModel model);
+	ColorModel colorModel() const;
+	
+	// 输出像素格式(默认RGB32), 圆环和三角形直接画成该格式:
+	// Format_RGB16 (抖动), Format_RGBX64 (Qt >= 5.12), Format_RGBX32FPx4 (Qt >= 6.2);
+	// 不支持的格式按RGB32处理, 低内存模式总是RGB32
+	// output pixel format (RGB32 by default), the ring and triangle are drawn straight into it:
+	// Format_RGB16 (dithered), Format_RGBX64 (Qt >= 5.12), Format_RGBX32FPx4 (Qt >= 6.2);
+	// other formats fall back to RGB32, and low-memory mode always uses RGB32
+	void setOutputFormat(QImage::Format format);
+	QImage::Format outputFormat() const;
+	
+	// 显示器色彩管理: 画面经过3D LUT再显示. setDisplayLut读取.cube文件,
+	// setDisplayProfile读取ICC配置(Qt >= 5.14); 空参数关闭, 失败时返回false并保持原来的设置.
+	// 只对RGB32输出格式生效
+	// display colour management: the picture goes through a 3D LUT before it is
+	// shown. setDisplayLut reads a .cube file, setDisplayProfile an ICC profile
+	// (Qt >= 5.14); an empty argument turns it off, on failure false is returned
+	// and the previous setting kept. Applies to the RGB32 output format only
+	bool setDisplayLut(const QString &fileName);
+	bool setDisplayProfile(const QByteArray &iccProfile);
+	bool isColorManaged() const;
+	
+	// 批量转换, 结果与单个点的转换一致; 点在控件的内容坐标(逻辑像素)中, 颜色取当前色相
+	// batch conversions matching the single-point ones; points are in contents
+	// coordinates (logical pixels), colours take the current hue
+	void colorsFromPoints(const QPointF *points, QColor *colors, int count) const;
+	void pointsFromColors(const QColor *colors, QPointF *points, int count) const;
+	
+	// 参考图像的颜色分布热度图
+	// colour distribution heat map of a reference image
+	void setDistributionImage(const QImage &image);
+	void updateDistributionImage(const QImage &image, const QRect &changed);
+	
+	void setColorDelivery(ColorDelivery mode);
+	ColorDelivery colorDelivery() const;
+	void setColorDeliveryRate(int hz);
+	int colorDeliveryRate() const;
 
 signals:
 	void colorChanged(const QColor &col);
+	// 松开鼠标或按键时的最终颜色
+	// final colour on mouse or key release
+	void colorCommitted(const QColor &col);
 
 public slots:
 	void setColor(qreal h, qreal s, qreal l);
 	void setColor(const QColor &col);
+	void setHsvF(qreal h, qreal s, qreal v);
+	
+	// 线程安全, 只显示最新的值
+	// thread-safe, only the newest value is shown
+	void postColor(const QColor &col);
+	void postHsvF(qreal h, qreal s, qreal v);
 	
 protected:
 	void paintEvent(QPaintEvent *);
@@ -35,9 +257,27 @@ protected:
 	void mousePressEvent(QMouseEvent *);
 	void mouseReleaseEvent(QMouseEvent *);
 	void keyPressEvent(QKeyEvent *e);
+	void keyReleaseEvent(QKeyEvent *e);
 	void resizeEvent(QResizeEvent *);
+	void changeEvent(QEvent *e);
+	bool event(QEvent *e);
+	void timerEvent(QTimerEvent *e);
+	
+private slots:
+	void renderFinished();
+	void drainMailbox();
+	void updatePixelRatio();
 	
 private:
+	friend class KHsvTriangleCache;
+	friend class KHsvTriangleWarmup;
+	friend class KHsvRenderJob;
+	friend class KHsvRenderBand;
+	friend class KColorCircleHsvBench;
+	friend class KColorCircleHsvTest;
+	friend class KColorCircleHsvItem;
+	friend class KHsvRenderScheduler;
+	
 	// double型color
 	// 三角形渐变中：SV的差度/y差度=SV增量比, 所以用SV的渐变需要用qreal,避免累计中精度丢失
 	struct DoubleColor
@@ -62,26 +302,302 @@ private:
 		}
 	};
 	
+	// 三角形几何: 圆心, 内半径, 颜色模型, 图块格式
+	// triangle geometry: center, inner radius, colour model and tile format
+	struct TriangleGeometry
+	{
+		QPointF center;
+		int innerRadius;
+		ColorModel model;
+		QImage::Format format;
+		
+		TriangleGeometry() : innerRadius(0), model(ModelHsv), format(QImage::Format_ARGB32_Premultiplied) {}
+		TriangleGeometry(const QPointF &c, int r, ColorModel m = ModelHsv,
+						 QImage::Format f = QImage::Format_ARGB32_Premultiplied)
+			: center(c), innerRadius(r), model(m), format(f) {}
+		bool operator==(const TriangleGeometry &other) const
+		{
+			return center == other.center && innerRadius == other.innerRadius
+					&& model == other.model && format == other.format;
+		}
+	};
+	
+	// drawTriangle的每行边界, 按三角形的行数分配, 可重复使用
+	// per-row edges of drawTriangle, sized by the triangle's rows and reusable
+	struct TriangleScratch
+	{
+		QVector<DoubleColor> leftColors;
+		QVector<DoubleColor> rightColors;
+		QVector<qreal> leftX;
+		QVector<qreal> rightX;
+		
+		void reserve(int rows);
+	};
+	
+	// 不相交的脏矩形, 个数固定, 不分配内存
+	// disjoint dirty rectangles, fixed capacity, never allocates
+	struct DirtyRects
+	{
+		enum { MaxRects = 8 };
+		QRect rects[MaxRects];
+		int count;
+		
+		DirtyRects() : count(0) {}
+		bool isEmpty() const { return count == 0; }
+		void clear() { count = 0; }
+		void add(const QRect &rect);
+	};
+	
+	// 三角形上(s,v)与像素的仿射变换: P = B + v(C - B) + v*s(A - C)
+	// the affine (s,v) <-> pixel transform of the triangle:
+	// P = B + v(C - B) + v*s(A - C)
+	struct SvTransform
+	{
+		qreal ox, oy;		// B
+		qreal e1x, e1y;		// C - B
+		qreal e2x, e2y;		// A - C
+		qreal i11, i12, i21, i22;	// [e1 e2]的逆 inverse of [e1 e2]
+		
+		SvTransform();
+		void setup(const QPointF &a, const QPointF &b, const QPointF &c);
+		void toSv(const QPointF *points, qreal *s, qreal *v, int count) const;
+		void toPoints(const qreal *s, const qreal *v, QPointF *points, int count) const;
+	};
+	
+	// 缩放预览用的一级圆环 + 三角形, 正方形, 边长为PyramidBase << level
+	// one level of ring + triangle for the resize preview, square with a side
+	// of PyramidBase << level
+	struct PyramidLevel
+	{
+		QImage image;
+		int hue;
+		QRgb background;
+		
+		PyramidLevel() : hue(-1), background(0) {}
+	};
+	
+	// 缓存的三角形, offset为左上角在背景图中的位置
+	// a cached triangle, offset is its top-left corner in the background image
+	struct TriangleTile
+	{
+		QImage image;
+		QPoint offset;
+	};
+	
 	void calVertexPoint();
 	void calRadian(int hue);
 	bool pointChanged(QPointF point);
+	void notifyColorChanged();
+	void commitColor();
 	
+	void setHsv(const KHsvF &hsv);
+	void postHsv(const KHsvF &hsv);
+	bool takeMailbox();
+	QPointF pointFromHsv(const KHsvF &hsv) const;
+	KHsvF hsvFromPoint(const QPointF &p) const;
 	QPointF pointFromColor(const QColor &col) const;
 	QColor colorFromPoint(const QPointF &p) const;
 	
+	// 图像坐标: 内容区域的设备像素, 所有几何和图像都在其中
+	// image coordinates: the contents in device pixels, where all geometry
+	// and images live
+	qreal pixelRatio() const;
+	QSize imageSize() const;
+	QRect imageRect() const;
+	QPointF mapToImage(const QPointF &pos) const;
+	QRect mapToImage(const QRect &rect) const;
+	QRect mapFromImage(const QRect &rect) const;
+	void blit(QPainter *p, const QRect &rect, const QImage &image, const QPoint &from);
+	void relayout();
+	void updatePyramid();
+	void renderPreview();
+	void updatePreview(const QRect *rects, int count);
+	
+	QRect selectorRect() const;
+	QRect hueLineRect() const;
+	QRect triangleRect() const;
+	void markDirty();
+	
 	void createBackground();
+	static QImage renderRing(const QSize &size, int outerRadius, qreal innerRadius, QRgb background,
+							 ColorModel model = ModelHsv, QImage::Format format = QImage::Format_RGB32);
+	KHsvRingKey ringKey() const;
+	static void drawRing(QImage *buf, const QPoint &center, qreal outerRadius,
+						 qreal innerRadius, QRgb background, int yBegin = 0, int yEnd = -1,
+						 ColorModel model = ModelHsv);
 	void paintImage();
-	void drawTriangle(QImage *p, const QPointF &a, const QPointF &b,
-					const QPointF &c, const QColor &color);
+	void setDisplayTransform(const QSharedPointer<KHsvDisplayLut> &lut);
+	bool displayManaged() const;
+	void updateDisplayImage();
+	void updateTriangleLayer();
+	QRect setTriangleLayer(int hue, const TriangleTile &tile);
+	// origin: buf的(0, 0)在控件内容中的位置
+	// origin: where pixel (0, 0) of buf sits in the contents
+	void paintDistribution(QImage *buf, const QRect &clip, const QPoint &origin = QPoint());
+	template <class Dst>
+	void paintDistributionFormat(QImage *buf, const QRect &clip, const QPoint &origin);
+	void paintOverlays(QImage *buf, const QRect &clip, const QPoint &origin = QPoint());
+	void paintCompact(QPainter *p, const QRegion &region);
+	static void drawTriangle(QImage *p, const QPointF &a, const QPointF &b,
+					const QPointF &c, const QColor &color, int yBegin = 0, int yEnd = -1,
+					TriangleScratch *scratch = 0, bool antialias = true,
+					ColorModel model = ModelHsv);
+	template <class Dst>
+	static void drawTriangleFormat(QImage *p, const QPointF &a, const QPointF &b,
+					const QPointF &c, const QColor &color, int yBegin, int yEnd,
+					TriangleScratch *scratch, bool antialias, ColorModel model);
+	template <class Model, class Dst>
+	static void drawTriangleModel(QImage *p, const QPointF &a, const QPointF &b,
+					const QPointF &c, const QColor &color, int yBegin, int yEnd,
+					TriangleScratch *scratch, bool antialias);
+	
+	// 色相hue的纯色顶点(也是圆环上的颜色); 模型坐标与QColor的转换
+	// the pure colour vertex of hue (also the ring colour); model coordinates
+	// to and from QColor
+	static QColor apexColor(int hue, ColorModel model);
+	static QColor colorFromModel(const KHsvF &hsv, ColorModel model);
+	static KHsvF modelFromColor(const QColor &color, qreal fallbackHue, ColorModel model);
+	
+	TriangleGeometry triangleGeometry() const;
+	
+	// 与KColorCircleHsvItem共用的几何和光栅化, 都在图像坐标中
+	// geometry and rasterisers shared with KColorCircleHsvItem, all in image
+	// coordinates
+	static void triangleVertices(int hue, const TriangleGeometry &geometry, QPointF *vertices);
+	static qreal hueAt(const QPointF &pos, const QRect &rect);
+	static QPointF clampToTriangle(const QPointF &p, const QPointF &a, const QPointF &b, const QPointF &c);
+	static bool triangleContains(const QPointF &p, const QPointF &a, const QPointF &b, const QPointF &c);
+	static void markerColors(QRgb hueColor, QRgb *lineColor, QRgb *selectorColor);
+	static QImage sharedRing(const QSize &size, qreal pixelRatio, int outerRadius,
+							 qreal ringWidth, QRgb background, ColorModel model = ModelHsv,
+							 QImage::Format format = QImage::Format_RGB32);
+	static void releaseSharedRing(QImage *ring);
+	static QImage renderLineMarker(qreal length, int penWidth, QRgb color, QPointF *anchor);
+	static QImage renderCircleMarker(qreal radius, int penWidth, QRgb color, QPointF *anchor);
+	static TriangleTile allocTriangleTile(int hue, const TriangleGeometry &geometry, QPointF *vertices);
+	static TriangleTile renderTriangleTile(int hue, const TriangleGeometry &geometry,
+										   TriangleScratch *scratch = 0);
+	TriangleTile renderDraftTile(int hue, const TriangleGeometry &geometry);
+	void warmTriangleCache();
+	
+	// 交给全局调度器的渲染请求(可合并的位)
+	// render requests handed to the shared scheduler (bits that merge)
+	enum RenderRequest
+	{
+		RenderFrame = 1,	// paintImage
+		RenderWarm = 2		// 再预热三角形缓存 plus the triangle cache warm-up
+	};
+	void scheduleRender(int request = RenderFrame);
+	void runScheduledRender(bool exposed = false);
+	
+	void dragTo(const QPointF &pos);
+	void governFrame(qreal ms);
+	void restoreQuality();
+	
+	static void renderBand(KHsvRenderJob *job, int y0, int y1);
+	void startRenderJob(const QSharedPointer<KHsvRenderJob> &job, int height);
+	void startFrameRender();
+	void startTileRender();
 	
-	QImage m_imgBG;
-	QImage m_buf;
+	QImage m_imgBG;		// 圆环, 进程内共享 ring layer, shared process-wide
+	QImage m_imgBase;	// 圆环 + 三角形 ring + triangle layer
+	QImage m_buf;		// 底图 + 叠加 base + overlays
 	
+	// 底图中三角形的色相和位置
+	// hue and area of the triangle in the base layer
+	int m_nTriangleHue;
+	QRect m_rcTriangleLayer;
+	
+	// 脏区域和上次画在m_buf中的定位圈/定位线的位置
+	// dirty region, and where the selector / marker were last painted in m_buf
+	DirtyRects m_dirty;
+	QRect m_rcPaintedSelector;
+	QRect m_rcPaintedHueLine;
+	
+	// GUI线程上drawTriangle的行缓冲; 上次paintImage的内存分配次数
+	// drawTriangle row scratch for the GUI thread; allocations in the last paintImage
+	TriangleScratch m_triangleScratch;
+	int m_nPaintAllocations;
+	
+	QSharedPointer<KHsvTriangleCache> m_triangleCache;
+	QSharedPointer<KHsvDistribution> m_distribution;
+	QSharedPointer<KHsvFrameStats> m_frameStats;	// 关闭时为空 null when off
+	
+	// 低内存模式: 索引圆环和一个带的RGB32缓冲
+	// low-memory mode: the indexed ring and one band of RGB32
+	enum { CompactBandRows = 32 };
+	bool m_bLowMemory;
+	QSharedPointer<KHsvCompactRing> m_compactRing;
+	QImage m_compactBand;
+	
+	// 进行中的后台渲染
+	// background renders in progress
+	bool m_bThreadedRendering;
+	QSharedPointer<KHsvRenderJob> m_frameJob;
+	QSharedPointer<KHsvRenderJob> m_tileJob;
+	QList<QSharedPointer<KHsvRenderJob> > m_liveJobs;	// 还可能有带在运行的 bands may still be running
+	int m_nScheduledRender;		// 等待调度的RenderRequest, 0为没有 pending RenderRequest bits, 0 for none
+	
+	// 尺寸稳定后才按精确的分辨率渲染, 之前用金字塔中最近的一级缩放预览
+	// the exact resolution is rendered once the size settles, until then the
+	// nearest pyramid level is scaled into a preview
+	enum { SettleDelay = 150, PyramidLevels = 7, PyramidBase = 64 };
+	QBasicTimer m_settleTimer;
+	PyramidLevel m_pyramid[PyramidLevels];
+	bool m_bPyramidCurrent;		// 金字塔由当前的m_imgBase生成 built from the current m_imgBase
+	QImage m_imgPreview;
+	QImage m_imgPreviewBase;	// 缩放的一级, 只在尺寸改变时重建 scaled level, rebuilt only on resize
+	int m_nPreviewBaseHue;		// 预览底图中三角形的色相 hue of the triangle in the preview base
+	int m_nPreviewHue;			// 预览中三角形的色相 hue of the triangle in the preview
+	QRect m_rcPreviewTriangle;
+	
+	// 显示色彩管理: 变换过的圆环(m_imgBG的cacheKey改变时重算)和m_buf
+	// display colour management: the transformed ring (redone when the
+	// cacheKey of m_imgBG changes) and m_buf
+	QSharedPointer<KHsvDisplayLut> m_displayLut;
+	QImage m_imgBGDisplay;
+	qint64 m_nDisplayRingKey;
+	QImage m_bufDisplay;
+	
+	// 自适应画质: 最近的帧耗时(毫秒, 指数平均); 三角形是否是降低画质画的;
+	// 跳过帧时暂存的最新拖动位置
+	// adaptive quality: recent frame cost (ms, exponential average); whether
+	// the triangle was drawn at reduced quality; the latest drag position held
+	// back while skipping frames
+	enum { IdleDelay = 250 };
+	int m_nFrameBudget;
+	RenderQuality m_quality;
+	qreal m_dFrameCost;
+	bool m_bDraftTriangle;
+	QBasicTimer m_idleTimer;
+	QBasicTimer m_dragTimer;
+	QElapsedTimer m_dragClock;
+	QPointF m_pendingDragPos;
+	bool m_bDragPending;
+	
+	ColorModel m_colorModel;
+	QImage::Format m_outputFormat;
+	qreal m_dPixelRatio;
 	double m_radA, m_radB, m_radC;
 	QPointF pa, pb, pc, pd;
-	QColor m_OldColor;
-	QColor m_CurrentColor;
-	int m_nCurrentHue;
+	SvTransform m_svTransform;
+	SvTransform m_svContents;	// 内容坐标(逻辑像素)中的 in contents coordinates (logical pixels)
+	KHsvF m_hsv;			// 当前颜色 current colour
+	KHsvF m_committedHsv;
+	
+	ColorDelivery m_colorDelivery;
+	int m_nColorDeliveryRate;
+	bool m_bColorPending;
+	QBasicTimer m_colorTimer;
+	
+	// 其它线程写入的颜色, 每帧最多取一次
+	// colours posted from other threads, taken at most once per frame
+	enum { MailboxRate = 60 };
+	QSharedPointer<KHsvMailbox> m_mailbox;
+	int m_nMailboxTag;		// 上次取走的标记 tag last taken
+	QBasicTimer m_mailboxTimer;
+	
+	int m_nCurrentHue;		// 三角形的整数色相 whole hue of the triangle
 	
 	bool m_bNeedUpdateBackground;
 	int m_nPenWidth;
@@ -0,0 +1,381 @@
+﻿
+
+#include "kcolorcirclehsvitem.h"
+
+#if QT_VERSION >= 0x050800
+#include <math.h>
+#include <QtGui/QMatrix4x4>
+#include <QtQuick/QQuickWindow>
+#include <QtQuick/QSGImageNode>
+#include <QtQuick/QSGTransformNode>
+
+#define HSVITEM_PI 3.1415926535897932
+
+
+// 节点树: 圆环, 三角形, 定位线和定位圈的变换各带一个图块
+// the node tree: ring, triangle, and a sprite under each of the line and
+// selector transforms
+struct KHsvItemNode : public QSGNode
+{
+	QSGImageNode *ring;
+	QSGImageNode *triangle;
+	QSGTransformNode *lineTransform;
+	QSGImageNode *line;
+	QSGTransformNode *selectorTransform;
+	QSGImageNode *selector;
+};
+
+
+// 用image替换节点的纹理, rect为逻辑坐标
+// replace the node's texture with image, rect in logical coordinates
+static void setNodeImage(QQuickWindow *window, QSGImageNode *node, const QImage &image,
+						 const QRectF &rect)
+{
+	node->setTexture(window->createTextureFromImage(image));
+	node->setOwnsTexture(true);
+	node->setSourceRect(QRectF(QPointF(0, 0), image.size()));
+	node->setRect(rect);
+	node->setFiltering(QSGTexture::Linear);
+}
+
+
+// 事件的逻辑坐标, Qt6把localPos换成了position
+// the event's logical position, Qt 6 renamed localPos to position
+static QPointF eventPos(const QMouseEvent *e)
+{
+#if QT_VERSION >= 0x060000
+	return e->position();
+#else
+	return e->localPos();
+#endif
+}
+
+
+KColorCircleHsvItem::KColorCircleHsvItem(QQuickItem *parent)
+	: QQuickItem(parent)
+	, m_nCurrentHue(0)
+	, m_background(Qt::white)
+	, m_dPixelRatio(1.0)
+	, m_nOuterRadius(0)
+	, m_dRingWidth(0.0)
+	, m_nPenWidth(0)
+	, m_nSVEllipseSize(0)
+	, m_selMode(KColorCircleHsv::None)
+	, m_nRasterDirty(0)
+	, m_nNodeDirty(0)
+	, m_nTriangleHue(-1)
+	, m_lineColor(0)
+	, m_nSelectorHue(-1)
+{
+	setFlag(ItemHasContents, true);
+	setAcceptedMouseButtons(Qt::LeftButton);
+}
+
+KColorCircleHsvItem::~KColorCircleHsvItem()
+{
+	KColorCircleHsv::releaseSharedRing(&m_imgRing);
+}
+
+
+QColor KColorCircleHsvItem::color() const
+{
+	return m_hsv.toColor();
+}
+
+void KColorCircleHsvItem::setColor(const QColor &color)
+{
+	KHsvF hsv = KHsvF::fromColor(color, m_hsv.h);
+	setHsvF(hsv.h, hsv.s, hsv.v);
+}
+
+void KColorCircleHsvItem::setHsvF(qreal h, qreal s, qreal v)
+{
+	KHsvF hsv(KHsvF::wrapHue(h), KHsvF::clamp01(s), KHsvF::clamp01(v));
+	if (hsv == m_hsv)
+		return;
+	m_hsv = hsv;
+	setHue(KHsvF::wholeHue(hsv.h));
+	m_svTransform.toPoints(&m_hsv.s, &m_hsv.v, &m_selectorPos, 1);
+	markDirty(DirtyTransforms);
+	emit colorChanged(color());
+}
+
+QColor KColorCircleHsvItem::backgroundColor() const
+{
+	return m_background;
+}
+
+void KColorCircleHsvItem::setBackgroundColor(const QColor &color)
+{
+	if (color == m_background)
+		return;
+	m_background = color;
+	markDirty(DirtyRing);
+	emit backgroundColorChanged(color);
+}
+
+
+// ***************** 几何 geometry
+
+void KColorCircleHsvItem::relayout()
+{
+	m_dPixelRatio = window() ? window()->devicePixelRatio() : 1.0;
+	m_imageSize = QSize(qRound(width() * m_dPixelRatio), qRound(height() * m_dPixelRatio));
+	m_nOuterRadius = qMax(0, qMin(m_imageSize.width() - 1, m_imageSize.height() - 1) / 2);
+	m_nPenWidth = (int) floor(m_nOuterRadius / 50.0);
+	m_nSVEllipseSize = (int) floor(m_nOuterRadius / 12.5);
+	m_dRingWidth = m_nOuterRadius / 5.0;
+
+	m_nTriangleHue = -1;
+	m_nSelectorHue = -1;
+	m_imgLine = QImage();
+	setHue(m_nCurrentHue);
+	m_svTransform.toPoints(&m_hsv.s, &m_hsv.v, &m_selectorPos, 1);
+	markDirty(DirtyRing | DirtyTriangle | DirtyLine | DirtySelector | DirtyTransforms);
+}
+
+// 三角形与控件一样对齐到整数色相
+// the triangle snaps to whole hues like the widget's
+void KColorCircleHsvItem::setHue(int hue)
+{
+	m_nCurrentHue = hue;
+	KColorCircleHsv::TriangleGeometry geometry(QRect(QPoint(0, 0), m_imageSize).center(),
+											   m_nOuterRadius - m_dRingWidth);
+	KColorCircleHsv::triangleVertices(hue, geometry, m_vertices);
+	m_svTransform.setup(m_vertices[0], m_vertices[1], m_vertices[2]);
+	if (hue != m_nTriangleHue)
+		markDirty(DirtyTriangle);
+	if (hue != m_nSelectorHue)
+		markDirty(DirtySelector);
+	markDirty(DirtyLine | DirtyTransforms);
+}
+
+QPointF KColorCircleHsvItem::mapToImage(const QPointF &pos) const
+{
+	return pos * m_dPixelRatio;
+}
+
+void KColorCircleHsvItem::markDirty(int flags)
+{
+	m_nRasterDirty |= flags;
+	polish();
+	update();
+}
+
+#if QT_VERSION >= 0x060000
+void KColorCircleHsvItem::geometryChange(const QRectF &newGeometry, const QRectF &oldGeometry)
+{
+	QQuickItem::geometryChange(newGeometry, oldGeometry);
+	if (newGeometry.size() != oldGeometry.size())
+		relayout();
+}
+#else
+void KColorCircleHsvItem::geometryChanged(const QRectF &newGeometry, const QRectF &oldGeometry)
+{
+	QQuickItem::geometryChanged(newGeometry, oldGeometry);
+	if (newGeometry.size() != oldGeometry.size())
+		relayout();
+}
+#endif
+
+void KColorCircleHsvItem::itemChange(ItemChange change, const ItemChangeData &value)
+{
+	QQuickItem::itemChange(change, value);
+	if (change == ItemSceneChange || change == ItemDevicePixelRatioHasChanged)
+		relayout();
+}
+
+
+// ***************** 鼠标 mouse
+
+bool KColorCircleHsvItem::pointChanged(const QPointF &point)
+{
+	KHsvF hsv = m_hsv;
+	if (m_selMode == KColorCircleHsv::SelCircle)
+	{
+		hsv.h = KColorCircleHsv::hueAt(point, QRect(QPoint(0, 0), m_imageSize));
+		setHue(KHsvF::wholeHue(hsv.h));
+	}
+	else if (m_selMode == KColorCircleHsv::SelTriangle)
+	{
+		QPointF fpos = KColorCircleHsv::clampToTriangle(point, m_vertices[0], m_vertices[1],
+														m_vertices[2]);
+		m_svTransform.toSv(&fpos, &hsv.s, &hsv.v, 1);
+	}
+	else
+		return false;
+
+	m_svTransform.toPoints(&hsv.s, &hsv.v, &m_selectorPos, 1);
+	markDirty(DirtyTransforms);
+	if (hsv == m_hsv)
+		return false;
+	m_hsv = hsv;
+	return true;
+}
+
+void KColorCircleHsvItem::mousePressEvent(QMouseEvent *e)
+{
+	QPointF fpos = mapToImage(eventPos(e));
+	QPointF center = QRect(QPoint(0, 0), m_imageSize).center();
+	QPointF d = fpos - center;
+	if (sqrt(d.x() * d.x() + d.y() * d.y()) > m_nOuterRadius - m_dRingWidth)
+		m_selMode = KColorCircleHsv::SelCircle;
+	else if (KColorCircleHsv::triangleContains(fpos, m_vertices[0], m_vertices[1], m_vertices[2]))
+		m_selMode = KColorCircleHsv::SelTriangle;
+	else
+	{
+		// 没点中圆环和三角形, 让下面的项处理
+		// missed both the ring and the triangle, leave it to the items below
+		m_selMode = KColorCircleHsv::None;
+		e->ignore();
+		return;
+	}
+
+	if (pointChanged(fpos))
+		emit colorChanged(color());
+	e->accept();
+}
+
+void KColorCircleHsvItem::mouseMoveEvent(QMouseEvent *e)
+{
+	if (pointChanged(mapToImage(eventPos(e))))
+		emit colorChanged(color());
+}
+
+void KColorCircleHsvItem::mouseReleaseEvent(QMouseEvent *)
+{
+	if (m_selMode != KColorCircleHsv::None)
+		emit colorCommitted(color());
+	m_selMode = KColorCircleHsv::None;
+}
+
+
+// ***************** 光栅化和节点 rasterising and nodes
+
+// GUI线程: 只重画变了的图块
+// GUI thread: only the sprites that changed are drawn again
+void KColorCircleHsvItem::updatePolish()
+{
+	if (m_imageSize.isEmpty() || m_nOuterRadius <= 0)
+		return;
+
+	if (m_nRasterDirty & DirtyRing)
+	{
+		m_imgRing = KColorCircleHsv::sharedRing(m_imageSize, m_dPixelRatio, m_nOuterRadius,
+												m_dRingWidth, m_background.rgb());
+	}
+	if ((m_nRasterDirty & DirtyTriangle) && m_nTriangleHue != m_nCurrentHue)
+	{
+		KColorCircleHsv::TriangleGeometry geometry(QRect(QPoint(0, 0), m_imageSize).center(),
+												   m_nOuterRadius - m_dRingWidth);
+		m_triangle = KColorCircleHsv::renderTriangleTile(m_nCurrentHue, geometry);
+		m_nTriangleHue = m_nCurrentHue;
+	}
+	else
+		m_nRasterDirty &= ~DirtyTriangle;
+
+	QRgb lineColor, selectorColor;
+	KColorCircleHsv::markerColors(KColorCircleHsv::apexColor(m_nCurrentHue, KColorCircleHsv::ModelHsv).rgb(),
+								  &lineColor, &selectorColor);
+	// 定位线只有黑白两种, 颜色翻转时才重画
+	// the line is only black or white, drawn again only when that flips
+	if ((m_nRasterDirty & DirtyLine) && (m_imgLine.isNull() || lineColor != m_lineColor))
+	{
+		m_imgLine = KColorCircleHsv::renderLineMarker(m_dRingWidth, m_nPenWidth, lineColor,
+													  &m_lineAnchor);
+		m_lineColor = lineColor;
+	}
+	else
+		m_nRasterDirty &= ~DirtyLine;
+
+	if ((m_nRasterDirty & DirtySelector) && m_nSelectorHue != m_nCurrentHue)
+	{
+		qreal radius = (m_nSVEllipseSize + 0.5) / 2.0;
+		m_imgSelector = KColorCircleHsv::renderCircleMarker(radius, m_nPenWidth, selectorColor,
+															&m_selectorAnchor);
+		m_nSelectorHue = m_nCurrentHue;
+	}
+	else
+		m_nRasterDirty &= ~DirtySelector;
+
+	m_nNodeDirty |= m_nRasterDirty;
+	m_nRasterDirty = 0;
+}
+
+// 渲染线程, GUI线程阻塞: 只上传变了的纹理, 其余只改变换矩阵
+// render thread with the GUI thread blocked: only changed textures are
+// uploaded, everything else only changes a matrix
+QSGNode *KColorCircleHsvItem::updatePaintNode(QSGNode *oldNode, UpdatePaintNodeData *)
+{
+	KHsvItemNode *root = static_cast<KHsvItemNode *>(oldNode);
+	if (m_imgRing.isNull() || m_triangle.image.isNull())
+	{
+		delete root;
+		m_nNodeDirty |= DirtyRing | DirtyTriangle | DirtyLine | DirtySelector;
+		return 0;
+	}
+
+	QQuickWindow *win = window();
+	if (!root)
+	{
+		root = new KHsvItemNode;
+		root->ring = win->createImageNode();
+		root->triangle = win->createImageNode();
+		root->lineTransform = new QSGTransformNode;
+		root->line = win->createImageNode();
+		root->selectorTransform = new QSGTransformNode;
+		root->selector = win->createImageNode();
+		root->appendChildNode(root->ring);
+		root->appendChildNode(root->triangle);
+		root->appendChildNode(root->lineTransform);
+		root->lineTransform->appendChildNode(root->line);
+		root->appendChildNode(root->selectorTransform);
+		root->selectorTransform->appendChildNode(root->selector);
+		m_nNodeDirty |= DirtyRing | DirtyTriangle | DirtyLine | DirtySelector | DirtyTransforms;
+	}
+
+	if (m_nNodeDirty & DirtyRing)
+	{
+		setNodeImage(win, root->ring, m_imgRing,
+					 QRectF(QPointF(0, 0), QSizeF(m_imgRing.size()) / m_dPixelRatio));
+	}
+	if (m_nNodeDirty & DirtyTriangle)
+	{
+		setNodeImage(win, root->triangle, m_triangle.image,
+					 QRectF(QPointF(m_triangle.offset) / m_dPixelRatio,
+							QSizeF(m_triangle.image.size()) / m_dPixelRatio));
+	}
+	if (m_nNodeDirty & DirtyLine)
+		setNodeImage(win, root->line, m_imgLine, QRectF(QPointF(0, 0), m_imgLine.size()));
+	if (m_nNodeDirty & DirtySelector)
+		setNodeImage(win, root->selector, m_imgSelector, QRectF(QPointF(0, 0), m_imgSelector.size()));
+
+	if (m_nNodeDirty & DirtyTransforms)
+	{
+		// 定位线从纯色顶点沿半径方向穿过圆环
+		// the hue line runs outwards from the pure colour vertex across the ring
+		QPointF center = QRect(QPoint(0, 0), m_imageSize).center();
+		QPointF dir = m_vertices[0] - center;
+		QMatrix4x4 lineMatrix;
+		lineMatrix.translate(m_vertices[0].x() / m_dPixelRatio, m_vertices[0].y() / m_dPixelRatio);
+		lineMatrix.rotate(atan2(dir.y(), dir.x()) * 180.0 / HSVITEM_PI, 0, 0, 1);
+		lineMatrix.scale(1.0 / m_dPixelRatio);
+		lineMatrix.translate(-m_lineAnchor.x(), -m_lineAnchor.y());
+		root->lineTransform->setMatrix(lineMatrix);
+
+		// 与控件一样的圆心
+		// the same circle center as the widget's
+		qreal radius = (m_nSVEllipseSize + 0.5) / 2.0;
+		QPointF selCenter(m_selectorPos.x() - m_nSVEllipseSize / 2.0 + radius,
+						  m_selectorPos.y() - m_nSVEllipseSize / 2.0 + radius);
+		QMatrix4x4 selectorMatrix;
+		selectorMatrix.translate(selCenter.x() / m_dPixelRatio, selCenter.y() / m_dPixelRatio);
+		selectorMatrix.scale(1.0 / m_dPixelRatio);
+		selectorMatrix.translate(-m_selectorAnchor.x(), -m_selectorAnchor.y());
+		root->selectorTransform->setMatrix(selectorMatrix);
+	}
+	m_nNodeDirty = 0;
+	return root;
+}
+
+#endif
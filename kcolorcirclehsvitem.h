@@ -0,0 +1,113 @@
+﻿/****************************************************************************
+**
+** Copyright (C) 2013 Ken
+** All rights reserved.
+** Contact: ikenchina@gmail.com
+**
+****************************************************************************/
+#ifndef __KCOLORCIRCLEHSVITEM_H__
+#define __KCOLORCIRCLEHSVITEM_H__
+#include <QtCore/QtGlobal>
+
+#if QT_VERSION >= 0x050800
+#include <QtQuick/QQuickItem>
+#include "kcolorcirclehsv.h"
+
+
+// KColorCircleHsv的Qt Quick版本, 共用同样的光栅化.
+// 圆环和三角形是纹理节点, 定位线和定位圈是各自变换节点下的小图块, 移动定位圈只更新变换;
+// 只用QSGImageNode和QSGTransformNode, 软件场景图后端也能用
+// the Qt Quick counterpart of KColorCircleHsv, sharing its rasterisers.
+// The ring and the triangle are texture nodes, the hue line and the SV
+// selector are small sprites under their own transform nodes, so moving the
+// selector only updates a transform; only QSGImageNode and QSGTransformNode
+// are used, so the software scene graph backend works too
+class KColorCircleHsvItem : public QQuickItem
+{
+	Q_OBJECT
+	Q_PROPERTY(QColor color READ color WRITE setColor NOTIFY colorChanged)
+	Q_PROPERTY(QColor backgroundColor READ backgroundColor WRITE setBackgroundColor NOTIFY backgroundColorChanged)
+
+public:
+	explicit KColorCircleHsvItem(QQuickItem *parent = 0);
+	~KColorCircleHsvItem();
+
+	QColor color() const;
+	void setColor(const QColor &color);
+	Q_INVOKABLE void setHsvF(qreal h, qreal s, qreal v);
+
+	QColor backgroundColor() const;
+	void setBackgroundColor(const QColor &color);
+
+signals:
+	void colorChanged(const QColor &color);
+	// 松开鼠标时的最终颜色
+	// final colour on mouse release
+	void colorCommitted(const QColor &color);
+	void backgroundColorChanged(const QColor &color);
+
+protected:
+	QSGNode *updatePaintNode(QSGNode *oldNode, UpdatePaintNodeData *data);
+	void updatePolish();
+	void itemChange(ItemChange change, const ItemChangeData &value);
+#if QT_VERSION >= 0x060000
+	void geometryChange(const QRectF &newGeometry, const QRectF &oldGeometry);
+#else
+	void geometryChanged(const QRectF &newGeometry, const QRectF &oldGeometry);
+#endif
+	void mousePressEvent(QMouseEvent *e);
+	void mouseMoveEvent(QMouseEvent *e);
+	void mouseReleaseEvent(QMouseEvent *e);
+
+private:
+	// 需要重新光栅化(GUI线程)或重新上传纹理(渲染线程)的部分
+	// the parts to rasterise again (GUI thread) or upload again (render thread)
+	enum DirtyFlag
+	{
+		DirtyRing = 0x1,
+		DirtyTriangle = 0x2,
+		DirtyLine = 0x4,
+		DirtySelector = 0x8,
+		DirtyTransforms = 0x10
+	};
+
+	void relayout();
+	void setHue(int hue);
+	bool pointChanged(const QPointF &point);
+	QPointF mapToImage(const QPointF &pos) const;
+	void markDirty(int flags);
+
+	KHsvF m_hsv;
+	int m_nCurrentHue;
+	QColor m_background;
+
+	// 图像坐标(设备像素)中的几何
+	// geometry in image coordinates (device pixels)
+	qreal m_dPixelRatio;
+	QSize m_imageSize;
+	int m_nOuterRadius;
+	qreal m_dRingWidth;
+	int m_nPenWidth;
+	int m_nSVEllipseSize;
+	QPointF m_vertices[3];		// 纯色, 黑, 白 pure colour, black, white
+	KColorCircleHsv::SvTransform m_svTransform;
+	QPointF m_selectorPos;
+	KColorCircleHsv::ESelectMode m_selMode;
+
+	// updatePolish中光栅化, updatePaintNode中上传
+	// rasterised in updatePolish, uploaded in updatePaintNode
+	int m_nRasterDirty;
+	int m_nNodeDirty;
+	QImage m_imgRing;
+	KColorCircleHsv::TriangleTile m_triangle;
+	int m_nTriangleHue;
+	QImage m_imgLine;
+	QPointF m_lineAnchor;
+	QRgb m_lineColor;
+	QImage m_imgSelector;
+	QPointF m_selectorAnchor;
+	int m_nSelectorHue;
+};
+
+#endif
+#endif
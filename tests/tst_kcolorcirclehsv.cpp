@@ -0,0 +1,183 @@
+﻿/****************************************************************************
+**
+** Copyright (C) 2013 Ken
+** All rights reserved.
+** Contact: ikenchina@gmail.com
+**
+****************************************************************************/
+
+/* 正确性测试(QtTest), 在offscreen平台上运行; 性能见bench/.
+ * Correctness tests (QtTest), run on the offscreen platform; performance
+ * lives in bench/.
+ *
+ * build : compile together with ../kcolorcirclehsv.cpp (QtGui / QtWidgets, QtTest)
+ * usage : tst_kcolorcirclehsv [QtTest options]
+ */
+
+#include "../kcolorcirclehsv.h"
+
+#include <QtCore/QtGlobal>
+#include <QtCore/QAtomicInt>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QEventLoop>
+#include <QtCore/QThread>
+#include <QtCore/QVector>
+#include <QtTest/QtTest>
+#if QT_VERSION >= 0x050000
+#include <QtWidgets/QApplication>
+#else
+#include <QtGui/QApplication>
+#endif
+
+
+// 连续向信箱写入s == v的颜色; 所有写入者写完后一起再写最后一个s = v = 1的颜色,
+// 最后显示的必须是其中之一
+// posts colours with s == v to the mailbox; once every writer is done they
+// all post a final colour with s = v = 1 at once, and what ends up shown
+// must be one of those
+class KHsvMailboxWriter : public QThread
+{
+public:
+	KHsvMailboxWriter(KColorCircleHsv *w, int index, int writers, QAtomicInt *arrived)
+		: m_w(w), m_nIndex(index), m_nWriters(writers), m_arrived(arrived) {}
+	
+	enum { Posts = 50000 };
+	
+protected:
+	void run()
+	{
+		for (int i = 0; i < Posts; ++i)
+		{
+			const qreal x = ((i * 7 + m_nIndex * 13) % 90) / 100.0;
+			m_w->postHsvF(m_nIndex * 10 + i % 10, x, x);
+		}
+		m_arrived->fetchAndAddOrdered(1);
+		while (m_arrived->fetchAndAddOrdered(0) < m_nWriters)
+			QThread::yieldCurrentThread();
+		m_w->postHsvF(m_nIndex, 1.0, 1.0);
+	}
+	
+private:
+	KColorCircleHsv *m_w;
+	int m_nIndex, m_nWriters;
+	QAtomicInt *m_arrived;
+};
+
+
+// 以友元访问控件的私有成员
+// reaches the widget's private members as a friend
+class KColorCircleHsvTest : public QObject
+{
+	Q_OBJECT
+	
+private slots:
+	void wrapHue();
+	void mailbox();
+#if QT_VERSION >= 0x050c00
+	void deepRing();
+#endif
+};
+
+
+// 色相折回: 多个周期和负数
+// hue wrapping: several periods and negative hues
+void KColorCircleHsvTest::wrapHue()
+{
+	QCOMPARE(KHsvF::wrapHue(720.0), 0.0);
+	QVERIFY(qAbs(KHsvF::wrapHue(-370.0) - 350.0) < 1e-9);
+	QVERIFY(qAbs(KHsvF::wrapHue(1085.5) - 5.5) < 1e-9);
+	QVERIFY(KHsvF::wrapHue(-1e-20) < 360.0);
+}
+
+
+// 多个写入者, 比信箱的槽多, 满了也不等待: 显示的颜色从不撕裂, 最后显示的是最后写入的
+// more writers than the mailbox has slots, so it also fills up without
+// waiting: the shown colour is never torn, and the last one posted is what
+// ends up shown
+void KColorCircleHsvTest::mailbox()
+{
+	enum { Writers = 24 };
+	KColorCircleHsv w;
+	w.setThreadedRendering(false);
+	w.resize(200, 200);
+	
+	QAtomicInt arrived;
+	QVector<KHsvMailboxWriter *> writers;
+	for (int k = 0; k < Writers; ++k)
+		writers.append(new KHsvMailboxWriter(&w, k, Writers, &arrived));
+	for (int k = 0; k < Writers; ++k)
+		writers.at(k)->start();
+	
+	qreal h, s, v;
+	bool torn = false, running = true;
+	while (running)
+	{
+		QApplication::processEvents();
+		w.getHsvF(&h, &s, &v);
+		torn |= s != v;
+		running = false;
+		for (int k = 0; k < Writers; ++k)
+			running |= writers.at(k)->isRunning();
+	}
+	for (int k = 0; k < Writers; ++k)
+		writers.at(k)->wait();
+	qDeleteAll(writers);
+	
+	// 帧定时器取走剩下的
+	// the frame timer takes what is left
+	QElapsedTimer timer;
+	timer.start();
+	while (w.m_mailboxTimer.isActive() && timer.elapsed() < 1000)
+		QApplication::processEvents(QEventLoop::AllEvents, 20);
+	QApplication::processEvents();
+	
+	w.getHsvF(&h, &s, &v);
+	QVERIFY2(!torn, "no torn colour");
+	QVERIFY2(s == 1.0 && v == 1.0 && h >= 0.0 && h < Writers && h == (int) h,
+			 "the last posted colour is shown");
+}
+
+
+// RGBA64的圆环不量化到8位: 每个通道多于256种值
+// the RGBA64 ring is not quantised to 8 bits: more than 256 values per channel
+#if QT_VERSION >= 0x050c00
+void KColorCircleHsvTest::deepRing()
+{
+	QImage img(600, 600, QImage::Format_RGBA64);
+	img.fill(0);
+	KColorCircleHsv::drawRing(&img, QPoint(300, 300), 290.0, 260.0, qRgb(0, 0, 0), 0, -1,
+							  KColorCircleHsv::ModelHsv);
+	
+	QVector<bool> seen(3 * 65536, false);
+	int distinct[3] = { 0, 0, 0 };
+	for (int y = 0; y < img.height(); ++y)
+	{
+		const QRgba64 *line = reinterpret_cast<const QRgba64 *>(img.constScanLine(y));
+		for (int x = 0; x < img.width(); ++x)
+		{
+			const quint16 c[3] = { line[x].red(), line[x].green(), line[x].blue() };
+			for (int k = 0; k < 3; ++k)
+			{
+				if (!seen[k * 65536 + c[k]])
+				{
+					seen[k * 65536 + c[k]] = true;
+					++distinct[k];
+				}
+			}
+		}
+	}
+	QVERIFY(distinct[0] > 256 && distinct[1] > 256 && distinct[2] > 256);
+}
+#endif
+
+
+int main(int argc, char **argv)
+{
+	if (qgetenv("QT_QPA_PLATFORM").isEmpty())
+		qputenv("QT_QPA_PLATFORM", "offscreen");
+	QApplication app(argc, argv);
+	KColorCircleHsvTest test;
+	return QTest::qExec(&test, argc, argv);
+}
+
+#include "tst_kcolorcirclehsv.moc"